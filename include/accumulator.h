@@ -0,0 +1,31 @@
+#ifndef _ACCUMULATOR_H_
+#define _ACCUMULATOR_H_
+
+#include "common.h"
+#include "compiler.h"
+
+namespace Accumulator {
+  /*  Rewrites let-bound functions that combine the result of calling
+      themselves with +, *, && or ||, and have nothing left to do after
+      that, into ones that pass the partial result along instead:
+
+        let sum = fn (n) => { if (n == 0) { 0 } else { n + sum(n - 1) + 1 } };
+
+      becomes
+
+        let sum.acc = fn (n, acc) => { if (n == 0) { 0 + acc } else { sum.acc(n - 1, n + 1 + acc) } };
+        let sum = fn (n) => { sum.acc(n, 0) };
+
+      so the recursive calls are tail calls, which LLVM turns into a loop.
+      Only functions whose every non-recursive result is a number (for + and
+      *) or a boolean (for && and ||) are rewritten, which makes the
+      operators associative. The operands moved into the accumulator (all
+      others for + and *, the ones after the call for && and ||) have to be
+      of that type too, since + on strings isn't commutative, and can't
+      call, print, divide or bind anything, so evaluating them earlier
+      isn't observable.
+  */
+  void transform(std::unique_ptr<AST::Term>& root);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef _ANALYSIS_H_
+#define _ANALYSIS_H_
+
+#include "common.h"
+#include "compiler.h"
+#include <map>
+#include <set>
+#include <unordered_map>
+
+// Analyses over the AST, run before (or during) code generation
+namespace Analysis {
+  /*  The names bound where a walk over the AST is, each to the Let or
+      Function node that bound it (or whatever else a pass wants to know
+      about it). Lookups don't depend on how many names are bound, so long
+      sequences of lets are walked in linear time.
+  */
+  class Scope {
+    std::unordered_map<std::string, std::vector<std::pair<const AST::Term*, size_t>>> bindings;
+    std::vector<const std::string*> names;    // In the order they were bound
+  public:
+    void push(const std::string& name, const AST::Term* binding);
+    void pop();
+    size_t size() const { return names.size(); }
+    // Unbinds the names bound since there were n
+    void resize(size_t n);
+    // nullptr if name is unbound
+    const AST::Term* lookup(const std::string& name) const;
+    // How many names were bound before the binding name refers to. Bindings
+    // that enclose one another have increasing levels.
+    size_t level(const std::string& name) const;
+  };
+
+  // Names a function's body refers to that are not bound inside of it (by its
+  // parameters or by a let), in order of first occurrence. These are what a
+  // closure created from fn has to capture.
+  std::vector<std::string> free_variables(AST::Function* fn);
+  // Same as above, for any term
+  std::vector<std::string> free_variables(AST::Term* term);
+
+  // Operators are left associative, so chains of them (e.g. a + b + c) nest
+  // through lhs. Appends binary and the binaries nested in its lhs, from the
+  // outermost in. Walks can then start at the innermost lhs and go back out
+  // through the right operands, without recursing once per operator.
+  void unchain(AST::Binary* binary, std::vector<AST::Binary*>& chain);
+
+  // Rough cost of evaluating term, in AST nodes. Function bodies are not
+  // counted, and a call counts as call_cost since its callee's work is not
+  // known here.
+  constexpr uint32_t call_cost = 32;
+  uint32_t cost(AST::Term* term);
+
+  // Hash of term's structure: node kinds, names, literals and operators,
+  // but not where they are in the source, so terms that only differ in
+  // whitespace or comments hash the same
+  uint64_t structural_hash(AST::Term* term);
+
+  // A binding in the sequence of lets a program starts with
+  struct TopLevelBinding {
+    // The bound name, with #2, #3... appended when it was bound before (e.g.
+    // "_" in `let _ = print(x);`). The term after the lets is "<main>".
+    std::string key;
+    uint64_t hash;                  // Of the bound term (see structural_hash)
+    std::vector<size_t> uses;       // Earlier bindings it refers to
+  };
+  std::vector<TopLevelBinding> top_level_bindings(AST::Term* program);
+
+  /*  Which terms can be evaluated without observable effects, i.e. without
+      reaching a print. A call is resolved by name to the function literal
+      bound to that name where the call is; calling anything else (e.g. a
+      parameter) is assumed to print. Function literals start out pure and
+      become impure if their body isn't, until nothing changes, so
+      recursion doesn't make a function impure.
+  */
+  class Effects {
+    std::map<const AST::Call*, const AST::Function*> call_targets;
+    std::set<const AST::Function*> impure_fns;
+
+    bool mayPrint(const AST::Term* term) const;
+  public:
+    Effects(AST::Term* root);
+    bool isPure(const AST::Term* term) const;
+    // Makes copy (a clone of original) answer the same as original
+    void copy(AST::Term* original, AST::Term* copy);
+  };
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include "common.h"
+#include "llvm/IR/Module.h"
+
+namespace Backend {
+  // Registers the native target. Done on first use, or ahead of time by the
+  // compile server so that requests don't have to.
+  void initialize();
+
+  /*  Emits module as a native object file. The module is split into
+      partitions (by function, see llvm::SplitModule) that are compiled on up
+      to jobs threads, each with its own LLVMContext, and then merged into a
+      single object with `ld -r` ($LD overrides the linker).
+
+      The number of partitions only depends on the module, so the object is
+      the same no matter how many jobs are used. Consumes module.
+  */
+  void emit_object(llvm::Module& module, const std::string& out_file, uint32_t jobs);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _CLIENT_H_
+#define _CLIENT_H_
+
+// Client side of the compile server (see include/server.h). Plain C, so the
+// thin client (src/vladpiler_client.c) doesn't have to load LLVM.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Has the server at socket_path run vladpiler with the given arguments (not
+// including the program name), in this process' working directory and with
+// its stdout and stderr. Returns the exit status.
+int client_compile(const char* socket_path, int argc, char* const argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,7 +2,11 @@
 #define _COMPILER_H_
 
 #include "common.h"
+#include <deque>
+#include <functional>
+#include <set>
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
@@ -28,8 +32,11 @@ namespace AST {
     OR
   };
 
+  // 1-based position in the source. Line 0 means unknown (e.g. terms
+  // created by passes).
   struct Localization {
     uint64_t beginLine;
+    uint64_t beginColumn;
   };
 
   /* Will consider smarter ways to include this data inside of
@@ -47,7 +54,18 @@ namespace AST {
   
   struct Term : virtual Symbol {
     virtual llvm::Value* getVal() {return nullptr;};
+    // Appends the slots holding this term's direct subterms, in evaluation
+    // order. Passes may replace the terms through the returned slots.
+    virtual void getChildren(std::vector<std::unique_ptr<Term>*>& children) {};
+    // Deep copy, for passes that duplicate code (e.g. inlining)
+    virtual Term* clone() {return nullptr;};
     Term() = default;
+
+    // Where the term starts, set by the parser
+    Localization loc = {0, 0};
+  protected:
+    // Gives a copy made by clone() this term's location
+    Term* withLoc(Term* copy) const {copy->loc = loc; return copy;}
   };
 
   struct File : Symbol {
@@ -66,12 +84,14 @@ namespace AST {
     int32_t value;    
     Int(int64_t _value);
     llvm::Value* getVal() override;
+    Term* clone() override;
   };
 
   struct Str : Term {
     std::unique_ptr<std::string> str;
     Str(std::string* _str);
     llvm::Value* getVal() override;
+    Term* clone() override;
   };
 
   struct Arguments: Symbol {
@@ -87,6 +107,8 @@ namespace AST {
     Call(std::string* _callee, Arguments* _args);    
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct Binary : Term {
@@ -97,6 +119,10 @@ namespace AST {
     Binary(Term* _lhs, Term* _rhs, BinOp _binop);
 
     llvm::Value* getVal() override;
+    // Generates the operation itself on already evaluated operands
+    llvm::Value* apply(llvm::Value* lhs_val, llvm::Value* rhs_val);
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct Parameter: Symbol {
@@ -119,6 +145,10 @@ namespace AST {
     Function(Parameters* _parameters, Term* _value);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    // Same as getVal, for a function bound by let (so it may call itself)
+    llvm::Value* getNamedVal(const std::string& name);
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
 
   };
 
@@ -132,6 +162,8 @@ namespace AST {
       Term* _next);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct If : Term {
@@ -144,6 +176,8 @@ namespace AST {
       Term* _orElse);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
 
@@ -153,6 +187,8 @@ namespace AST {
     Print(Term* _arg);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct First : Term {
@@ -161,6 +197,8 @@ namespace AST {
     First(Term* _arg);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct Second : Term {
@@ -169,6 +207,8 @@ namespace AST {
     Second(Term* _arg);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct Bool : Term {
@@ -177,6 +217,7 @@ namespace AST {
     Bool(bool _val);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
   };
 
   struct Tuple : Term {
@@ -186,6 +227,8 @@ namespace AST {
     Tuple(Term* first, Term* second);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
+    void getChildren(std::vector<std::unique_ptr<Term>*>& children) override;
   };
 
   struct Var : Term {
@@ -194,20 +237,44 @@ namespace AST {
     Var(std::string* name);
 
     llvm::Value* getVal() override;
+    Term* clone() override;
   };
 }
 
+namespace Analysis {
+  class Effects;
+}
+
 namespace Compiler {
 
+    // Everything about a function that is known from its AST node alone
     struct ClosureSignature {
+      std::string name;                   // Names the specializations
+      std::string self_name;              // Let-bound functions may call themselves
       std::vector<std::string> params;
       AST::Term* fn_body;
+      std::vector<std::string> captures;  // Free variables bound where the function is defined
+      AST::Localization loc;              // Where the function is defined
     };
 
+    struct Closure;
     
     struct EitherValOrClosure {
       llvm::Value* val;
-      ClosureSignature* closureSig;
+      Closure* closure;   // Set when val is a closure (val is then its marker)
+    };
+
+    /*  A closure value: a signature plus the values captured when it was
+        created, one entry per capture. Captured closures are kept as closures,
+        so a call through them can still be resolved at compile time.
+
+        The marker is the llvm::Value the rest of the code generator sees in
+        place of the closure (see closure_table).
+    */
+    struct Closure {
+      ClosureSignature* sig;
+      std::vector<EitherValOrClosure> env;
+      llvm::Value* marker;
     };
 
   // Keeps track of scoped symbols
@@ -221,22 +288,75 @@ namespace Compiler {
     // Get functions may return nullptr if a corresponding value is not found
     EitherValOrClosure* getValue(const std::string& id);
     void insertValue(const std::string& name, llvm::Value* value);
-    void insertClosure(const std::string& name, ClosureSignature* closure_sig);
+    void insertClosure(const std::string& name, Closure* closure);
     void pushScope();
     void popScope();
   };
 
-  int compile(const std::string& input_file, const std::string& output_file);
+  enum class RuntimeKind {
+    LIBC,       // Embedded runtime bitcode, linked into the generated module
+    MINIMAL,    // Embedded libc-free runtime with its own _start (link with -static -nostdlib)
+    EXTERNAL    // Runtime left as external symbols (link build/rinha_extern.o)
+  };
+
+  enum class EmitKind {
+    LL,         // Textual LLVM IR
+    OBJ         // Native object file, generated on several threads (see Backend::emit_object)
+  };
+
+  struct CompileOptions {
+    // Count calls and time spent in each closure specialization
+    bool instrument = false;
+    RuntimeKind runtime = RuntimeKind::LIBC;
+    // LLVM optimization level (0-3) of the pipeline run on the generated module
+    uint32_t opt_level = 2;
+    // Largest function body (in AST nodes) inlined at its call sites. 0 disables inlining.
+    uint32_t inline_threshold = 16;
+    // Evaluate repeated pure terms once (see CSE::eliminate)
+    bool cse = true;
+    // Pass partial results of self-recursive functions along, so they
+    // recurse through tail calls (see Accumulator::transform)
+    bool accumulate = true;
+    // Evaluate pure operands in parallel when both cost at least parallel_cutoff
+    // (see Analysis::cost)
+    bool parallel = false;
+    uint32_t parallel_cutoff = 32;
+    // Specializations of a function before calls to it start sharing a more
+    // generic one (see RinhaCompiler::getSpecialization). 0 means no limit.
+    uint32_t specialization_budget = 16;
+    // Check the IR before and after optimizing it
+    bool verify = false;
+    // Optimization remarks of the passes matching remarks_filter (a regex, all
+    // of them if empty) are written to remarks_file, as yaml or bitstream
+    std::string remarks_file;
+    std::string remarks_filter;
+    std::string remarks_format = "yaml";
+    // Emit DWARF line tables mapping the generated code to Rinha source lines
+    bool debug_info = false;
+    EmitKind emit = EmitKind::LL;
+    // Threads used to generate object code. 0 uses one per CPU.
+    uint32_t jobs = 0;
+    // Scan the source on a thread of its own while it's parsed (see
+    // Lexer::start_pipeline)
+    bool pipelined_lexer = false;
+    // Called with the program once it's parsed. If it returns false, nothing
+    // is compiled (see Watch::changed).
+    bool (*after_parse)(AST::Term* program) = nullptr;
+  };
+
+  int compile(const std::string& input_file, const std::string& output_file, const CompileOptions& options = {});
   const std::string& get_rinha_filename();
   void set_ast_file(AST::File* file);
 
   class RinhaCompiler {
+  public:
+    using BinaryOp = std::function<llvm::Value*(llvm::Value*, llvm::Value*)>;
   private:
 
     // Fortunately tuples are immutable or else we would have problems
     struct TuplePtrIds{
-      std::string* first_ptr_id;    // Assign nullptr if first/second  is not a ptr
-      std::string* second_ptr_id;
+      std::string first_ptr_id;     // Empty if first/second is not a ptr
+      std::string second_ptr_id;
     };
 
     
@@ -248,6 +368,8 @@ namespace Compiler {
     llvm::Module module;
 
     const std::string& filename;
+    const CompileOptions options;
+    llvm::Function* main_fn;
     std::unique_ptr<AST::File> ast_root;
     llvm::Type* const default_type;
 
@@ -277,6 +399,11 @@ namespace Compiler {
     std::map<llvm::Value*, std::string> ptr_id_table;
     std::map<std::string, llvm::Type*> ptr_type_table;
     std::map<std::string, TuplePtrIds> tuple_ptr_types;
+    // Numbers the ids of tuples, since instruction names only are unique
+    // within their function
+    uint64_t n_tuple_ids = 0;
+    // Cells of lists laid out in one block, and the cell after each of them
+    std::map<llvm::Value*, llvm::Value*> next_cells;
 
     enum class SpecialValue {
       UNDEFINED = 1,
@@ -285,35 +412,198 @@ namespace Compiler {
 
     std::map<llvm::Value*, SpecialValue> special_value_table;
 
+    // Literals are interned, so equal literals share the same global and can
+    // be compared by address. Each literal also gets a constant runtime string
+    // (see rinha_extern.h) that is created the first time it's needed.
+    struct StrLiteral {
+      llvm::GlobalVariable* chars;
+      llvm::Constant* rstr;
+    };
+
+    llvm::StructType* str_type;
+    std::map<std::string, StrLiteral> str_literal_table;
+
     struct ClosureInstanceNode {
       llvm::Function* fn;
-      std::map<llvm::Type*,std::shared_ptr<ClosureInstanceNode>> children;
+      std::map<const void*, std::shared_ptr<ClosureInstanceNode>> children;
     };    
 
+    /*  Closures are converted to flat functions: every specialization takes
+        the argument values, then the values captured by the closure (nested
+        closures flattened in place), and returns its value directly. They
+        use the fast calling convention, since only this module calls them.
+        Since the closure behind each call is known at compile time, calls
+        are always direct and the environment is passed in registers.
+
+        A closure only needs a runtime representation when it's stored in a
+        tuple or returned: then its flattened environment is copied to a heap
+        record (see materializeClosure), and closure_shapes remembers how to
+        rebuild the closure from that record.
+
+        Specializations are cached by a key made of the argument types and
+        the shape of the environment (see appendClosureKey).
+    */
     std::map<llvm::Function*, llvm::Type*> fn_ret_table;
-    std::map<llvm::Value*, ClosureSignature> closure_table;
-    std::map<std::string, std::map<llvm::Type*, std::shared_ptr<ClosureInstanceNode>>> closure_cache;
+    std::map<llvm::Function*, Closure*> fn_ret_closure;
+    std::map<AST::Function*, ClosureSignature> closure_sigs;
+    std::deque<Closure> closures;
+    std::map<llvm::Value*, Closure*> closure_table;
+    std::map<std::string, Closure*> closure_shapes;
+    std::map<ClosureSignature*, std::shared_ptr<ClosureInstanceNode>> closure_cache;
+    // Every specialization in the order they were created, with its cache entry
+    std::vector<std::pair<std::shared_ptr<ClosureInstanceNode>, llvm::Function*>> specializations;
+    std::set<llvm::Function*> incomplete_fns;
+    uint64_t n_provisional_calls = 0;   // Calls generated to incomplete_fns
+    // Live specializations of each function, for --specialization-budget
+    std::map<ClosureSignature*, uint32_t> n_specializations;
+    std::map<llvm::Function*, ClosureSignature*> specialization_sigs;
+    std::set<ClosureSignature*> over_budget;
+    uint64_t n_closure_records = 0;
+
+    // --instrument: one rinha_prof_entry (see rinha_extern.h) per closure
+    // specialization. Registered with the runtime in finalizeInstrumentation.
+    llvm::StructType* prof_entry_type = nullptr;
+    std::vector<std::pair<llvm::Function*, llvm::GlobalVariable*>> prof_entries;
+
+    /*  --parallel: a forked operand becomes a closure with no parameters (a
+        thunk), so its specialization takes whatever it refers to as leaves.
+        Its task entry point receives a rinha_task (see rinha_extern.h)
+        followed by the result slot and the leaves, and calls it.
+    */
+    std::unique_ptr<Analysis::Effects> effects;
+    std::map<AST::Term*, std::unique_ptr<AST::Function>> fork_thunks;
+    std::map<llvm::Function*, llvm::Function*> task_entries;
+    llvm::StructType* task_type = nullptr;
+    uint32_t n_sequential_copies = 0;   // Generating a copy that must not fork
+
+    /*  Tuples are built in allocas, which die with the function that built
+        them. One that has to outlive it (a function's result, or captured
+        by a closure that escapes) is moved to the heap, where it has a
+        reference count (see rinha_extern.h). References are owned by the
+        region of code that got them (a function, or a branch of an if,
+        &&/|| or fork) and dropped when it ends, except for the region's
+        result, which goes to the enclosing one (a function's to its caller).
+
+        A region's result that has to be moved to the heap is built from
+        what the region drops: a tuple of the same type dropped for the last
+        time is reused in place (see buildTuple), so recursions that turn a
+        tuple into another one keep reusing the same memory.
+    */
+    std::set<llvm::Value*> heap_tuples;
+    // What each tuple built in an alloca holds
+    std::map<llvm::Value*, std::pair<llvm::Value*, llvm::Value*>> tuple_elements;
+    // References owned by the code being generated, innermost region last
+    std::vector<std::vector<llvm::Value*>> tuple_regions;
+
+    // How to build a tuple on the heap: either a value stored as is, or a
+    // new tuple of the given type
+    struct TuplePlan {
+      llvm::Value* val;
+      llvm::StructType* type = nullptr;
+      std::unique_ptr<TuplePlan> first, second;
+    };
+
+    /*  --debug-info: main and every specialization get a subprogram starting
+        at the line of the function they were compiled from, and instructions
+        get the location of the term they were generated for (see
+        LocationScope). Types aren't described, so debuggers can only show
+        lines.
+    */
+    std::unique_ptr<llvm::DIBuilder> di_builder;
+    llvm::DIFile* di_file = nullptr;
+    llvm::DISubroutineType* di_fn_type = nullptr;
    
     void printType(llvm::Type* val);
     void printType(llvm::Value* val);
 
-    RinhaCompiler(const std::string& input_file);
+    RinhaCompiler(const std::string& input_file, const CompileOptions& options);
     // llvm::Function* lookForCosureInstance(const ClosureSignature& closure_sig, const std::vector<llvm::Value*>& args);
-    void _insertCachedClosure(const std::vector<llvm::Type*>& params, uint64_t param_it, std::shared_ptr<ClosureInstanceNode> node, llvm::Function* fn);
-    void insertCachedClosure(const std::string& name, llvm::Function* fn);
-    llvm::Function* _getCachedClosure(const std::vector<llvm::Type*>& args, uint64_t args_it, std::shared_ptr<ClosureInstanceNode> instance_it);
-    llvm::Function* getCachedClosure(const std::string& name, const std::vector<llvm::Type*> args);
+    void _insertCachedClosure(const std::vector<const void*>& key, uint64_t key_it, std::shared_ptr<ClosureInstanceNode> node, llvm::Function* fn);
+    void insertCachedClosure(ClosureSignature* sig, const std::vector<const void*>& key, llvm::Function* fn);
+    llvm::Function* _getCachedClosure(const std::vector<const void*>& key, uint64_t key_it, std::shared_ptr<ClosureInstanceNode> instance_it);
+    llvm::Function* getCachedClosure(ClosureSignature* sig, const std::vector<const void*>& key);
+    void appendValueKey(llvm::Value* val, std::vector<const void*>& key);
+    // In a generic specialization, captured constants that are numbers or
+    // booleans are passed like any other value instead of being part of the key
+    bool isKeyedConstant(llvm::Value* val, bool generic);
+    void appendClosureKey(Closure* closure, std::vector<const void*>& key, bool generic = false);
+    void appendClosureLeaves(Closure* closure, std::vector<llvm::Value*>& leaves, bool generic = false);
+    Closure* rebuildClosure(Closure* shape, std::vector<llvm::Value*>::const_iterator& leaf, bool generic = false);
+    llvm::Value* materializeClosure(Closure* closure);
+    llvm::Value* loadClosure(Closure* shape, llvm::Value* record);
+    void enterRegion();
+    // Drops the references owned by the innermost region. If result is a
+    // tuple that has to outlive them (always if own), it's replaced by a
+    // reference the caller owns and true is returned.
+    bool leaveRegion(llvm::Value*& result, bool own);
+    void keepTuple(llvm::Value* tuple);
+    // A new reference to tuple, moving it to the heap if it isn't there
+    llvm::Value* ownTuple(llvm::Value* tuple);
+    // Loads what has to be copied and dups what's already on the heap.
+    // References in owned are moved instead.
+    std::unique_ptr<TuplePlan> planTuple(llvm::Value* tuple, std::vector<llvm::Value*>& owned);
+    // Reuses (and drops) references in owned for the new tuples
+    llvm::Value* buildTuple(TuplePlan& plan, std::vector<llvm::Value*>& owned);
+    // Returns the tuple if it was the last reference and reuse is set, null otherwise
+    llvm::Value* dropTuple(llvm::Value* tuple, bool reuse);
+    llvm::Value* loadTupleElement(llvm::Value* tuple, uint32_t i);
+    llvm::Value* createClosureMerge(Closure* then_closure, llvm::BasicBlock* then_end, Closure* else_closure, llvm::BasicBlock* else_end);
+    llvm::Value* callKnownClosure(Closure* closure, std::vector<llvm::Value*>& args);
+    // Specialization of closure for args, plus the values to call it with
+    llvm::Function* getSpecialization(Closure* closure, std::vector<llvm::Value*>& args, std::vector<llvm::Value*>& leaves);
+    llvm::Function* createSpecialization(Closure* closure, const std::vector<llvm::Value*>& args, const std::vector<const void*>& key, const std::vector<llvm::Value*>& leaves, bool generic);
+    // Whether calls to sig should go to generic specializations
+    bool isOverBudget(ClosureSignature* sig);
+    void discardSpecializations(uint64_t first);
+    // Result of a call to a function whose body (and return type) is not done yet
+    bool isProvisional(llvm::Value* val);
+    // Allocas in the entry block are static and can be promoted to registers
+    llvm::AllocaInst* createEntryAlloca(llvm::Type* type, const std::string& name);
+    void copyPtrId(llvm::Value* from, llvm::Value* to);
     llvm::FunctionType* getDefaultFnType(uint32_t n_args);
     llvm::Function* createMain();
+    void initializeDebugInfo();
+    // Gives fn a subprogram starting at loc and points the builder at it.
+    // Returns the location to restore once done generating fn.
+    llvm::DebugLoc enterFunction(llvm::Function* fn, const std::string& name, const AST::Localization& loc);
     llvm::Value* createTupleDescriptor(llvm::Value* tuple);
     llvm::Value* createUndefined();
     
     inline bool is32Int(llvm::Value*);
     inline bool isInt(llvm::Value*);    
     inline bool isBool(llvm::Value*);
+    bool isStrLiteral(llvm::Value*);
+    bool isRuntimeStr(llvm::Value*);
+    bool isStr(llvm::Value*);
+    bool isTuple(llvm::Value*);
+
+    // Module-private global, e.g. for constants only the generated code uses
+    llvm::GlobalVariable* createGlobal(llvm::Type* type, bool is_constant, llvm::Constant* init, const std::string& name);
+    llvm::StructType* getStrType();
+    llvm::Type* lookupPtrType(llvm::Value*);
+    std::string getStrLiteral(llvm::Value*);
+    llvm::Value* toRuntimeStr(llvm::Value*);
+    llvm::Value* createStrConcat(llvm::Value* lhs, llvm::Value* rhs);
+    llvm::Value* createStrEq(llvm::Value* lhs, llvm::Value* rhs);
 
     void printValName(llvm::Value* val);
     void printTuple(llvm::Value* tuple);
+
+    llvm::StructType* getProfEntryType();
+    llvm::Value* instrumentEntry(llvm::Function* fn);
+    void instrumentExit(llvm::Function* fn, llvm::Value* entry_tsc);
+    // Emits the table of profiling counters and registers it at the start of main
+    void finalizeInstrumentation();
+    void linkRuntime();
+    void optimize();
+    // Exits with the verifier's findings if the module is broken
+    void verify(const std::string& stage);
+
+    bool shouldFork(AST::Term* lhs, AST::Term* rhs);
+    llvm::StructType* getTaskType();
+    llvm::StructType* getTaskFrameType(llvm::Function* fn);
+    llvm::Function* getTaskEntry(llvm::Function* fn);
+    llvm::Value* createForkJoin(AST::Term* lhs, AST::Term* rhs, const BinaryOp& op);
     void _print(llvm::Value*);
     llvm::Type* getPtrType(llvm::Value*);
   public:
@@ -322,12 +612,20 @@ namespace Compiler {
       MAIN
     };
 
-    static RinhaCompiler& initialize(const std::string& input_file);
+    static RinhaCompiler& initialize(const std::string& input_file, const CompileOptions& options = {});
     static bool isInitialized();
     static RinhaCompiler& getSingleton();
 
     // Prints code to the given output file
     void printCode(const std::string& out_file);
+    // Compiles the module to a native object file. Leaves the module empty.
+    void emitObject(const std::string& out_file);
+    uint64_t getInstructionCount();
+    // Runs the passes that need the whole module, after code generation
+    void finalize();
+    // Whole-program analyses that code generation relies on. Run after the
+    // AST passes, before code generation.
+    void analyze(AST::Term* root);
 
 
     // Declare an extern function at the beginning of the module
@@ -338,6 +636,8 @@ namespace Compiler {
     llvm::Value* createInt(int32_t value);
     llvm::Value* createStr(const std::string& str);
     llvm::Value* createTuple(llvm::Value* value1, llvm::Value* value2);
+    // Tuples nested through their second element: (heads[0], (heads[1], ... tail))
+    llvm::Value* createList(const std::vector<llvm::Value*>& heads, llvm::Value* tail);
 
     llvm::Value* createAdd(llvm::Value* value1, llvm::Value* value2);
     llvm::Value* createMinus(llvm::Value* value1, llvm::Value* value2);
@@ -352,10 +652,14 @@ namespace Compiler {
     llvm::Value* createLte(llvm::Value* value1, llvm::Value* value2);
     llvm::Value* createAnd(AST::Term* value1, AST::Term* value2);
     llvm::Value* createOr(AST::Term* value1, AST::Term* value2);
+    // Evaluates lhs, then rhs (or both at once, with --parallel) and applies op
+    llvm::Value* createBinary(AST::Term* lhs, AST::Term* rhs, const BinaryOp& op);
+    // Whether createBinary would evaluate rhs on another thread
+    bool forks(AST::Term* lhs, AST::Term* rhs);
   
     bool isClosure(llvm::Value* val);
     llvm::Value* assignClosure(const std::string& name, llvm::Value* val);
-    llvm::Value* createAnonClosure(const std::vector<std::string>& params, AST::Term* fn_body);
+    llvm::Value* createAnonClosure(AST::Function* fn, const std::string& self_name = "");
     llvm::Value* createClosureVal();
     llvm::Value* callClosure(const std::string& name, std::vector<llvm::Value*>& args);
 
@@ -368,6 +672,20 @@ namespace Compiler {
     llvm::Value* getTupleFirst(llvm::Value* tuple);
     llvm::Value* getTupleSecond(llvm::Value* tuple);
     llvm::Value* print(llvm::Value*);
+
+    // Location of the instructions generated from now on, with --debug-info.
+    // Returns the previous one.
+    llvm::DebugLoc setLocation(const AST::Localization& loc);
+    void restoreLocation(const llvm::DebugLoc& loc);
+
+    // Instructions generated while it's alive get the location of a term
+    class LocationScope {
+      RinhaCompiler& compiler;
+      llvm::DebugLoc previous;
+    public:
+      LocationScope(RinhaCompiler& compiler, const AST::Localization& loc) : compiler(compiler), previous(compiler.setLocation(loc)) {}
+      ~LocationScope() { compiler.restoreLocation(previous); }
+    };
   };
 
 }
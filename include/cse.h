@@ -0,0 +1,25 @@
+#ifndef _CSE_H_
+#define _CSE_H_
+
+#include "common.h"
+#include "compiler.h"
+
+namespace CSE {
+  /*  Common-subexpression elimination on the AST, before code generation.
+      Terms are hash-consed: two terms are the same when they have the same
+      shape and every name in them refers to the same binding. When a pure
+      term (see Analysis::Effects) occurs more than once, it's bound by a let
+      right before the first term that always evaluates it (the value of a
+      let in a sequence, an if arm...), and every occurrence becomes a
+      reference to the binding.
+
+      A term is only bound where it would be evaluated before any print
+      anyway, so hoisting it doesn't reorder output even if it never
+      returns. Function bodies are handled on their own: occurrences are
+      not shared across function literals. Each value in a sequence of lets
+      is looked at once, so this takes time linear in the sequence's length.
+  */
+  void eliminate(std::unique_ptr<AST::Term>& root);
+}
+
+#endif
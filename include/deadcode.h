@@ -0,0 +1,16 @@
+#ifndef _DEADCODE_H_
+#define _DEADCODE_H_
+
+#include "common.h"
+#include "compiler.h"
+
+namespace DeadCode {
+  /*  Removes let bindings that are never referred to and whose value can't
+      print (see Analysis::Effects), so they don't generate any code. A
+      function that only refers to itself counts as unreferenced. Bindings
+      that only become dead once an inner one is removed go too.
+  */
+  void remove_bindings(std::unique_ptr<AST::Term>& root);
+}
+
+#endif
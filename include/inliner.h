@@ -0,0 +1,22 @@
+#ifndef _INLINER_H_
+#define _INLINER_H_
+
+#include "common.h"
+#include "compiler.h"
+
+namespace Inliner {
+  /*  Replaces calls to small let-bound functions with a copy of their body,
+      before code generation. A function is inlined when it's not recursive,
+      doesn't create closures itself and its body has at most threshold
+      nodes. A threshold of 0 disables inlining.
+
+      A call is only inlined when its arguments are pure (no calls or
+      prints) and every name the function captures refers to the same
+      binding at the call site. Names and literals are substituted into
+      the body (so the names they use must not be bound in it), and other
+      arguments are bound by lets around it.
+  */
+  void inline_calls(std::unique_ptr<AST::Term>& root, uint32_t threshold);
+}
+
+#endif
@@ -9,11 +9,39 @@ extern int yyleng;
 extern int yylineno;
 
 namespace Lexer {
+	// A token as the scanner matched it: its kind (0 at the end of the input),
+	// value and span, laid out like the parser's yylval and yylloc
+	struct Token {
+		int kind;
+		union {
+			int64_t int64_val;
+			std::string* str_ptr;
+		} value;
+		struct {
+			int first_line, first_column, last_line, last_column;
+		} loc;
+	};
+
+	// Where the scanner's rules put the value and span of what they match
+	extern Token scanned;
+
 	int64_t get_number(int base);
 	void get_identifier(std::string& str); 
 	void get_str(std::string& str); 
   void tokens_scanner(const std::string& filename);
 	std::string get_token_name(int token);
+
+	/*  From now on, scans yyin on a thread of its own, which hands tokens to
+	    the parser through a single-producer single-consumer ring buffer, so
+	    scanning and parsing run at the same time (see --pipelined-lexer).
+	    Does nothing on a machine with one CPU. stop_pipeline waits for the
+	    thread, whether or not the parser got to the end of the input.
+	*/
+	void start_pipeline();
+	void stop_pipeline();
+
+	// The next token for the parser, from the pipeline if it's running
+	int next_token(Token& token);
 }
 
 extern "C"
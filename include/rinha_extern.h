@@ -0,0 +1,133 @@
+#ifndef _RINHA_EXTERN_H_
+#define _RINHA_EXTERN_H_
+
+// Runtime support linked into every compiled Rinha program. Shared between
+// src/rinha_extern.c and the compiler so that both agree on data layouts.
+// Defining RINHA_MINIMAL builds the libc-free variant (--runtime=minimal).
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*  Strings are immutable and come in three flavours:
+
+    - FLAT: points to characters owned by someone else (e.g. a literal
+      emitted by the compiler as a constant global).
+    - SSO: short strings stored inline in the node itself.
+    - ROPE: concatenation of two strings. Building one is O(1), so repeated
+      concatenation inside recursions does not become quadratic. Ropes are
+      flattened lazily (and in place) when their characters are needed.
+
+    The compiler emits FLAT nodes for literals as constants of type
+    { i32 len, i32 kind, ptr, ptr }, so keep this layout in sync with
+    RinhaCompiler::getStrType.
+*/
+#define RINHA_STR_SSO_CAP 15
+
+enum rinha_str_kind {
+  RINHA_STR_FLAT = 0,
+  RINHA_STR_SSO,
+  RINHA_STR_ROPE
+};
+
+typedef struct rinha_str rinha_str;
+
+struct rinha_str {
+  uint32_t len;
+  uint32_t kind;
+  union {
+    char sso[RINHA_STR_SSO_CAP + 1];
+    struct {
+      const char* chars;
+    } flat;
+    struct {
+      rinha_str* left;
+      rinha_str* right;
+    } rope;
+  };
+};
+
+void print_undefined(void);
+void print_bool(uint8_t val);
+void print_num(int32_t val);
+void print_str(char* str);
+void print_rstr(rinha_str* str);
+void print_closure(void);
+void print_lp(void);
+void print_delim(void);
+void print_rp(void);
+void print_nl(void);
+
+// Heap memory for the generated code (e.g. environments of closures that
+// escape the function that created them). Never returns NULL.
+void* rinha_alloc(uint64_t size);
+
+/*  Tuples that outlive the function that built them live on the heap, with
+    a reference count in the word before them. The compiler inserts the
+    dups and releases, and knows the layout of every tuple, so it drops the
+    elements itself.
+
+    rinha_tuple_release returns the tuple if that was its last reference
+    (the caller then drops its elements and frees it or passes it to
+    rinha_tuple_reuse), NULL otherwise. rinha_tuple_reuse takes what
+    release returned and a size, and gives back a tuple with one reference,
+    reusing the memory if there was any.
+*/
+void* rinha_tuple_alloc(uint64_t size);
+void* rinha_tuple_reuse(void* token, uint64_t size);
+void rinha_tuple_dup(void* tuple);
+void* rinha_tuple_release(void* tuple);
+void rinha_tuple_free(void* tuple, uint64_t size);
+
+rinha_str* rinha_str_from_int(int32_t val);
+rinha_str* rinha_str_from_bool(uint8_t val);
+rinha_str* rinha_str_concat(rinha_str* lhs, rinha_str* rhs);
+uint8_t rinha_str_eq(rinha_str* lhs, rinha_str* rhs);
+
+/*  Profiling counters for programs compiled with --instrument. The compiler
+    emits one entry per closure specialization (layout must match
+    RinhaCompiler::getProfEntryType) and registers them at the start of main.
+    The report is written at exit to $RINHA_PROFILE_OUT, or stderr if unset.
+    Not available in the minimal runtime (RINHA_MINIMAL).
+*/
+typedef struct rinha_prof_entry {
+  const char* name;
+  uint64_t calls;
+  uint64_t cycles;  // Inclusive, in timestamp counter ticks
+  uint64_t depth;   // Active activations, so recursion is only timed once
+} rinha_prof_entry;
+
+void rinha_prof_init(rinha_prof_entry** table, uint32_t n_entries);
+
+/*  Fork-join tasks for programs compiled with --parallel. The compiler puts
+    each task in the stack frame of the function that forks it, followed by
+    the values it needs and a slot for its result, and sets run (layout must
+    match RinhaCompiler::getTaskType). rinha_par_fork may hand the task to
+    another thread; rinha_par_join returns once it has run, running it on
+    the calling thread if no other thread took it.
+
+    Forking only pays off when some thread is out of work, so the generated
+    code checks rinha_par_hungry (the number of such threads) first and
+    calls the task's code directly when it's zero. The pool is started by
+    the first fork, with one worker per online CPU or $RINHA_THREADS. Not
+    available in the minimal runtime.
+*/
+typedef struct rinha_task rinha_task;
+
+struct rinha_task {
+  void (*run)(rinha_task* task);
+  uint64_t state;   // Written by the runtime only
+};
+
+extern uint32_t rinha_par_hungry;
+
+void rinha_par_fork(rinha_task* task);
+void rinha_par_join(rinha_task* task);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _RUNTIME_H_
+#define _RUNTIME_H_
+
+#include "common.h"
+#include "llvm/ADT/StringRef.h"
+
+// The runtime (src/rinha_extern.c) compiled to LLVM bitcode and embedded in
+// vladpiler at build time, so it can be linked into every generated module.
+namespace Runtime {
+  llvm::StringRef libc_bitcode();
+  // Built with -DRINHA_MINIMAL: raw syscalls, no libc
+  llvm::StringRef minimal_bitcode();
+}
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include "common.h"
+
+// Compile server (--serve). Starting vladpiler (loading LLVM, registering
+// its targets) takes longer than compiling a small program, so a server
+// pays for that once and handles every request in a fork of itself.
+namespace Server {
+  // Runs a command line, as main would. Returns the exit status.
+  using Handler = int (*)(int argc, char* argv[]);
+
+  /*  Listens on a Unix domain socket at socket_path (replacing whatever is
+      there) and never returns. Each connection is handled by a forked
+      process that calls handler with the request's command line, in the
+      client's working directory and with the client's stdout and stderr.
+      Requests are handled at the same time, each in a fresh copy of the
+      server, so nothing one of them does is seen by the others.
+
+      A request is the client's working directory, stdout and stderr, sent
+      as file descriptors (SCM_RIGHTS) along with the first bytes of the
+      arguments: their number and then each of them, all NUL terminated.
+      The reply is a single byte with the exit status (128 + the signal
+      number if the handler was killed).
+  */
+  [[noreturn]] void serve(const std::string& socket_path, Handler handler);
+}
+
+#endif
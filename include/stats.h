@@ -0,0 +1,86 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "common.h"
+#include <chrono>
+
+// Compiler self-profiling. Everything here is a no-op unless enable() was
+// called (e.g. through --stats=json), so it's safe to leave instrumentation
+// points in hot paths.
+namespace Stats {
+
+  enum class Phase : uint32_t {
+    LEX,
+    PARSE,
+    CODEGEN,
+    VERIFY,
+    OPTIMIZE,
+    EMIT,
+    N_PHASES
+  };
+
+  enum class Counter : uint32_t {
+    TOKENS,
+    AST_NODES,
+    CLOSURE_SPECIALIZATIONS,
+    SPECIALIZATION_CACHE_HITS,
+    SPECIALIZATION_CACHE_MISSES,
+    OVER_BUDGET_CLOSURES,
+    SYMBOL_LOOKUPS,
+    IR_INSTRUCTIONS,
+    INLINED_CALLS,
+    CSE_BINDINGS,
+    DEAD_BINDINGS,
+    ACCUMULATED_FUNCTIONS,
+    PARALLEL_FORKS,
+    N_COUNTERS
+  };
+
+  // Storage is exposed only so the helpers below can be inlined
+  extern bool enabled;
+  extern uint64_t counters[static_cast<uint32_t>(Counter::N_COUNTERS)];
+
+  inline bool is_enabled() { return enabled; }
+  void enable();
+
+  inline void increment(Counter counter, uint64_t n = 1) {
+    if (enabled) counters[static_cast<uint32_t>(counter)] += n;
+  }
+
+  // Counts an AST node of the given kind (also bumps Counter::AST_NODES)
+  void count_node(const char* kind);
+  // Called once the program is parsed: nodes built after that are copies
+  // made by the AST passes (inlining, fork-join...), not the program's
+  void stop_counting_nodes();
+  void set(Counter counter, uint64_t value);
+
+  // Writes every phase and counter as a single JSON object
+  void report_json(std::ostream& out, const std::string& filename);
+
+  /*  Times the enclosing scope and attributes it to a phase. Timers nest:
+      time spent in an inner timer is subtracted from the outer one, so each
+      phase reports exclusive time (e.g. parse excludes lex).
+
+      Reading the process CPU clock is a syscall, which is too expensive to
+      do per token, so timers created with track_cpu = false only measure
+      wall time. Their CPU time stays attributed to the enclosing phase.
+  */
+  class PhaseTimer {
+    using clock = std::chrono::steady_clock;
+
+    Phase phase;
+    bool active;
+    bool track_cpu;
+    clock::time_point wall_start;
+    uint64_t cpu_start_ns;
+    uint64_t child_wall_ns;
+    uint64_t child_cpu_ns;
+    PhaseTimer* parent;
+
+  public:
+    PhaseTimer(Phase phase, bool track_cpu = true);
+    ~PhaseTimer();
+  };
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "common.h"
+#include "compiler.h"
+
+// Watch mode (--watch). Recompiles a program every time its source is
+// saved, from a process that has already set LLVM up.
+namespace Watch {
+  // Compiles the program once, as main would. Returns the exit status.
+  using Build = std::function<int()>;
+
+  /*  Builds, then waits for source to change and builds again, forever.
+      Each build runs in a fork of this process, like a compile server's
+      requests (see Server::serve), so a build that fails or leaves state
+      behind doesn't affect the next one. Saves that replace the file
+      (as most editors do) are seen too, since it's the directory that is
+      watched.
+
+      Builds should have Watch::changed as CompileOptions::after_parse.
+  */
+  [[noreturn]] void watch(const std::string& source, const Build& build);
+
+  /*  Compares the top-level bindings of program (see
+      Analysis::top_level_bindings) against those of the last build that
+      succeeded, and reports on stderr the ones that changed and the ones
+      that use them. Returns false, so the build stops there, when none
+      changed: edits to whitespace and comments don't recompile anything.
+  */
+  bool changed(AST::Term* program);
+}
+
+#endif
@@ -9,7 +9,7 @@ program="${basename%.*}"
 build="build/${program}.o"
 llfile="llvm/${program}.ll"
 
-./bin/vladpiler ${source}
+./bin/vladpiler --runtime=minimal ${source}
 llc --filetype=obj ${llfile} -o ${build}
-clang -no-pie ${build} build/rinha_extern.o -o exec
+clang -static -nostdlib ${build} -o exec
 ./exec
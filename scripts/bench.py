@@ -0,0 +1,162 @@
+#!/bin/python
+
+# Compiles and runs every Rinha program in bench/ a few times and compares
+# the results against a stored baseline. Exits with status 1 when any
+# benchmark regressed by more than the configured threshold.
+#
+# The toolchain can be overridden through VLAD, VLAD_FLAGS, LLC and CC. The
+# runtime is linked into the IR by the compiler; set RINHA_RUNTIME to an object
+# file to benchmark with --runtime=external instead.
+
+import argparse
+import json
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+
+from pathlib import Path
+
+bench_dir = Path('bench')
+out_dir = Path('build/bench')
+baseline_file = bench_dir / 'baseline.json'
+results_file = Path('build/bench-results.json')
+
+vlad = os.environ.get('VLAD', 'bin/vladpiler')
+vlad_flags = shlex.split(os.environ.get('VLAD_FLAGS', ''))
+llc = shlex.split(os.environ.get('LLC', 'llc'))
+cc = shlex.split(os.environ.get('CC', 'clang'))
+runtime = os.environ.get('RINHA_RUNTIME')
+if runtime:
+    vlad_flags.append('--runtime=external')
+
+
+def run_checked(cmd: list) -> None:
+    proc = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(' '.join(cmd) + ' failed:\n' + proc.stderr.decode())
+
+
+def compile_bench(source: Path) -> Path:
+    name = source.stem
+    ll_file = Path('llvm') / (name + '.ll')
+    obj_file = out_dir / (name + '.o')
+    exe_file = out_dir / name
+    run_checked([vlad] + vlad_flags + [str(source)])
+    run_checked(llc + ['--filetype=obj', str(ll_file), '-o', str(obj_file)])
+    run_checked(cc + ['-no-pie', str(obj_file)] + ([runtime] if runtime else []) + ['-o', str(exe_file)])
+    return exe_file
+
+
+def build_launcher() -> Path:
+    source = Path('scripts/bench_exec.c')
+    launcher = out_dir / 'bench_exec'
+    if not launcher.exists() or launcher.stat().st_mtime < source.stat().st_mtime:
+        run_checked(cc + ['-O2', str(source), '-o', str(launcher)])
+    return launcher
+
+
+# Returns (wall time in ms, max RSS in kB) of a single run
+def run_once(launcher: Path, exe: Path) -> tuple:
+    proc = subprocess.run([str(launcher), str(exe)], stdout=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(f'{exe} exited with status {proc.returncode}')
+    wall_ns, rss_kb = proc.stdout.split()
+    return int(wall_ns) / 1e6, int(rss_kb)
+
+
+def percentile(values: list, pct: float) -> float:
+    ordered = sorted(values)
+    index = min(len(ordered) - 1, round(pct / 100 * (len(ordered) - 1)))
+    return ordered[index]
+
+
+def bench(launcher: Path, source: Path, runs: int) -> dict:
+    exe = compile_bench(source)
+    run_once(launcher, exe)  # Warm up caches and page in the binary
+    samples = [run_once(launcher, exe) for _ in range(runs)]
+    walls = [wall for wall, _ in samples]
+    return {
+        'runs': runs,
+        'median_ms': round(statistics.median(walls), 3),
+        'p95_ms': round(percentile(walls, 95), 3),
+        'max_rss_kb': max(rss for _, rss in samples),
+    }
+
+
+def find_regressions(results: dict, baseline: dict, threshold: float,
+                     min_delta_ms: float, min_delta_kb: int) -> list:
+    regressions = []
+    for name, base in baseline.items():
+        if name not in results:
+            regressions.append(f'{name}: missing from this run')
+            continue
+        cur = results[name]
+        if 'error' in cur:
+            regressions.append(f'{name}: {cur["error"]}')
+            continue
+        limit = base['median_ms'] * (1 + threshold)
+        if cur['median_ms'] > limit and cur['median_ms'] - base['median_ms'] > min_delta_ms:
+            regressions.append(f'{name}: median {cur["median_ms"]}ms vs baseline {base["median_ms"]}ms')
+        if cur['max_rss_kb'] > base['max_rss_kb'] * (1 + threshold) and \
+                cur['max_rss_kb'] - base['max_rss_kb'] > min_delta_kb:
+            regressions.append(f'{name}: max RSS {cur["max_rss_kb"]}kB vs baseline {base["max_rss_kb"]}kB')
+    return regressions
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Run the vladpiler benchmark suite.')
+    parser.add_argument('--runs', type=int, default=5, help='timed runs per benchmark')
+    parser.add_argument('--threshold', type=float, default=0.10,
+                        help='allowed relative slowdown before failing (0.10 = 10%%)')
+    parser.add_argument('--min-delta-ms', type=float, default=2.0,
+                        help='ignore slowdowns smaller than this, to absorb timer noise')
+    parser.add_argument('--min-delta-kb', type=int, default=512,
+                        help='ignore RSS growth smaller than this')
+    parser.add_argument('--update-baseline', action='store_true',
+                        help='store this run as the new baseline instead of comparing')
+    parser.add_argument('filter', nargs='*', help='only run benchmarks with these names')
+    args = parser.parse_args()
+
+    out_dir.mkdir(parents=True, exist_ok=True)
+    Path('llvm').mkdir(exist_ok=True)
+
+    launcher = build_launcher()
+    results = {}
+    for source in sorted(bench_dir.glob('*.rinha')):
+        if args.filter and source.stem not in args.filter:
+            continue
+        try:
+            results[source.stem] = bench(launcher, source, args.runs)
+            r = results[source.stem]
+            print(f'{source.stem:<16} median {r["median_ms"]:>10.3f}ms  '
+                  f'p95 {r["p95_ms"]:>10.3f}ms  max RSS {r["max_rss_kb"]:>8}kB')
+        except RuntimeError as e:
+            results[source.stem] = {'error': str(e).splitlines()[0]}
+            print(f'{source.stem:<16} ERROR {e}')
+
+    results_file.write_text(json.dumps(results, indent=2) + '\n')
+
+    if args.update_baseline:
+        ok = {name: r for name, r in results.items() if 'error' not in r}
+        baseline = json.loads(baseline_file.read_text()) if baseline_file.exists() and args.filter else {}
+        baseline.update(ok)
+        baseline_file.write_text(json.dumps(baseline, indent=2, sort_keys=True) + '\n')
+        print(f'Baseline written to {baseline_file}')
+        return 0
+
+    if not baseline_file.exists():
+        print(f'No baseline at {baseline_file}; run `make bench-baseline` to create one.')
+        return 0
+
+    baseline = json.loads(baseline_file.read_text())
+    if args.filter:
+        baseline = {name: b for name, b in baseline.items() if name in args.filter}
+    regressions = find_regressions(results, baseline, args.threshold, args.min_delta_ms, args.min_delta_kb)
+    for regression in regressions:
+        print('REGRESSION ' + regression)
+    return 1 if regressions else 0
+
+
+sys.exit(main())
@@ -0,0 +1,69 @@
+#!/bin/python
+
+# Measures the throughput of the frontend (scanning and parsing) on large
+# programs from gen_rinha.py, with and without --pipelined-lexer. The
+# compiler stops once the program is parsed (--program parser), so the
+# time is the lex and parse phases of --stats=json.
+#
+# The compiler can be overridden through VLAD. Any other option is passed
+# to gen_rinha.py, e.g. --ident-len 32.
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+
+from pathlib import Path
+
+import gen_rinha
+
+out_dir = Path('build/bench-frontend')
+
+vlad = os.environ.get('VLAD', 'bin/vladpiler')
+
+modes = [('sequential', []), ('pipelined', ['--pipelined-lexer'])]
+
+
+# Returns the wall time (in ms) of scanning and parsing source
+def parse_once(source: Path, flags: list) -> float:
+    proc = subprocess.run([vlad, '--program', 'parser', '--stats=json'] + flags + [str(source)],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(f'parsing {source} failed:\n' + proc.stderr.decode())
+    report = proc.stderr.decode()
+    phases = json.loads(report[report.index('{'):])['phases']
+    return phases['lex']['wall_ms'] + phases['parse']['wall_ms']
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Compare frontend throughput with and without --pipelined-lexer.',
+                                     epilog='Other options are passed to gen_rinha.py.')
+    parser.add_argument('--sizes', default='20000,50000,100000',
+                        help='comma-separated numbers of top-level lets')
+    parser.add_argument('--runs', type=int, default=5, help='parses per size and mode')
+    args, gen_args = parser.parse_known_args()
+
+    out_dir.mkdir(parents=True, exist_ok=True)
+    for size in sorted(int(size) for size in args.sizes.split(',')):
+        source = out_dir / f'gen_{size}.rinha'
+        source.write_text(gen_rinha.generate(['--lets', str(size)] + gen_args))
+        megabytes = source.stat().st_size / 1e6
+        print(f'{size} lets ({megabytes:.1f}MB)')
+
+        sequential_ms = None
+        for name, flags in modes:
+            try:
+                parse_once(source, flags)  # Warm up the page cache
+                median = statistics.median(parse_once(source, flags) for _ in range(args.runs))
+            except RuntimeError as e:
+                print(f'  {name:<12} ERROR {e}')
+                return 1
+            sequential_ms = sequential_ms or median
+            print(f'  {name:<12} {median:>9.1f}ms  {megabytes / median * 1e3:>7.1f}MB/s  '
+                  f'{sequential_ms / median:>5.2f}x')
+    return 0
+
+
+sys.exit(main())
@@ -0,0 +1,146 @@
+#!/bin/python
+
+# Measures how compile time and memory grow with the size of the program:
+# compiles programs from gen_rinha.py at increasing sizes with --stats=json,
+# and fits how each phase grows against the number of AST nodes. Exits with
+# status 1 when a phase grows faster than --max-exponent (e.g. 2 for a phase
+# that is quadratic), since generated programs are the ones that get big.
+#
+# The compiler can be overridden through VLAD and VLAD_FLAGS. Any other
+# option is passed to gen_rinha.py, e.g. --depth 5 or --ident-len 32.
+
+import argparse
+import json
+import math
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+
+from pathlib import Path
+
+import gen_rinha
+
+out_dir = Path('build/bench-scaling')
+results_file = Path('build/bench-scaling.csv')
+
+vlad = os.environ.get('VLAD', 'bin/vladpiler')
+vlad_flags = shlex.split(os.environ.get('VLAD_FLAGS', '--runtime=external'))
+
+phases = ['lex', 'parse', 'codegen', 'optimize', 'emit']
+
+# Phases that take less than this at the largest size (and RSS that grows
+# less than this) are left out of the fit, since they are mostly noise.
+# The AST passes (inlining, CSE...) are timed as part of optimize.
+min_fit_ms = 5.0
+min_fit_kb = 16384
+
+
+# Returns the --stats=json report of compiling source
+def compile_once(source: Path) -> dict:
+    proc = subprocess.run([vlad, '--stats=json'] + vlad_flags + [str(source)],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(f'compiling {source} failed:\n' + proc.stderr.decode())
+    report = proc.stderr.decode()
+    return json.loads(report[report.index('{'):])
+
+
+def measure(size: int, runs: int, gen_args: list) -> dict:
+    source = out_dir / f'gen_{size}.rinha'
+    source.write_text(gen_rinha.generate(['--lets', str(size)] + gen_args))
+    reports = [compile_once(source) for _ in range(runs)]
+    result = {
+        'lets': size,
+        'ast_nodes': reports[0]['counters']['ast_nodes'],
+        'symbol_lookups': reports[0]['counters']['symbol_lookups'],
+        'total_ms': statistics.median(report['total']['wall_ms'] for report in reports),
+        'peak_rss_kb': max(report['total']['peak_rss_kb'] for report in reports),
+    }
+    for phase in phases:
+        result[phase + '_ms'] = statistics.median(report['phases'][phase]['wall_ms'] for report in reports)
+    return result
+
+
+# Slope of the least-squares line through (log x, log y), i.e. k when y
+# grows like x^k
+def growth_exponent(xs: list, ys: list) -> float:
+    points = [(math.log(x), math.log(y)) for x, y in zip(xs, ys) if x > 0 and y > 0]
+    if len(points) < 2:
+        return 0.0
+    mean_x = statistics.mean(x for x, _ in points)
+    mean_y = statistics.mean(y for _, y in points)
+    var_x = sum((x - mean_x) ** 2 for x, _ in points)
+    if var_x == 0:
+        return 0.0
+    return sum((x - mean_x) * (y - mean_y) for x, y in points) / var_x
+
+
+def plot(results: list, key: str, width: int = 40) -> None:
+    top = max(result[key] for result in results) or 1
+    for result in results:
+        bar = '#' * round(result[key] / top * width)
+        print(f'  {result["ast_nodes"]:>9} | {bar:<{width}} {result[key]:.1f}')
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Measure how compilation scales with program size.',
+                                     epilog='Other options are passed to gen_rinha.py.')
+    parser.add_argument('--sizes', default='1000,2000,3000,4000',
+                        help='comma-separated numbers of top-level lets')
+    parser.add_argument('--runs', type=int, default=1, help='compilations per size')
+    parser.add_argument('--max-exponent', type=float, default=1.3,
+                        help='fail if a phase grows faster than nodes to this power')
+    args, gen_args = parser.parse_known_args()
+    sizes = sorted(int(size) for size in args.sizes.split(','))
+
+    out_dir.mkdir(parents=True, exist_ok=True)
+    Path('llvm').mkdir(exist_ok=True)
+
+    results = []
+    for size in sizes:
+        try:
+            results.append(measure(size, args.runs, gen_args))
+        except RuntimeError as e:
+            print(f'{size} lets: ERROR {e}')
+            return 1
+        result = results[-1]
+        print(f'{size:>7} lets {result["ast_nodes"]:>9} nodes  ' +
+              '  '.join(f'{phase} {result[phase + "_ms"]:>9.1f}ms' for phase in phases) +
+              f'  total {result["total_ms"]:>9.1f}ms  max RSS {result["peak_rss_kb"]:>8}kB')
+
+    with open(results_file, 'w') as out:
+        keys = list(results[0].keys())
+        out.write(','.join(keys) + '\n')
+        for result in results:
+            out.write(','.join(str(result[key]) for key in keys) + '\n')
+
+    print('\ntotal time (ms) by AST nodes')
+    plot(results, 'total_ms')
+    print('\npeak RSS (kB) by AST nodes')
+    plot(results, 'peak_rss_kb')
+
+    # RSS starts at what LLVM itself takes, so only what grows past the
+    # smallest program is fitted, against the nodes added past it
+    nodes = [result['ast_nodes'] for result in results]
+    series = {phase: [result[phase + '_ms'] for result in results] for phase in phases}
+    series['symbol lookups'] = [result['symbol_lookups'] for result in results]
+    series['RSS'] = [result['peak_rss_kb'] - results[0]['peak_rss_kb'] for result in results[1:]]
+
+    print('\ngrowth against AST nodes (1 is linear)')
+    failed = False
+    for name, values in series.items():
+        xs = [n - nodes[0] for n in nodes[1:]] if name == 'RSS' else nodes
+        if values[-1] < (min_fit_kb if name == 'RSS' else min_fit_ms):
+            print(f'  {name:<15} too small to fit')
+            continue
+        exponent = growth_exponent(xs, values)
+        flag = exponent > args.max_exponent
+        failed |= flag
+        print(f'  {name:<15} n^{exponent:.2f}' + ('  SUPER-LINEAR' if flag else ''))
+    print(f'\nResults written to {results_file}')
+    return 1 if failed else 0
+
+
+sys.exit(main())
@@ -0,0 +1,110 @@
+#!/bin/python
+
+# Measures process start-up cost: compiles tiny programs against each runtime
+# and times many runs of them, so the dynamic loader and libc initialization
+# show up instead of being buried under the program's own work.
+#
+# The toolchain can be overridden through VLAD, LLC and CC. To use prebuilt
+# runtime objects instead of the embedded ones, set RINHA_RUNTIME (libc) and
+# RINHA_MINIMAL_RUNTIME (built with -DRINHA_MINIMAL).
+
+import argparse
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+
+from pathlib import Path
+
+startup_dir = Path('bench/startup')
+out_dir = Path('build/bench-startup')
+
+vlad = os.environ.get('VLAD', 'bin/vladpiler')
+llc = shlex.split(os.environ.get('LLC', 'llc'))
+cc = shlex.split(os.environ.get('CC', 'clang'))
+
+# (name, --runtime, link flags, prebuilt runtime object)
+runtimes = [
+    ('libc', 'libc', ['-no-pie'], os.environ.get('RINHA_RUNTIME')),
+    ('libc-static', 'libc', ['-static', '-no-pie'], os.environ.get('RINHA_RUNTIME')),
+    ('minimal', 'minimal', ['-static', '-nostdlib'], os.environ.get('RINHA_MINIMAL_RUNTIME')),
+]
+
+
+def run_checked(cmd: list) -> None:
+    proc = subprocess.run(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(' '.join(cmd) + ' failed:\n' + proc.stderr.decode())
+
+
+def compile_program(source: Path, name: str, runtime: str, link_flags: list, runtime_obj: str) -> Path:
+    ll_file = Path('llvm') / (source.stem + '.ll')
+    obj_file = out_dir / f'{source.stem}-{name}.o'
+    exe_file = out_dir / f'{source.stem}-{name}'
+    runtime_flag = '--runtime=external' if runtime_obj else f'--runtime={runtime}'
+    run_checked([vlad, runtime_flag, str(source)])
+    run_checked(llc + ['--filetype=obj', str(ll_file), '-o', str(obj_file)])
+    run_checked(cc + link_flags + [str(obj_file)] + ([runtime_obj] if runtime_obj else []) + ['-o', str(exe_file)])
+    return exe_file
+
+
+def build_launcher() -> Path:
+    source = Path('scripts/bench_exec.c')
+    launcher = out_dir / 'bench_exec'
+    if not launcher.exists() or launcher.stat().st_mtime < source.stat().st_mtime:
+        run_checked(cc + ['-O2', str(source), '-o', str(launcher)])
+    return launcher
+
+
+# Returns (wall time in us, max RSS in kB) of a single run
+def run_once(launcher: Path, exe: Path) -> tuple:
+    proc = subprocess.run([str(launcher), str(exe)], stdout=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(f'{exe} exited with status {proc.returncode}')
+    wall_ns, rss_kb = proc.stdout.split()
+    return int(wall_ns) / 1e3, int(rss_kb)
+
+
+def percentile(values: list, pct: float) -> float:
+    ordered = sorted(values)
+    index = min(len(ordered) - 1, round(pct / 100 * (len(ordered) - 1)))
+    return ordered[index]
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Compare process start-up latency of the runtimes.')
+    parser.add_argument('--runs', type=int, default=200, help='timed runs per program and runtime')
+    parser.add_argument('filter', nargs='*', help='only run programs with these names')
+    args = parser.parse_args()
+
+    out_dir.mkdir(parents=True, exist_ok=True)
+    Path('llvm').mkdir(exist_ok=True)
+
+    launcher = build_launcher()
+    failed = False
+    for source in sorted(startup_dir.glob('*.rinha')):
+        if args.filter and source.stem not in args.filter:
+            continue
+        print(source.stem)
+        libc_median = None
+        for name, runtime, link_flags, runtime_obj in runtimes:
+            try:
+                exe = compile_program(source, name, runtime, link_flags, runtime_obj)
+                run_once(launcher, exe)  # Page in the binary
+                samples = [run_once(launcher, exe) for _ in range(args.runs)]
+            except RuntimeError as e:
+                print(f'  {name:<12} ERROR {e}')
+                failed = True
+                continue
+
+            walls = [wall for wall, _ in samples]
+            median = statistics.median(walls)
+            libc_median = libc_median or median
+            print(f'  {name:<12} median {median:>9.1f}us  p95 {percentile(walls, 95):>9.1f}us  '
+                  f'max RSS {max(rss for _, rss in samples):>6}kB  size {exe.stat().st_size:>8}B  '
+                  f'{libc_median / median:>5.2f}x')
+    return 1 if failed else 0
+
+
+sys.exit(main())
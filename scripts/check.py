@@ -0,0 +1,76 @@
+#!/bin/python
+
+# Compiles and runs every Rinha program in tests/ and compares what it prints
+# with <name>.out. A <name>.flags file next to it holds extra vladpiler flags.
+# Exits with status 1 when any of them differs or fails to build.
+#
+# The toolchain can be overridden through VLAD, LLC and CC. The runtime is
+# linked into the IR by the compiler; set RINHA_RUNTIME to an object file to
+# check with --runtime=external instead.
+
+import argparse
+import os
+import shlex
+import subprocess
+import sys
+
+from pathlib import Path
+
+tests_dir = Path('tests')
+out_dir = Path('build/tests')
+
+vlad = os.environ.get('VLAD', 'bin/vladpiler')
+llc = shlex.split(os.environ.get('LLC', 'llc'))
+cc = shlex.split(os.environ.get('CC', 'clang'))
+runtime = os.environ.get('RINHA_RUNTIME')
+
+
+def run_checked(cmd: list) -> str:
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    if proc.returncode != 0:
+        raise RuntimeError(' '.join(cmd) + ' failed:\n' + proc.stderr.decode())
+    return proc.stdout.decode()
+
+
+def check(source: Path) -> str:
+    flags_file = source.with_suffix('.flags')
+    flags = shlex.split(flags_file.read_text()) if flags_file.exists() else []
+    if runtime:
+        flags.append('--runtime=external')
+    ll_file = Path('llvm') / (source.stem + '.ll')
+    obj_file = out_dir / (source.stem + '.o')
+    exe_file = out_dir / source.stem
+    run_checked([vlad] + flags + [str(source)])
+    run_checked(llc + ['--filetype=obj', str(ll_file), '-o', str(obj_file)])
+    run_checked(cc + ['-no-pie', '-pthread', str(obj_file)] + ([runtime] if runtime else []) + ['-o', str(exe_file)])
+    return run_checked([str(exe_file)])
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description='Run the vladpiler regression programs.')
+    parser.add_argument('filter', nargs='*', help='only run programs with these names')
+    args = parser.parse_args()
+
+    out_dir.mkdir(parents=True, exist_ok=True)
+    Path('llvm').mkdir(exist_ok=True)
+
+    failed = False
+    for source in sorted(tests_dir.glob('*.rinha')):
+        if args.filter and source.stem not in args.filter:
+            continue
+        try:
+            output = check(source)
+        except RuntimeError as e:
+            print(f'{source.stem:<24} ERROR {e}')
+            failed = True
+            continue
+        expected = source.with_suffix('.out').read_text()
+        if output != expected:
+            print(f'{source.stem:<24} FAILED\n  expected: {expected!r}\n  got:      {output!r}')
+            failed = True
+        else:
+            print(f'{source.stem:<24} ok')
+    return 1 if failed else 0
+
+
+sys.exit(main())
@@ -0,0 +1,143 @@
+#!/bin/python
+
+# Generates valid Rinha programs of a given size and shape, for measuring how
+# the compiler scales (see bench_scaling.py). The same seed and knobs always
+# give the same program.
+#
+# The program is a chain of top-level lets, some of them functions or nested
+# tuples. Every let uses the one before it and the last one is printed, so
+# dead-binding elimination can't drop any of it. Only +, -, *, < and == are
+# used, so the program doesn't divide by zero and doesn't run for long.
+
+import argparse
+import random
+import string
+import sys
+
+
+class Generator:
+    def __init__(self, args: argparse.Namespace):
+        self.rng = random.Random(args.seed)
+        self.args = args
+        self.ints = []       # Top-level int bindings
+        self.tuples = []     # Top-level tuple bindings, as (name, depth)
+        self.closures = []   # Top-level functions, as (name, arity)
+        self.names = 0
+
+    # kind, then random letters, then a counter that keeps names unique
+    def name(self, kind: str) -> str:
+        self.names += 1
+        suffix = str(self.names)
+        filler = max(0, self.args.ident_len - len(kind) - len(suffix))
+        return kind + ''.join(self.rng.choice(string.ascii_lowercase) for _ in range(filler)) + suffix
+
+    def literal(self) -> str:
+        return str(self.rng.randrange(100))
+
+    # Comparisons bind tighter than first and second, so conditions can't
+    # take a tuple's elements
+    def leaf(self, scope: list, projections: bool = True) -> str:
+        choice = self.rng.random()
+        if scope and choice < 0.4:
+            return self.rng.choice(scope)
+        if self.ints and choice < 0.75:
+            return self.rng.choice(self.ints)
+        if projections and self.tuples and choice < 0.85:
+            name, depth = self.rng.choice(self.tuples)
+            return 'first ' + 'second ' * self.rng.randrange(depth) + name
+        return self.literal()
+
+    def call(self, depth: int, scope: list) -> str:
+        name, arity = self.rng.choice(self.closures)
+        return f'{name}({", ".join(self.term(depth - 1, scope) for _ in range(arity))})'
+
+    # An int-valued term nested at most depth levels deep
+    def term(self, depth: int, scope: list) -> str:
+        if depth <= 0 or self.rng.random() < 0.3:
+            return self.leaf(scope)
+        if self.closures and self.rng.random() < self.args.call_density:
+            return self.call(depth, scope)
+        choice = self.rng.random()
+        if choice < 0.25:
+            cond = f'{self.leaf(scope, False)} {self.rng.choice(["<", "=="])} {self.leaf(scope, False)}'
+            return f'if ({cond}) {{ {self.block(depth - 1, scope)} }} else {{ {self.block(depth - 1, scope)} }}'
+        operands = [self.term(depth - 1, scope) for _ in range(self.rng.randrange(2, 4))]
+        operators = [self.rng.choice(['+', '-', '*']) for _ in operands[1:]]
+        return operands[0] + ''.join(f' {op} {rhs}' for op, rhs in zip(operators, operands[1:]))
+
+    # A term that can bind locals first, where the grammar allows a let
+    def block(self, depth: int, scope: list) -> str:
+        if depth <= 0 or self.rng.random() < 0.5:
+            return self.term(depth, scope)
+        local = self.name('l')
+        value = self.term(depth - 1, scope)
+        return f'let {local} = {value}; {self.term(depth - 1, scope + [local])}'
+
+    def tuple(self, depth: int) -> str:
+        head = self.term(1, [])
+        if depth <= 1:
+            return f'({head}, {self.term(1, [])})'
+        return f'({head}, {self.tuple(depth - 1)})'
+
+    def program(self) -> str:
+        args = self.args
+        lines = []
+        closure_every = args.lets // args.closures if args.closures else 0
+        tuple_every = 8 if args.tuple_depth else 0
+        for i in range(args.lets):
+            if closure_every and i % closure_every == 0 and len(self.closures) < args.closures:
+                name = self.name('f')
+                params = [self.name('p') for _ in range(self.rng.randrange(1, 4))]
+                body = self.block(args.depth, params)
+                lines.append(f'let {name} = fn ({", ".join(params)}) => {{ {body} }};')
+                self.closures.append((name, len(params)))
+            elif tuple_every and i % tuple_every == tuple_every - 1:
+                name = self.name('t')
+                lines.append(f'let {name} = {self.tuple(args.tuple_depth)};')
+                self.tuples.append((name, args.tuple_depth))
+            else:
+                name = self.name('v')
+                value = self.term(args.depth, [])
+                if self.ints:
+                    value = f'{self.ints[-1]} + {value}'
+                lines.append(f'let {name} = {value};')
+                self.ints.append(name)
+        lines.append(f'print({self.ints[-1] if self.ints else 0})')
+        return '\n'.join(lines) + '\n'
+
+
+def parse_args(argv: list) -> argparse.Namespace:
+    parser = argparse.ArgumentParser(description='Generate a Rinha program.')
+    parser.add_argument('--seed', type=int, default=0)
+    parser.add_argument('--lets', type=int, default=1000, help='top-level lets, functions and tuples included')
+    parser.add_argument('--depth', type=int, default=3, help='how deep terms nest')
+    parser.add_argument('--closures', type=int, default=16, help='top-level functions')
+    parser.add_argument('--tuple-depth', type=int, default=2, help='nesting of tuples bound every 8 lets (0 for none)')
+    parser.add_argument('--call-density', type=float, default=0.2, help='chance of a term being a call')
+    parser.add_argument('--ident-len', type=int, default=8, help='length of identifiers')
+    parser.add_argument('-o', '--output', help='where to write the program (stdout if not given)')
+    args = parser.parse_args(argv)
+    if args.lets < 1 or args.depth < 0 or args.closures < 0 or args.tuple_depth < 0:
+        parser.error('sizes must not be negative, and there must be a let')
+    if not 0 <= args.call_density <= 1:
+        parser.error('--call-density must be between 0 and 1')
+    return args
+
+
+def generate(argv: list) -> str:
+    return Generator(parse_args(argv)).program()
+
+
+def main() -> int:
+    args = parse_args(sys.argv[1:])
+    program = Generator(args).program()
+    if args.output:
+        with open(args.output, 'w') as out:
+            out.write(program)
+    else:
+        sys.stdout.write(program)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
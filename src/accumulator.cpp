@@ -0,0 +1,360 @@
+#include "accumulator.h"
+#include "stats.h"
+#include <optional>
+#include <set>
+
+namespace Accumulator {
+
+  struct Candidate {
+    std::unique_ptr<AST::Term>* slot;     // Holding the let that binds the function
+    AST::BinOp op;
+    // Where the body's value comes from (past ifs and lets), split into
+    // those that call the function and those that don't
+    std::vector<std::unique_ptr<AST::Term>*> calls;
+    std::vector<std::unique_ptr<AST::Term>*> results;
+  };
+
+  // Whether visit returns true for some term in root. Walks an explicit
+  // stack of pending terms, as generated programs can nest very deeply.
+  template <typename Visit>
+  static bool any_term(AST::Term* root, Visit visit) {
+    std::vector<AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      AST::Term* term = pending.back();
+      pending.pop_back();
+      if (visit(term)) return true;
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) pending.push_back(child->get());
+    }
+    return false;
+  }
+
+  // Refers to name, or binds it again
+  static bool mentions(AST::Term* term, const std::string& name) {
+    return any_term(term, [&name](AST::Term* term) {
+      if (AST::Var* var = dynamic_cast<AST::Var*>(term)) return *var->name == name;
+      if (AST::Call* call = dynamic_cast<AST::Call*>(term)) return call->callee == name;
+      if (AST::Let* let = dynamic_cast<AST::Let*>(term)) return *let->parameter->identifier == name;
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) {
+          if (*param->identifier == name) return true;
+        }
+      }
+      return false;
+    });
+  }
+
+  // Can be evaluated earlier than where it's written without it showing:
+  // it can't print, fail (dividing by zero) or fail to terminate
+  static bool is_simple(AST::Term* term) {
+    return !any_term(term, [](AST::Term* term) {
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        return binary->binop == AST::BinOp::DIV || binary->binop == AST::BinOp::MOD;
+      }
+      return dynamic_cast<AST::Call*>(term) || dynamic_cast<AST::Print*>(term) || dynamic_cast<AST::Function*>(term) ||
+        dynamic_cast<AST::Let*>(term) || dynamic_cast<AST::If*>(term);
+    });
+  }
+
+  static bool accumulates(AST::BinOp op) {
+    return op == AST::BinOp::PLUS || op == AST::BinOp::MULT || op == AST::BinOp::AND || op == AST::BinOp::OR;
+  }
+
+  static bool is_numeric(AST::BinOp op) {
+    return op == AST::BinOp::PLUS || op == AST::BinOp::MULT;
+  }
+
+  static bool is_arithmetic(AST::BinOp op) {
+    switch (op) {
+      case AST::BinOp::MINUS:
+      case AST::BinOp::MULT:
+      case AST::BinOp::DIV:
+      case AST::BinOp::MOD:
+      case AST::BinOp::LT:
+      case AST::BinOp::GT:
+      case AST::BinOp::LTE:
+      case AST::BinOp::GTE:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /*  Parameters of fn that are numbers whenever what it does is defined:
+      the body subtracts, multiplies, divides or compares them with < or >,
+      which only numbers can be (on anything else the result is undefined),
+      and doesn't bind their names again.
+  */
+  static std::set<std::string> numeric_params(AST::Function* fn) {
+    std::set<std::string> used, rebound;
+    any_term(fn->value.get(), [&used, &rebound](AST::Term* term) {
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term); binary && is_arithmetic(binary->binop)) {
+        for (AST::Term* operand : {binary->lhs.get(), binary->rhs.get()}) {
+          if (AST::Var* var = dynamic_cast<AST::Var*>(operand)) used.insert(*var->name);
+        }
+      }
+      if (AST::Let* let = dynamic_cast<AST::Let*>(term)) rebound.insert(*let->parameter->identifier);
+      if (AST::Function* inner = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : inner->parameters->params) rebound.insert(*param->identifier);
+      }
+      return false;
+    });
+
+    std::set<std::string> numbers;
+    for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) {
+      const std::string& name = *param->identifier;
+      if (used.count(name) && !rebound.count(name)) numbers.insert(name);
+    }
+    return numbers;
+  }
+
+  // Whether term is a number (for + and *) or a boolean (for && and ||)
+  // whatever the names in it are bound to, numbers being names known to be
+  // numbers (see numeric_params)
+  static bool has_operand_type(AST::Term* root, AST::BinOp op, const std::set<std::string>& numbers) {
+    bool numeric = is_numeric(op);
+    std::vector<AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      AST::Term* term = pending.back();
+      pending.pop_back();
+      if (AST::Var* var = dynamic_cast<AST::Var*>(term)) {
+        if (!numeric || !numbers.count(*var->name)) return false;
+        continue;
+      }
+      if (dynamic_cast<AST::Int*>(term)) {
+        if (!numeric) return false;
+        continue;
+      }
+      if (dynamic_cast<AST::Bool*>(term)) {
+        if (numeric) return false;
+        continue;
+      }
+
+      AST::Binary* binary = dynamic_cast<AST::Binary*>(term);
+      if (!binary) return false;
+      switch (binary->binop) {
+        // A string on either side would make + a concatenation, so both
+        // have to be numbers too
+        case AST::BinOp::PLUS:
+        case AST::BinOp::AND:
+        case AST::BinOp::OR:
+          if (numeric != is_numeric(binary->binop)) return false;
+          pending.push_back(binary->lhs.get());
+          pending.push_back(binary->rhs.get());
+          break;
+        case AST::BinOp::MINUS:
+        case AST::BinOp::MULT:
+        case AST::BinOp::DIV:
+        case AST::BinOp::MOD:
+          if (!numeric) return false;
+          break;
+        default:
+          if (numeric) return false;
+          break;
+      }
+    }
+    return true;
+  }
+
+  // The operands of a chain of op (e.g. a + b + c), in evaluation order.
+  // Just the term itself if it isn't one.
+  static std::vector<std::unique_ptr<AST::Term>*> operands(std::unique_ptr<AST::Term>& slot, AST::BinOp op) {
+    std::vector<AST::Binary*> chain;
+    for (AST::Binary* binary = dynamic_cast<AST::Binary*>(slot.get()); binary && binary->binop == op; binary = dynamic_cast<AST::Binary*>(binary->lhs.get())) {
+      chain.push_back(binary);
+    }
+    if (chain.empty()) return {&slot};
+    std::vector<std::unique_ptr<AST::Term>*> terms = {&chain.back()->lhs};
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) terms.push_back(&(*it)->rhs);
+    return terms;
+  }
+
+  static bool is_call_to(AST::Term* term, const std::string& name) {
+    AST::Call* call = dynamic_cast<AST::Call*>(term);
+    return call && call->callee == name;
+  }
+
+  static size_t find_call(const std::vector<std::unique_ptr<AST::Term>*>& terms, const std::string& name) {
+    size_t i = 0;
+    while (!is_call_to(terms[i]->get(), name)) i++;
+    return i;
+  }
+
+  static std::optional<Candidate> consider(std::unique_ptr<AST::Term>& slot) {
+    AST::Let* let = static_cast<AST::Let*>(slot.get());
+    AST::Function* fn = static_cast<AST::Function*>(let->val.get());
+    const std::string& name = *let->parameter->identifier;
+    std::vector<std::unique_ptr<AST::Parameter>>& params = fn->parameters->params;
+    for (const std::unique_ptr<AST::Parameter>& param : params) {
+      if (*param->identifier == name) return std::nullopt;
+    }
+
+    Candidate candidate{&slot};
+    bool has_op = false;
+    std::vector<std::unique_ptr<AST::Term>*> pending = {&fn->value};
+    while (!pending.empty()) {
+      std::unique_ptr<AST::Term>* result = pending.back();
+      pending.pop_back();
+      AST::Term* term = result->get();
+
+      if (AST::If* branch = dynamic_cast<AST::If*>(term)) {
+        if (mentions(branch->condition.get(), name)) return std::nullopt;
+        pending.push_back(&branch->then);
+        pending.push_back(&branch->orElse);
+        continue;
+      }
+      if (AST::Let* inner = dynamic_cast<AST::Let*>(term)) {
+        if (*inner->parameter->identifier == name || mentions(inner->val.get(), name)) return std::nullopt;
+        pending.push_back(&inner->next);
+        continue;
+      }
+      if (!mentions(term, name)) {
+        candidate.results.push_back(result);
+        continue;
+      }
+
+      // The function's own call, alone or as one operand of a chain
+      AST::Binary* binary = dynamic_cast<AST::Binary*>(term);
+      if (binary && accumulates(binary->binop)) {
+        if (has_op && binary->binop != candidate.op) return std::nullopt;
+        candidate.op = binary->binop;
+        has_op = true;
+      }
+      std::vector<std::unique_ptr<AST::Term>*> terms = binary && accumulates(binary->binop) ? operands(*result, binary->binop) : std::vector{result};
+      size_t n_calls = 0;
+      for (std::unique_ptr<AST::Term>* operand : terms) {
+        if (!is_call_to(operand->get(), name)) {
+          if (mentions(operand->get(), name)) return std::nullopt;
+          continue;
+        }
+        AST::Call* call = static_cast<AST::Call*>(operand->get());
+        if (call->args->args.size() != params.size()) return std::nullopt;
+        for (std::unique_ptr<AST::Term>& arg : call->args->args) {
+          if (mentions(arg.get(), name)) return std::nullopt;
+        }
+        n_calls++;
+      }
+      if (n_calls != 1) return std::nullopt;
+      candidate.calls.push_back(result);
+    }
+
+    // Without an operator to accumulate, the calls already are tail calls
+    if (!has_op || candidate.results.empty()) return std::nullopt;
+    std::set<std::string> numbers = numeric_params(fn);
+    for (std::unique_ptr<AST::Term>* result : candidate.results) {
+      if (!has_operand_type(result->get(), candidate.op, numbers)) return std::nullopt;
+    }
+
+    // + and * on numbers are also commutative, so every other operand is
+    // accumulated. They have to be numbers too: + on a string concatenates,
+    // which isn't. && and || keep the operands before the call in front of it.
+    for (std::unique_ptr<AST::Term>* call : candidate.calls) {
+      std::vector<std::unique_ptr<AST::Term>*> terms = operands(*call, candidate.op);
+      size_t call_index = find_call(terms, name);
+      for (size_t i = is_numeric(candidate.op) ? 0 : call_index + 1; i < terms.size(); i++) {
+        if (i == call_index) continue;
+        if (!is_simple(terms[i]->get()) || !has_operand_type(terms[i]->get(), candidate.op, numbers)) return std::nullopt;
+      }
+    }
+    return candidate;
+  }
+
+  static AST::Term* combine(AST::Term* lhs, AST::Term* rhs, AST::BinOp op, const AST::Localization& loc) {
+    AST::Term* binary = new AST::Binary(lhs, rhs, op);
+    binary->loc = loc;
+    return binary;
+  }
+
+  static AST::Term* identity(AST::BinOp op) {
+    switch (op) {
+      case AST::BinOp::PLUS: return new AST::Int(0);
+      case AST::BinOp::MULT: return new AST::Int(1);
+      case AST::BinOp::AND: return new AST::Bool(true);
+      default: return new AST::Bool(false);
+    }
+  }
+
+  static void rewrite(Candidate& candidate) {
+    AST::Let* let = static_cast<AST::Let*>(candidate.slot->get());
+    AST::Function* fn = static_cast<AST::Function*>(let->val.get());
+    const std::string& name = *let->parameter->identifier;
+    // Neither can clash with a name in the program
+    std::string helper = name + ".acc";
+    const std::string acc = ".acc";
+    AST::BinOp op = candidate.op;
+
+    for (std::unique_ptr<AST::Term>* result : candidate.results) {
+      AST::Localization loc = (*result)->loc;
+      result->reset(combine(result->release(), new AST::Var(new std::string(acc)), op, loc));
+    }
+
+    for (std::unique_ptr<AST::Term>* slot : candidate.calls) {
+      AST::Localization loc = (*slot)->loc;
+      std::vector<std::unique_ptr<AST::Term>*> terms = operands(*slot, op);
+      size_t call_index = find_call(terms, name);
+      AST::Call* call = static_cast<AST::Call*>(terms[call_index]->get());
+
+      AST::Term* kept = nullptr;
+      AST::Term* accumulated = nullptr;
+      for (size_t i = 0; i < terms.size(); i++) {
+        if (i == call_index) continue;
+        AST::Term*& into = i < call_index && !is_numeric(op) ? kept : accumulated;
+        AST::Term* operand = terms[i]->release();
+        into = into ? combine(into, operand, op, loc) : operand;
+      }
+      AST::Term* acc_var = new AST::Var(new std::string(acc));
+      accumulated = accumulated ? combine(accumulated, acc_var, op, loc) : acc_var;
+
+      AST::Arguments* args = call->args.release();
+      args->args.emplace_back(accumulated);
+      AST::Term* tail_call = new AST::Call(&helper, args);
+      tail_call->loc = call->loc;
+      slot->reset(kept ? combine(kept, tail_call, op, loc) : tail_call);
+    }
+
+    // The function itself only starts the accumulation
+    std::vector<std::unique_ptr<AST::Parameter>>& params = fn->parameters->params;
+    AST::Parameters* wrapper_params = new AST::Parameters();
+    AST::Arguments* args = new AST::Arguments();
+    for (const std::unique_ptr<AST::Parameter>& param : params) {
+      wrapper_params->params.emplace_back(new AST::Parameter(new std::string(*param->identifier)));
+      args->args.emplace_back(new AST::Var(new std::string(*param->identifier)));
+    }
+    args->args.emplace_back(identity(op));
+    params.emplace_back(new AST::Parameter(new std::string(acc)));
+    AST::Term* start = new AST::Call(&helper, args);
+    start->loc = fn->loc;
+    AST::Term* wrapper = new AST::Function(wrapper_params, start);
+    wrapper->loc = fn->loc;
+
+    AST::Term* helper_fn = let->val.release();
+    let->val.reset(wrapper);
+    AST::Term* helper_let = new AST::Let(new AST::Parameter(new std::string(helper)), helper_fn, candidate.slot->release());
+    helper_let->loc = let->loc;
+    candidate.slot->reset(helper_let);
+  }
+
+  void transform(std::unique_ptr<AST::Term>& root) {
+    std::vector<Candidate> candidates;
+    std::vector<std::unique_ptr<AST::Term>*> pending = {&root};
+    while (!pending.empty()) {
+      std::unique_ptr<AST::Term>* slot = pending.back();
+      pending.pop_back();
+      AST::Let* let = dynamic_cast<AST::Let*>(slot->get());
+      if (let && dynamic_cast<AST::Function*>(let->val.get())) {
+        if (std::optional<Candidate> candidate = consider(*slot)) candidates.push_back(std::move(*candidate));
+      }
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      (*slot)->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) pending.push_back(child);
+    }
+
+    // Inner functions first: rewriting one moves the arguments of its calls,
+    // which may hold another
+    for (auto it = candidates.rbegin(); it != candidates.rend(); it++) {
+      rewrite(*it);
+      Stats::increment(Stats::Counter::ACCUMULATED_FUNCTIONS);
+    }
+  }
+}
@@ -0,0 +1,310 @@
+#include "analysis.h"
+#include <set>
+#include <typeinfo>
+
+namespace Analysis {
+
+  void Scope::push(const std::string& name, const AST::Term* binding) {
+    auto it = bindings.try_emplace(name).first;
+    it->second.push_back({binding, names.size()});
+    names.push_back(&it->first);
+  }
+
+  void Scope::pop() {
+    bindings[*names.back()].pop_back();
+    names.pop_back();
+  }
+
+  void Scope::resize(size_t n) {
+    while (names.size() > n) pop();
+  }
+
+  const AST::Term* Scope::lookup(const std::string& name) const {
+    auto it = bindings.find(name);
+    return it == bindings.end() || it->second.empty() ? nullptr : it->second.back().first;
+  }
+
+  size_t Scope::level(const std::string& name) const {
+    auto it = bindings.find(name);
+    return it == bindings.end() || it->second.empty() ? 0 : it->second.back().second;
+  }
+
+  void unchain(AST::Binary* binary, std::vector<AST::Binary*>& chain) {
+    for (; binary; binary = dynamic_cast<AST::Binary*>(binary->lhs.get())) chain.push_back(binary);
+  }
+
+  struct FreeVarCollector {
+    Scope bound;
+    std::set<std::string> seen;
+    std::vector<std::string> free;
+
+    void reference(const std::string& name) {
+      if (bound.lookup(name)) return;
+      if (seen.insert(name).second) free.push_back(name);
+    }
+
+    void collect(AST::Term* term) {
+      if (AST::Var* var = dynamic_cast<AST::Var*>(term)) {
+        reference(*var->name);
+        return;
+      }
+
+      if (AST::Call* call = dynamic_cast<AST::Call*>(term)) reference(call->callee);
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        size_t n_bound = bound.size();
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) bound.push(*param->identifier, fn);
+        collect(fn->value.get());
+        bound.resize(n_bound);
+        return;
+      }
+
+      // A let-bound function may refer to itself, anything else may not.
+      // Sequences of lets are walked in a loop, so long ones don't need a
+      // deep stack.
+      if (dynamic_cast<AST::Let*>(term)) {
+        size_t n_bound = bound.size();
+        while (AST::Let* let = dynamic_cast<AST::Let*>(term)) {
+          const std::string& name = *let->parameter->identifier;
+          bool is_fn = dynamic_cast<AST::Function*>(let->val.get());
+          if (is_fn) bound.push(name, let);
+          collect(let->val.get());
+          if (!is_fn) bound.push(name, let);
+          term = let->next.get();
+        }
+        collect(term);
+        bound.resize(n_bound);
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        unchain(binary, chain);
+        collect(chain.back()->lhs.get());
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) collect((*it)->rhs.get());
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) collect(child->get());
+    }
+  };
+
+  std::vector<std::string> free_variables(AST::Function* fn) {
+    return free_variables(static_cast<AST::Term*>(fn));
+  }
+
+  std::vector<std::string> free_variables(AST::Term* term) {
+    FreeVarCollector collector;
+    collector.collect(term);
+    return collector.free;
+  }
+
+  // Walks an explicit stack of pending terms rather than recursing, as
+  // generated programs can nest very deeply
+  uint32_t cost(AST::Term* root) {
+    uint32_t total = 0;
+    std::vector<AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      AST::Term* term = pending.back();
+      pending.pop_back();
+      if (dynamic_cast<AST::Function*>(term)) {
+        total++;
+        continue;
+      }
+
+      total += dynamic_cast<AST::Call*>(term) ? call_cost : 1;
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) pending.push_back(child->get());
+    }
+    return total;
+  }
+
+  // FNV-1a
+  static void mix(uint64_t& hash, const void* data, size_t size) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 0x100000001b3;
+  }
+
+  static void mix(uint64_t& hash, const std::string& str) {
+    size_t size = str.size();
+    mix(hash, &size, sizeof(size));
+    mix(hash, str.data(), size);
+  }
+
+  // Hashes the terms in preorder, each with its number of children, which
+  // is enough to tell trees apart
+  uint64_t structural_hash(AST::Term* root) {
+    uint64_t hash = 0xcbf29ce484222325;
+    std::vector<AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      AST::Term* term = pending.back();
+      pending.pop_back();
+      mix(hash, typeid(*term).name());
+
+      if (AST::Int* num = dynamic_cast<AST::Int*>(term)) mix(hash, &num->value, sizeof(num->value));
+      else if (AST::Bool* boolean = dynamic_cast<AST::Bool*>(term)) mix(hash, &boolean->val, sizeof(boolean->val));
+      else if (AST::Str* str = dynamic_cast<AST::Str*>(term)) mix(hash, *str->str);
+      else if (AST::Var* var = dynamic_cast<AST::Var*>(term)) mix(hash, *var->name);
+      else if (AST::Call* call = dynamic_cast<AST::Call*>(term)) mix(hash, call->callee);
+      else if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) mix(hash, &binary->binop, sizeof(binary->binop));
+      else if (AST::Let* let = dynamic_cast<AST::Let*>(term)) mix(hash, *let->parameter->identifier);
+      else if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) mix(hash, *param->identifier);
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      size_t n_children = children.size();
+      mix(hash, &n_children, sizeof(n_children));
+      for (auto it = children.rbegin(); it != children.rend(); it++) pending.push_back((*it)->get());
+    }
+    return hash;
+  }
+
+  std::vector<TopLevelBinding> top_level_bindings(AST::Term* program) {
+    std::vector<TopLevelBinding> bindings;
+    std::map<std::string, size_t> bound;        // To the index of its latest binding
+    std::map<std::string, uint32_t> times_bound;
+    for (AST::Term* term = program;;) {
+      AST::Let* let = dynamic_cast<AST::Let*>(term);
+      AST::Term* value = let ? let->val.get() : term;
+      const std::string name = let ? *let->parameter->identifier : "<main>";
+      uint32_t n = ++times_bound[name];
+      TopLevelBinding binding{n == 1 ? name : name + "#" + std::to_string(n), structural_hash(value), {}};
+
+      // A let-bound function may refer to itself, anything else may not
+      bool is_fn = dynamic_cast<AST::Function*>(value);
+      if (let && is_fn) bound[name] = bindings.size();
+      for (const std::string& var : free_variables(value)) {
+        auto it = bound.find(var);
+        if (it != bound.end() && it->second != bindings.size()) binding.uses.push_back(it->second);
+      }
+      if (let && !is_fn) bound[name] = bindings.size();
+
+      bindings.push_back(std::move(binding));
+      if (!let) return bindings;
+      term = let->next.get();
+    }
+  }
+
+  // Resolves every call to the function literal its callee is bound to
+  struct CallResolver {
+    // Names are bound to nullptr if they're bound to something that isn't a
+    // function literal
+    Scope bound;
+    std::map<const AST::Call*, const AST::Function*>& call_targets;
+    std::vector<const AST::Function*>& fns;
+
+    const AST::Function* lookup(const std::string& name) {
+      return static_cast<const AST::Function*>(bound.lookup(name));
+    }
+
+    void resolve(AST::Term* term) {
+      if (AST::Call* call = dynamic_cast<AST::Call*>(term)) call_targets[call] = lookup(call->callee);
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        fns.push_back(fn);
+        size_t n_bound = bound.size();
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) bound.push(*param->identifier, nullptr);
+        resolve(fn->value.get());
+        bound.resize(n_bound);
+        return;
+      }
+
+      // Same scoping as FreeVarCollector
+      if (dynamic_cast<AST::Let*>(term)) {
+        size_t n_bound = bound.size();
+        while (AST::Let* let = dynamic_cast<AST::Let*>(term)) {
+          AST::Function* fn = dynamic_cast<AST::Function*>(let->val.get());
+          if (fn) bound.push(*let->parameter->identifier, fn);
+          resolve(let->val.get());
+          if (!fn) bound.push(*let->parameter->identifier, nullptr);
+          term = let->next.get();
+        }
+        resolve(term);
+        bound.resize(n_bound);
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        unchain(binary, chain);
+        resolve(chain.back()->lhs.get());
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) resolve((*it)->rhs.get());
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) resolve(child->get());
+    }
+  };
+
+  Effects::Effects(AST::Term* root) {
+    std::vector<const AST::Function*> fns;
+    CallResolver resolver{Scope(), call_targets, fns};
+    resolver.resolve(root);
+
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (const AST::Function* fn : fns) {
+        if (impure_fns.count(fn) || !mayPrint(fn->value.get())) continue;
+        impure_fns.insert(fn);
+        changed = true;
+      }
+    }
+  }
+
+  // Function literals only have effects when called, so their bodies are
+  // only looked at through the calls that reach them
+  bool Effects::mayPrint(const AST::Term* root) const {
+    std::vector<const AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      const AST::Term* term = pending.back();
+      pending.pop_back();
+      if (dynamic_cast<const AST::Print*>(term)) return true;
+      if (dynamic_cast<const AST::Function*>(term)) continue;
+
+      if (const AST::Call* call = dynamic_cast<const AST::Call*>(term)) {
+        auto opt_target = call_targets.find(call);
+        if (opt_target == call_targets.end() || !opt_target->second) return true;
+        if (impure_fns.count(opt_target->second)) return true;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      const_cast<AST::Term*>(term)->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) pending.push_back(child->get());
+    }
+    return false;
+  }
+
+  bool Effects::isPure(const AST::Term* term) const {
+    return !mayPrint(term);
+  }
+
+  void Effects::copy(AST::Term* original_root, AST::Term* copy_root) {
+    std::vector<std::pair<AST::Term*, AST::Term*>> pending = {{original_root, copy_root}};
+    while (!pending.empty()) {
+      auto [original, copy] = pending.back();
+      pending.pop_back();
+      if (AST::Call* call = dynamic_cast<AST::Call*>(original)) {
+        auto opt_target = call_targets.find(call);
+        if (opt_target != call_targets.end()) call_targets[static_cast<AST::Call*>(copy)] = opt_target->second;
+      }
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(original)) {
+        if (impure_fns.count(fn)) impure_fns.insert(static_cast<AST::Function*>(copy));
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> original_children, copy_children;
+      original->getChildren(original_children);
+      copy->getChildren(copy_children);
+      for (size_t i = 0; i < original_children.size(); i++) {
+        pending.push_back({original_children[i]->get(), copy_children[i]->get()});
+      }
+    }
+  }
+}
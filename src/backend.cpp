@@ -0,0 +1,137 @@
+#include "backend.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+namespace Backend {
+
+  // Splitting has a cost (cross-partition calls can't be relaxed, every
+  // partition repeats the declarations), so small modules aren't split
+  constexpr uint32_t fns_per_partition = 32;
+  constexpr uint32_t max_partitions = 16;
+
+  [[noreturn]] static void fail(const std::string& msg) {
+    std::cerr << "Error: " << msg << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static uint32_t count_partitions(llvm::Module& module) {
+    uint32_t n_fns = 0;
+    for (llvm::Function& fn : module) if (!fn.isDeclaration()) n_fns++;
+    return std::clamp(n_fns / fns_per_partition, 1u, max_partitions);
+  }
+
+  void initialize() {
+    static std::once_flag initialized;
+    std::call_once(initialized, [] {
+      llvm::InitializeNativeTarget();
+      llvm::InitializeNativeTargetAsmPrinter();
+    });
+  }
+
+  static const llvm::Target* get_target(const std::string& triple) {
+    initialize();
+    std::string error;
+    const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target) fail("no target for " + triple + ": " + error);
+    return target;
+  }
+
+  // Runs code generation for a partition in a context of its own, so
+  // partitions can be compiled at the same time
+  static llvm::SmallString<0> compile_partition(const llvm::SmallString<0>& bitcode) {
+    llvm::LLVMContext context;
+    llvm::MemoryBufferRef buffer(llvm::StringRef(bitcode.data(), bitcode.size()), "partition");
+    llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(buffer, context);
+    if (!module) fail("could not read a partition back: " + llvm::toString(module.takeError()));
+
+    const std::string& triple = (*module)->getTargetTriple();
+    const llvm::Target* target = get_target(triple);
+    std::unique_ptr<llvm::TargetMachine> machine(target->createTargetMachine(
+      triple, "generic", "", llvm::TargetOptions(), llvm::None));
+    (*module)->setDataLayout(machine->createDataLayout());
+
+    llvm::SmallString<0> object;
+    llvm::raw_svector_ostream out(object);
+    llvm::legacy::PassManager passes;
+    if (machine->addPassesToEmitFile(passes, out, nullptr, llvm::CGFT_ObjectFile)) fail("can't emit objects for " + triple);
+    passes.run(**module);
+    return object;
+  }
+
+  static void write_file(const std::string& path, const llvm::SmallString<0>& contents) {
+    std::error_code ec;
+    llvm::raw_fd_ostream out(path, ec);
+    if (ec) fail("could not write " + path + ": " + ec.message());
+    out << contents.str();
+  }
+
+  void emit_object(llvm::Module& module, const std::string& out_file, uint32_t jobs) {
+    // Same default as llc
+    if (module.getTargetTriple().empty()) module.setTargetTriple(llvm::sys::getDefaultTargetTriple());
+
+    std::vector<llvm::SmallString<0>> partitions;
+    uint32_t n_partitions = count_partitions(module);
+    if (n_partitions == 1) {
+      partitions.emplace_back();
+      llvm::raw_svector_ostream out(partitions.back());
+      llvm::WriteBitcodeToFile(module, out);
+    } else {
+      llvm::SplitModule(module, n_partitions, [&partitions](std::unique_ptr<llvm::Module> partition) {
+        partitions.emplace_back();
+        llvm::raw_svector_ostream out(partitions.back());
+        llvm::WriteBitcodeToFile(*partition, out);
+      });
+    }
+
+    std::vector<llvm::SmallString<0>> objects(partitions.size());
+    std::atomic<size_t> next_partition = 0;
+    auto worker = [&]() {
+      for (size_t i = next_partition++; i < partitions.size(); i = next_partition++) {
+        objects[i] = compile_partition(partitions[i]);
+      }
+    };
+
+    if (!jobs) jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < std::min<size_t>(jobs, partitions.size()); i++) threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads) thread.join();
+
+    if (objects.size() == 1) {
+      write_file(out_file, objects[0]);
+      return;
+    }
+
+    // Partitions refer to each other's functions, so they're linked into
+    // one relocatable object
+    const char* ld_env = getenv("LD");
+    llvm::ErrorOr<std::string> ld = llvm::sys::findProgramByName(ld_env && *ld_env ? ld_env : "ld");
+    if (!ld) fail("could not find ld to link the partitions");
+
+    std::vector<std::string> part_files;
+    for (size_t i = 0; i < objects.size(); i++) {
+      part_files.push_back(out_file + ".part" + std::to_string(i) + ".o");
+      write_file(part_files.back(), objects[i]);
+    }
+
+    std::vector<llvm::StringRef> ld_args = {*ld, "-r", "-o", out_file};
+    for (const std::string& part_file : part_files) ld_args.push_back(part_file);
+    std::string error;
+    int status = llvm::sys::ExecuteAndWait(*ld, ld_args, llvm::None, {}, 0, 0, &error);
+    for (const std::string& part_file : part_files) llvm::sys::fs::remove(part_file);
+    if (status != 0) fail("linking the partitions failed" + (error.empty() ? "" : ": " + error));
+  }
+}
@@ -0,0 +1,113 @@
+#include "client.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+static int connect_to(const char* socket_path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0) return -1;
+  if (connect(conn, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    close(conn);
+    return -1;
+  }
+  return conn;
+}
+
+// The number of arguments, then the arguments, all NUL terminated
+static char* make_request(int argc, char* const argv[], size_t* len) {
+  char count[16];
+  snprintf(count, sizeof(count), "%d", argc);
+  *len = strlen(count) + 1;
+  for (int i = 0; i < argc; i++) *len += strlen(argv[i]) + 1;
+
+  char* request = malloc(*len);
+  char* end = stpcpy(request, count) + 1;
+  for (int i = 0; i < argc; i++) end = stpcpy(end, argv[i]) + 1;
+  return request;
+}
+
+// The descriptors go along with the first bytes of the request
+static int send_request(int conn, int cwd, const char* request, size_t len) {
+  int fds[3] = {cwd, STDOUT_FILENO, STDERR_FILENO};
+  union {
+    struct cmsghdr header;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov = {(void*) request, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+  while (sent >= 0 && (size_t) sent < len) {
+    request += sent;
+    len -= sent;
+    sent = send(conn, request, len, MSG_NOSIGNAL);
+  }
+  return sent < 0 ? -1 : 0;
+}
+
+int client_compile(const char* socket_path, int argc, char* const argv[]) {
+  int conn = connect_to(socket_path);
+  if (conn < 0) {
+    fprintf(stderr, "Could not connect to %s: %s\n", socket_path, strerror(errno));
+    return EX_UNAVAILABLE;
+  }
+
+  int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cwd < 0) {
+    fprintf(stderr, "Could not open the working directory: %s\n", strerror(errno));
+    close(conn);
+    return EX_OSERR;
+  }
+
+  // Nothing buffered here may end up after what the server writes
+  fflush(stdout);
+  fflush(stderr);
+
+  size_t len;
+  char* request = make_request(argc, argv, &len);
+  int sent = send_request(conn, cwd, request, len);
+  free(request);
+  close(cwd);
+  if (sent != 0) {
+    fprintf(stderr, "Could not send the request to %s: %s\n", socket_path, strerror(errno));
+    close(conn);
+    return EX_UNAVAILABLE;
+  }
+
+  unsigned char status;
+  ssize_t n;
+  while ((n = read(conn, &status, 1)) < 0 && errno == EINTR) {}
+  close(conn);
+  if (n != 1) {
+    fprintf(stderr, "The server at %s hung up before replying\n", socket_path);
+    return EX_UNAVAILABLE;
+  }
+  return status;
+}
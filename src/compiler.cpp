@@ -3,7 +3,28 @@
 #include "compiler.h"
 #include "parser.tab.h"
 #include "rinha_extern.h"
+#include "stats.h"
+#include "analysis.h"
+#include "inliner.h"
+#include "cse.h"
+#include "deadcode.h"
+#include "accumulator.h"
+#include "runtime.h"
+#include "backend.h"
 #include <ostream>
+#include <set>
+#include <algorithm>
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 
 //==================================
 // Symbol Table
@@ -11,7 +32,9 @@
 
 namespace AST{
   File::File(const std::string& _filename, Term* _term)
-    : filename(_filename), term(_term) {}
+    : filename(_filename), term(_term) {
+    Stats::count_node("File");
+  }
 
   void File::compile() {
     term->getVal();
@@ -19,53 +42,136 @@ namespace AST{
     Compiler::RinhaCompiler::getSingleton().createReturn(ret_val);
   };
 
-  Int::Int(int64_t _value) : value(_value) {}
+  Int::Int(int64_t _value) : value(_value) {
+    Stats::count_node("Int");
+  }
 
   llvm::Value* Int::getVal() {
     Compiler::RinhaCompiler& generator = Compiler::RinhaCompiler::getSingleton();
     return generator.createInt(value);
   }
 
-  Str::Str(std::string* _str) : str(_str) {}
+  Term* Int::clone() {
+    return withLoc(new Int(value));
+  }
+
+  Str::Str(std::string* _str) : str(_str) {
+    Stats::count_node("Str");
+  }
 
   llvm::Value* Str::getVal() {
     Compiler::RinhaCompiler& generator = Compiler::RinhaCompiler::getSingleton();
     return generator.createStr(*str);
   }
 
+  Term* Str::clone() {
+    return withLoc(new Str(new std::string(*str)));
+  }
+
   Arguments::Arguments() = default;
   
   Call::Call(std::string* _callee, Arguments* _args) :
-    callee(*_callee), args(_args) {} 
+    callee(*_callee), args(_args) {
+    Stats::count_node("Call");
+  }
 
   llvm::Value* Call::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
     std::vector<llvm::Value*> args_val;
     for (const std::unique_ptr<AST::Term>& arg : args->args) args_val.push_back(arg.get()->getVal());
     return compiler.callClosure(callee, args_val);
   }
+
+  Term* Call::clone() {
+    Arguments* args_clone = new Arguments();
+    for (const std::unique_ptr<Term>& arg : args->args) args_clone->args.emplace_back(arg->clone());
+    std::string callee_clone = callee;
+    return withLoc(new Call(&callee_clone, args_clone));
+  }
+
+  void Call::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    for (std::unique_ptr<Term>& arg : args->args) children.push_back(&arg);
+  }
   
   Binary::Binary(Term* _lhs, Term* _rhs, BinOp _binop) :
-    lhs(_lhs), rhs(_rhs), binop(_binop) {}
+    lhs(_lhs), rhs(_rhs), binop(_binop) {
+    Stats::count_node("Binary");
+  }
+
+  static bool is_short_circuit(const Binary* binary) {
+    return binary->binop == BinOp::AND || binary->binop == BinOp::OR;
+  }
 
   llvm::Value* Binary::getVal() {
+    Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton(); 
+    // Short-circuiting operators decide themselves whether rhs is evaluated
+    if (is_short_circuit(this)) {
+      Compiler::RinhaCompiler::LocationScope location(compiler, loc);
+      if (binop == BinOp::AND) return compiler.createAnd(lhs.get(), rhs.get());
+      return compiler.createOr(lhs.get(), rhs.get());
+    }
+
+    // Chains of operators (e.g. a + b + c) nest through lhs, so they're
+    // generated from the innermost one out in a loop instead of recursing
+    // once per operator. Operations that fork end the chain.
+    std::vector<Binary*> chain;
+    for (Binary* binary = this; binary && !is_short_circuit(binary); binary = dynamic_cast<Binary*>(binary->lhs.get())) {
+      if (compiler.forks(binary->lhs.get(), binary->rhs.get())) break;
+      chain.push_back(binary);
+    }
+
+    if (chain.empty()) {
+      Compiler::RinhaCompiler::LocationScope location(compiler, loc);
+      return compiler.createBinary(lhs.get(), rhs.get(), [this](llvm::Value* lhs_val, llvm::Value* rhs_val) {
+        return apply(lhs_val, rhs_val);
+      });
+    }
+
+    llvm::Value* val;
+    {
+      Compiler::RinhaCompiler::LocationScope location(compiler, chain.back()->loc);
+      val = chain.back()->lhs->getVal();
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+      Compiler::RinhaCompiler::LocationScope location(compiler, (*it)->loc);
+      val = (*it)->apply(val, (*it)->rhs->getVal());
+    }
+    return val;
+  }
+
+  llvm::Value* Binary::apply(llvm::Value* lhs_val, llvm::Value* rhs_val) {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton(); 
     switch (binop) {
-      case BinOp::PLUS:  return compiler.createAdd(lhs->getVal(), rhs->getVal());
-      case BinOp::MINUS: return compiler.createMinus(lhs->getVal(), rhs->getVal());
-      case BinOp::MULT:  return compiler.createMult(lhs->getVal(), rhs->getVal());
-      case BinOp::DIV:   return compiler.createDiv(lhs->getVal(), rhs->getVal());
-      case BinOp::MOD:   return compiler.createMod(lhs->getVal(), rhs->getVal());
-      case BinOp::EQ:    return compiler.createEq(lhs->getVal(), rhs->getVal());
-      case BinOp::NEQ:   return compiler.createNeq(lhs->getVal(), rhs->getVal());
-      case BinOp::GT:    return compiler.createGt(lhs->getVal(), rhs->getVal());
-      case BinOp::LT:    return compiler.createLt(lhs->getVal(), rhs->getVal());
-      case BinOp::GTE:   return compiler.createGte(lhs->getVal(), rhs->getVal());
-      case BinOp::LTE:   return compiler.createLte(lhs->getVal(), rhs->getVal());
-      case BinOp::AND:   return compiler.createAnd(lhs.get(), rhs.get());
-      case BinOp::OR:    return compiler.createOr(lhs.get(), rhs.get());
-      default:           return nullptr;
+      case BinOp::PLUS:  return compiler.createAdd(lhs_val, rhs_val);
+      case BinOp::MINUS: return compiler.createMinus(lhs_val, rhs_val);
+      case BinOp::MULT:  return compiler.createMult(lhs_val, rhs_val);
+      case BinOp::DIV:   return compiler.createDiv(lhs_val, rhs_val);
+      case BinOp::MOD:   return compiler.createMod(lhs_val, rhs_val);
+      case BinOp::EQ:    return compiler.createEq(lhs_val, rhs_val);
+      case BinOp::NEQ:   return compiler.createNeq(lhs_val, rhs_val);
+      case BinOp::GT:    return compiler.createGt(lhs_val, rhs_val);
+      case BinOp::LT:    return compiler.createLt(lhs_val, rhs_val);
+      case BinOp::GTE:   return compiler.createGte(lhs_val, rhs_val);
+      case BinOp::LTE:   return compiler.createLte(lhs_val, rhs_val);
+      default:           return static_cast<llvm::Value*>(nullptr);
+    }
+  }
+
+  // Copies chains of operators in a loop, see getVal
+  Term* Binary::clone() {
+    std::vector<Binary*> chain;
+    for (Binary* binary = this; binary; binary = dynamic_cast<Binary*>(binary->lhs.get())) chain.push_back(binary);
+    Term* copy = chain.back()->lhs->clone();
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+      copy = (*it)->withLoc(new Binary(copy, (*it)->rhs->clone(), (*it)->binop));
     }
+    return copy;
+  }
+
+  void Binary::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&lhs);
+    children.push_back(&rhs);
   }
 
   Parameter::Parameter(std::string* id) :
@@ -77,82 +183,222 @@ namespace AST{
   Parameters::Parameters() = default;
 
   Function::Function(Parameters* _parameters, Term* _value) :
-    parameters(_parameters), value(std::move(_value)) {}
+    parameters(_parameters), value(std::move(_value)) {
+    Stats::count_node("Function");
+  }
 
   llvm::Value* Function::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
-    std::vector<std::string> param_names;
-    for (const std::unique_ptr<Parameter>& param : parameters->params) param_names.push_back(*param->identifier);
-    return compiler.createAnonClosure(param_names, value.get());
+    return compiler.createAnonClosure(this);
+  }
+
+  Term* Function::clone() {
+    Parameters* params_clone = new Parameters();
+    for (const std::unique_ptr<Parameter>& param : parameters->params) {
+      params_clone->params.emplace_back(new Parameter(new std::string(*param->identifier)));
+    }
+    return withLoc(new Function(params_clone, value->clone()));
+  }
+
+  llvm::Value* Function::getNamedVal(const std::string& name) {
+    Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
+    return compiler.createAnonClosure(this, name);
+  }
+
+  void Function::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&value);
   }
 
   Let::Let(Parameter* _parameter, Term* _val, Term* _next) :
-    parameter(_parameter), val(_val), next(_next) {}
+    parameter(_parameter), val(_val), next(_next) {
+    Stats::count_node("Let");
+  }
 
+  // Sequences of lets are generated in a loop, so long ones don't need a
+  // deep stack
   llvm::Value* Let::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
-    llvm::Value* eval_val = val->getVal();
-    if (compiler.isClosure(eval_val)) compiler.assignClosure(*parameter->identifier, eval_val);
-    else compiler.createVariable(*parameter->identifier, val->getVal());
-    return next->getVal();
+    Term* term = this;
+    while (Let* let = dynamic_cast<Let*>(term)) {
+      const std::string& name = *let->parameter->identifier;
+      Function* fn = dynamic_cast<Function*>(let->val.get());
+      llvm::Value* eval_val = fn ? fn->getNamedVal(name) : let->val->getVal();
+      if (compiler.isClosure(eval_val)) compiler.assignClosure(name, eval_val);
+      else compiler.createVariable(name, eval_val);
+      term = let->next.get();
+    }
+    return term->getVal();
+  }
+
+  Term* Let::clone() {
+    Let* copy = nullptr;
+    std::unique_ptr<Term>* next_copy = nullptr;
+    Term* term = this;
+    while (Let* let = dynamic_cast<Let*>(term)) {
+      Let* let_copy = static_cast<Let*>(let->withLoc(new Let(new Parameter(new std::string(*let->parameter->identifier)), let->val->clone(), nullptr)));
+      if (next_copy) next_copy->reset(let_copy);
+      else copy = let_copy;
+      next_copy = &let_copy->next;
+      term = let->next.get();
+    }
+    next_copy->reset(term->clone());
+    return copy;
+  }
+
+  void Let::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&val);
+    children.push_back(&next);
   }
 
   If::If(Term* _condition, Term* _then, Term* _orElse) :
-    condition(_condition), then(_then), orElse(_orElse) {}
+    condition(_condition), then(_then), orElse(_orElse) {
+    Stats::count_node("If");
+  }
 
   llvm::Value* If::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
     return compiler.createIfElse(condition.get(), then.get(), orElse.get());
   }
 
+  Term* If::clone() {
+    return withLoc(new If(condition->clone(), then->clone(), orElse->clone()));
+  }
+
+  void If::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&condition);
+    children.push_back(&then);
+    children.push_back(&orElse);
+  }
+
   Print::Print(Term* _arg) :
-    arg(_arg) {}
+    arg(_arg) {
+    Stats::count_node("Print");
+  }
 
   llvm::Value* Print::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
     return compiler.print(arg->getVal());
   }
 
+  Term* Print::clone() {
+    return withLoc(new Print(arg->clone()));
+  }
+
+  void Print::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&arg);
+  }
+
   First::First(Term* _arg) :
-    arg(_arg) {}
+    arg(_arg) {
+    Stats::count_node("First");
+  }
 
   llvm::Value* First::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton(); 
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
     return compiler.getTupleFirst(arg->getVal());
   }
 
+  Term* First::clone() {
+    return withLoc(new First(arg->clone()));
+  }
+
+  void First::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&arg);
+  }
+
   Second::Second(Term* _arg) :
-    arg(_arg) {}
+    arg(_arg) {
+    Stats::count_node("Second");
+  }
 
   llvm::Value* Second::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
     return compiler.getTupleSecond(arg->getVal());
   }
 
+  Term* Second::clone() {
+    return withLoc(new Second(arg->clone()));
+  }
+
+  void Second::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&arg);
+  }
+
   Bool::Bool(bool _val) :
-    val(_val) {};
+    val(_val) {
+    Stats::count_node("Bool");
+  }
 
   llvm::Value* Bool::getVal() {
     Compiler::RinhaCompiler& generator = Compiler::RinhaCompiler::getSingleton();
     return generator.createBool(val); 
   }
 
+  Term* Bool::clone() {
+    return withLoc(new Bool(val));
+  }
+
   Tuple::Tuple(Term* _first, Term* _second) :
-    first(_first), second(_second) {}
+    first(_first), second(_second) {
+    Stats::count_node("Tuple");
+  }
 
+  // Lists written as nested tuples (e.g. (1, (2, (3, 0)))) nest through
+  // second, so their heads are generated in a loop and the cells laid out
+  // together, see createList
   llvm::Value* Tuple::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
-    return compiler.createTuple(first->getVal(), second->getVal());
+    std::vector<Tuple*> chain;
+    for (Tuple* tuple = this; tuple; tuple = dynamic_cast<Tuple*>(tuple->second.get())) chain.push_back(tuple);
+
+    std::vector<llvm::Value*> heads;
+    for (Tuple* tuple : chain) {
+      Compiler::RinhaCompiler::LocationScope location(compiler, tuple->loc);
+      heads.push_back(tuple->first->getVal());
+    }
+    llvm::Value* tail;
+    {
+      Compiler::RinhaCompiler::LocationScope location(compiler, chain.back()->loc);
+      tail = chain.back()->second->getVal();
+    }
+    Compiler::RinhaCompiler::LocationScope location(compiler, loc);
+    return compiler.createList(heads, tail);
+  }
+
+  // Copies lists in a loop, see getVal
+  Term* Tuple::clone() {
+    std::vector<Tuple*> chain;
+    for (Tuple* tuple = this; tuple; tuple = dynamic_cast<Tuple*>(tuple->second.get())) chain.push_back(tuple);
+    Term* copy = chain.back()->second->clone();
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+      copy = (*it)->withLoc(new Tuple((*it)->first->clone(), copy));
+    }
+    return copy;
+  }
+
+  void Tuple::getChildren(std::vector<std::unique_ptr<Term>*>& children) {
+    children.push_back(&first);
+    children.push_back(&second);
   }
 
   Var::Var(std::string* _name) :
-    name(_name) {};
+    name(_name) {
+    Stats::count_node("Var");
+  }
 
   llvm::Value* Var::getVal() {
     Compiler::RinhaCompiler& compiler = Compiler::RinhaCompiler::getSingleton();
     return compiler.getVariable(*name);
   }
 
+  Term* Var::clone() {
+    return withLoc(new Var(new std::string(*name)));
+  }
+
 }
 
 namespace Compiler {
@@ -162,6 +408,7 @@ namespace Compiler {
   }
 
   EitherValOrClosure* SymbolTableStack::getValue(const std::string& id) {
+    Stats::increment(Stats::Counter::SYMBOL_LOOKUPS);
     for (auto it = symbol_tables.rbegin(); it != symbol_tables.rend(); it++) {
       SymbolTable::iterator descriptor = it->find(id);
       if (descriptor != it->end()) return &descriptor->second;
@@ -173,8 +420,8 @@ namespace Compiler {
     symbol_tables.back()[name] = {val, nullptr};
   }
 
-  void SymbolTableStack::insertClosure(const std::string& name, ClosureSignature* closure_sig) {
-    symbol_tables.back()[name] = {nullptr, closure_sig};
+  void SymbolTableStack::insertClosure(const std::string& name, Closure* closure) {
+    symbol_tables.back()[name] = {closure->marker, closure};
   }
  
   void SymbolTableStack::pushScope() {
@@ -187,30 +434,81 @@ namespace Compiler {
   
   std::unique_ptr<AST::File> ast_root;
   RinhaCompiler* RinhaCompiler::singleton = nullptr;
+  // Starts the key of generic specializations, so they never share a cache
+  // entry with the specializations created before the budget ran out
+  static const char generic_key_tag = 0;
 
-  RinhaCompiler::RinhaCompiler(const std::string& input_file) :
+  RinhaCompiler::RinhaCompiler(const std::string& input_file, const CompileOptions& _options) :
     builder(context),
     module(input_file, context),
     filename(input_file),
-    default_type(builder.getInt32Ty()) {};
+    options(_options),
+    main_fn(nullptr),
+    default_type(builder.getInt32Ty()),
+    str_type(nullptr) {};
 
   bool RinhaCompiler::isInitialized() { return singleton != nullptr; }
 
   llvm::Function* RinhaCompiler::createMain() {
     llvm::FunctionType* main_fn_type = llvm::FunctionType::get(llvm::Type::getInt32Ty(context), {}, false);
     llvm::Function* main = llvm::Function::Create(main_fn_type, llvm::Function::ExternalLinkage, "main", module);
+    main->addFnAttr(llvm::Attribute::NoUnwind);
     llvm::BasicBlock* main_entry = llvm::BasicBlock::Create(context, "entry", main);
     builder.SetInsertPoint(main_entry);
+    enterFunction(main, "main", {1, 1});
 
     return main;
   }
 
-  RinhaCompiler& RinhaCompiler::initialize(const std::string& input_file) {  
+  void RinhaCompiler::initializeDebugInfo() {
+    module.addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+    module.addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+
+    llvm::SmallString<128> dir;
+    llvm::sys::fs::current_path(dir);
+    di_builder.reset(new llvm::DIBuilder(module));
+    di_file = di_builder->createFile(filename, dir);
+    // There's no DWARF language code for Rinha, and C makes tools fall back
+    // to showing plain source lines
+    di_builder->createCompileUnit(llvm::dwarf::DW_LANG_C, di_file, "vladpiler", options.opt_level > 0, "", 0);
+    di_fn_type = di_builder->createSubroutineType(di_builder->getOrCreateTypeArray({}));
+  }
+
+  llvm::DebugLoc RinhaCompiler::enterFunction(llvm::Function* fn, const std::string& name, const AST::Localization& loc) {
+    llvm::DebugLoc previous = builder.getCurrentDebugLocation();
+    if (!di_builder) return previous;
+
+    llvm::DISubprogram::DISPFlags flags = llvm::DISubprogram::SPFlagDefinition;
+    if (fn->hasLocalLinkage()) flags |= llvm::DISubprogram::SPFlagLocalToUnit;
+    if (options.opt_level) flags |= llvm::DISubprogram::SPFlagOptimized;
+    llvm::StringRef linkage_name = fn->getName() == name ? "" : fn->getName();
+    llvm::DISubprogram* subprogram = di_builder->createFunction(
+      di_file, name, linkage_name, di_file, loc.beginLine, di_fn_type, loc.beginLine, llvm::DINode::FlagPrototyped, flags
+    );
+    fn->setSubprogram(subprogram);
+    builder.SetCurrentDebugLocation(llvm::DILocation::get(context, loc.beginLine, loc.beginColumn, subprogram));
+    return previous;
+  }
+
+  llvm::DebugLoc RinhaCompiler::setLocation(const AST::Localization& loc) {
+    llvm::DebugLoc previous = builder.getCurrentDebugLocation();
+    if (!di_builder || !loc.beginLine) return previous;
+    llvm::DISubprogram* subprogram = builder.GetInsertBlock()->getParent()->getSubprogram();
+    if (subprogram) builder.SetCurrentDebugLocation(llvm::DILocation::get(context, loc.beginLine, loc.beginColumn, subprogram));
+    return previous;
+  }
+
+  void RinhaCompiler::restoreLocation(const llvm::DebugLoc& loc) {
+    builder.SetCurrentDebugLocation(loc);
+  }
+
+  RinhaCompiler& RinhaCompiler::initialize(const std::string& input_file, const CompileOptions& options) {  
     if (isInitialized()) throw std::runtime_error("IRGenerator is already initialized.");
-    singleton = new RinhaCompiler(input_file);
+    singleton = new RinhaCompiler(input_file, options);
     RinhaCompiler& generator = *singleton;
     generator.externInsertPoint = generator.builder.saveIP();
-    generator.createMain();
+    if (options.debug_info) generator.initializeDebugInfo();
+    generator.main_fn = generator.createMain();
     
     return *singleton;
   };
@@ -226,6 +524,360 @@ namespace Compiler {
     module.print(ostream, nullptr);
   };
 
+  void RinhaCompiler::emitObject(const std::string& out_file) {
+    Backend::emit_object(module, out_file, options.jobs);
+  }
+
+  uint64_t RinhaCompiler::getInstructionCount() {
+    return module.getInstructionCount();
+  }
+
+  //==================================
+  // Instrumentation (--instrument)
+  //==================================
+
+  llvm::StructType* RinhaCompiler::getProfEntryType() {
+    if (prof_entry_type) return prof_entry_type;
+    // Mirrors struct rinha_prof_entry: { name, calls, cycles, depth }
+    llvm::Type* i64 = builder.getInt64Ty();
+    prof_entry_type = llvm::StructType::create(context, {builder.getInt8PtrTy(), i64, i64, i64}, "rinha_prof_entry");
+    return prof_entry_type;
+  }
+
+  /*  Counts the call and returns the cycle counter at entry. The counters
+      are plain loads/stores: --parallel and --instrument are mutually
+      exclusive (main.cpp rejects the combination), so only one thread runs
+      compiled code that touches them.
+
+      Inclusive time is only accumulated when the outermost activation of
+      a specialization returns (tracked through depth), so recursion does not
+      count the same cycles more than once.
+  */
+  llvm::Value* RinhaCompiler::instrumentEntry(llvm::Function* fn) {
+    llvm::StructType* entry_type = getProfEntryType();
+    llvm::GlobalVariable* entry = createGlobal(entry_type, false, llvm::ConstantAggregateZero::get(entry_type), "prof");
+    prof_entries.push_back({fn, entry});
+
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::Value* calls_ptr = builder.CreateStructGEP(entry_type, entry, 1);
+    llvm::Value* depth_ptr = builder.CreateStructGEP(entry_type, entry, 3);
+    builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, calls_ptr), builder.getInt64(1)), calls_ptr);
+    builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, depth_ptr), builder.getInt64(1)), depth_ptr);
+    return builder.CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "entry_tsc");
+  }
+
+  void RinhaCompiler::instrumentExit(llvm::Function* fn, llvm::Value* entry_tsc) {
+    llvm::StructType* entry_type = getProfEntryType();
+    llvm::GlobalVariable* entry = nullptr;
+    for (auto it = prof_entries.rbegin(); it != prof_entries.rend() && !entry; it++) {
+      if (it->first == fn) entry = it->second;
+    }
+    assert(entry);
+
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::Value* exit_tsc = builder.CreateIntrinsic(llvm::Intrinsic::readcyclecounter, {}, {}, nullptr, "exit_tsc");
+    llvm::Value* cycles_ptr = builder.CreateStructGEP(entry_type, entry, 2);
+    llvm::Value* depth_ptr = builder.CreateStructGEP(entry_type, entry, 3);
+    llvm::Value* depth = builder.CreateSub(builder.CreateLoad(i64, depth_ptr), builder.getInt64(1));
+    builder.CreateStore(depth, depth_ptr);
+
+    llvm::Value* outermost = builder.CreateICmpEQ(depth, builder.getInt64(0));
+    llvm::Value* elapsed = builder.CreateSelect(outermost, builder.CreateSub(exit_tsc, entry_tsc), builder.getInt64(0));
+    builder.CreateStore(builder.CreateAdd(builder.CreateLoad(i64, cycles_ptr), elapsed), cycles_ptr);
+  }
+
+  void RinhaCompiler::finalizeInstrumentation() {
+    llvm::StructType* entry_type = getProfEntryType();
+    llvm::Type* ptr = builder.getInt8PtrTy();
+    std::vector<llvm::Constant*> table;
+    for (auto& [fn, entry] : prof_entries) {
+      llvm::Constant* name = builder.CreateGlobalStringPtr(fn->getName(), "prof_name", 0, &module);
+      entry->setInitializer(llvm::ConstantStruct::get(entry_type, {
+        llvm::ConstantExpr::getPointerCast(name, ptr),
+        builder.getInt64(0), builder.getInt64(0), builder.getInt64(0)
+      }));
+      table.push_back(llvm::ConstantExpr::getPointerCast(entry, ptr));
+    }
+
+    llvm::ArrayType* table_type = llvm::ArrayType::get(ptr, table.size());
+    llvm::GlobalVariable* table_global = createGlobal(table_type, true, llvm::ConstantArray::get(table_type, table), "prof_table");
+
+    llvm::IRBuilder<>::InsertPoint previous_point = builder.saveIP();
+    llvm::BasicBlock& main_entry = main_fn->getEntryBlock();
+    builder.SetInsertPoint(&main_entry, main_entry.getFirstInsertionPt());
+    llvm::Function* prof_init = getExternFunction(builder.getVoidTy(), {ptr, builder.getInt32Ty()}, "rinha_prof_init");
+    builder.CreateCall(prof_init, {
+      llvm::ConstantExpr::getPointerCast(table_global, ptr),
+      builder.getInt32(table.size())
+    });
+    builder.restoreIP(previous_point);
+  }
+
+  void RinhaCompiler::finalize() {
+    if (options.instrument) finalizeInstrumentation();
+    if (di_builder) di_builder->finalize();
+
+    // Closures that never needed a runtime representation leave their
+    // markers unused
+    for (auto& [marker, closure] : closure_table) {
+      llvm::GlobalVariable* global = llvm::dyn_cast<llvm::GlobalVariable>(marker);
+      if (global && global->use_empty()) global->eraseFromParent();
+    }
+
+    if (options.verify) verify("generated by the compiler");
+
+    Stats::PhaseTimer timer(Stats::Phase::OPTIMIZE);
+    if (options.runtime != RuntimeKind::EXTERNAL) linkRuntime();
+    if (options.opt_level) optimize();
+    if (options.verify) verify("after optimization");
+  }
+
+  //==================================
+  // Runtime linking and optimization
+  //==================================
+
+  /*  Links in the parts of the runtime the program uses. They're internalized,
+      so the optimizer can inline them (e.g. print helpers become a printf
+      with a constant format) and drop whatever ends up unused.
+
+      The minimal runtime is linked whole instead: nothing in the program
+      refers to its _start, nor to the memory functions the backend may emit
+      calls to, and those have to stay external.
+  */
+  void RinhaCompiler::linkRuntime() {
+    bool minimal = options.runtime == RuntimeKind::MINIMAL;
+    static const llvm::StringSet<> kept_external = {"_start", "memcpy", "memmove", "memset", "memcmp"};
+    llvm::StringRef bitcode = minimal ? Runtime::minimal_bitcode() : Runtime::libc_bitcode();
+    std::unique_ptr<llvm::MemoryBuffer> buffer = llvm::MemoryBuffer::getMemBuffer(bitcode, "rinha_runtime", false);
+    llvm::Expected<std::unique_ptr<llvm::Module>> runtime = llvm::parseBitcodeFile(buffer->getMemBufferRef(), context);
+    if (!runtime) {
+      std::cerr << "Error: could not read the embedded runtime: " << llvm::toString(runtime.takeError()) << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    // The generated code is target independent, so adopt the runtime's target
+    module.setTargetTriple((*runtime)->getTargetTriple());
+    module.setDataLayout((*runtime)->getDataLayout());
+
+    unsigned flags = minimal ? llvm::Linker::Flags::None : llvm::Linker::Flags::LinkOnlyNeeded;
+    bool failed = llvm::Linker::linkModules(module, std::move(*runtime), flags,
+      [minimal](llvm::Module& linked, const llvm::StringSet<>& runtime_symbols) {
+        llvm::internalizeModule(linked, [&runtime_symbols, minimal](const llvm::GlobalValue& global) {
+          if (!global.hasName() || !runtime_symbols.count(global.getName())) return true;
+          return minimal && kept_external.count(global.getName()) > 0;
+        });
+      });
+    if (failed) {
+      std::cerr << "Error: could not link the runtime" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  void RinhaCompiler::verify(const std::string& stage) {
+    Stats::PhaseTimer timer(Stats::Phase::VERIFY);
+    std::string errors;
+    llvm::raw_string_ostream errors_stream(errors);
+    if (!llvm::verifyModule(module, &errors_stream)) return;
+
+    std::cerr << "Error: invalid IR " << stage << ":" << std::endl << errors_stream.str();
+    exit(EXIT_FAILURE);
+  }
+
+  /*  Remarks name the function they're about, and specializations are named
+      after the Rinha function they come from (see ClosureSignature::name).
+  */
+  void RinhaCompiler::optimize() {
+    std::unique_ptr<llvm::ToolOutputFile> remarks;
+    if (!options.remarks_file.empty()) {
+      llvm::Expected<std::unique_ptr<llvm::ToolOutputFile>> opt_remarks = llvm::setupLLVMOptimizationRemarks(
+        context, options.remarks_file, options.remarks_filter, options.remarks_format, false);
+      if (!opt_remarks) {
+        std::cerr << "Error: could not write remarks: " << llvm::toString(opt_remarks.takeError()) << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      remarks = std::move(*opt_remarks);
+    }
+
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassBuilder pass_builder;
+    pass_builder.registerModuleAnalyses(mam);
+    pass_builder.registerCGSCCAnalyses(cgam);
+    pass_builder.registerFunctionAnalyses(fam);
+    pass_builder.registerLoopAnalyses(lam);
+    pass_builder.crossRegisterProxies(lam, fam, cgam, mam);
+
+    llvm::OptimizationLevel level = options.opt_level == 1 ? llvm::OptimizationLevel::O1
+      : options.opt_level == 2 ? llvm::OptimizationLevel::O2
+      : llvm::OptimizationLevel::O3;
+    llvm::ModulePassManager passes = pass_builder.buildPerModuleDefaultPipeline(level);
+    passes.run(module, mam);
+
+    if (remarks) {
+      context.setMainRemarkStreamer(nullptr);
+      context.setLLVMRemarkStreamer(nullptr);
+      remarks->keep();
+    }
+  }
+
+  //==================================
+  // Fork-join parallelism (--parallel)
+  //==================================
+
+  void RinhaCompiler::analyze(AST::Term* root) {
+    if (options.parallel) effects = std::make_unique<Analysis::Effects>(root);
+  }
+
+  bool RinhaCompiler::forks(AST::Term* lhs, AST::Term* rhs) {
+    return options.parallel && shouldFork(lhs, rhs);
+  }
+
+  llvm::Value* RinhaCompiler::createBinary(AST::Term* lhs, AST::Term* rhs, const BinaryOp& op) {
+    if (forks(lhs, rhs)) return createForkJoin(lhs, rhs, op);
+    llvm::Value* lhs_val = lhs->getVal();
+    return op(lhs_val, rhs->getVal());
+  }
+
+  // Running rhs on another thread only pays off if lhs keeps this one busy
+  // in the meantime, so both have to be above the cutoff
+  bool RinhaCompiler::shouldFork(AST::Term* lhs, AST::Term* rhs) {
+    if (n_sequential_copies) return false;
+    // rhs first: in a long chain of operators lhs is the expensive one to measure
+    if (Analysis::cost(rhs) < options.parallel_cutoff || Analysis::cost(lhs) < options.parallel_cutoff) return false;
+    return effects->isPure(lhs) && effects->isPure(rhs);
+  }
+
+  llvm::StructType* RinhaCompiler::getTaskType() {
+    if (task_type) return task_type;
+    task_type = llvm::StructType::create(context, {builder.getInt8PtrTy(), builder.getInt64Ty()}, "rinha_task");
+    return task_type;
+  }
+
+  // The task, then fn's result, then fn's arguments
+  llvm::StructType* RinhaCompiler::getTaskFrameType(llvm::Function* fn) {
+    std::vector<llvm::Type*> fields = {getTaskType(), fn->getReturnType()};
+    for (llvm::Argument& arg : fn->args()) fields.push_back(arg.getType());
+    return llvm::StructType::get(context, fields);
+  }
+
+  llvm::Function* RinhaCompiler::getTaskEntry(llvm::Function* fn) {
+    auto opt_entry = task_entries.find(fn);
+    if (opt_entry != task_entries.end()) return opt_entry->second;
+
+    llvm::StructType* frame_type = getTaskFrameType(fn);
+    llvm::FunctionType* entry_type = llvm::FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()}, false);
+    llvm::Function* entry = llvm::Function::Create(entry_type, llvm::Function::InternalLinkage, fn->getName() + ".task", module);
+    entry->addFnAttr(llvm::Attribute::NoUnwind);
+
+    llvm::IRBuilder<>::InsertPoint previous_point = builder.saveIP();
+    builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", entry));
+    llvm::DISubprogram* fn_subprogram = fn->getSubprogram();
+    llvm::DebugLoc previous_loc = fn_subprogram ?
+      enterFunction(entry, entry->getName().str(), {fn_subprogram->getLine(), 0}) :
+      builder.getCurrentDebugLocation();
+    llvm::Value* frame = entry->getArg(0);
+    std::vector<llvm::Value*> args;
+    for (llvm::Argument& arg : fn->args()) {
+      llvm::Value* arg_ptr = builder.CreateStructGEP(frame_type, frame, 2 + arg.getArgNo());
+      args.push_back(builder.CreateLoad(arg.getType(), arg_ptr, "captured"));
+    }
+    llvm::CallInst* ret = builder.CreateCall(fn, args, "ret");
+    ret->setCallingConv(fn->getCallingConv());
+    builder.CreateStore(ret, builder.CreateStructGEP(frame_type, frame, 1));
+    builder.CreateRetVoid();
+    builder.restoreIP(previous_point);
+    restoreLocation(previous_loc);
+
+    // Goes away together with fn (see discardSpecializations)
+    specializations.push_back({std::make_shared<ClosureInstanceNode>(), entry});
+    task_entries[fn] = entry;
+    return entry;
+  }
+
+  /*  The operation is generated twice, and which copy runs depends on
+      whether some thread is out of work at that point. The sequential copy
+      is the plain code (forking nothing inside of it), so it costs one load
+      over not using --parallel, and LLVM can still optimize it as usual
+      (e.g. turn fib's recursion into a loop). In the other one rhs becomes
+      a thunk that is handed to the runtime as a task while lhs is evaluated
+      here. The join runs the task right here if no other thread took it.
+  */
+  llvm::Value* RinhaCompiler::createForkJoin(AST::Term* lhs, AST::Term* rhs, const BinaryOp& op) {
+    llvm::Function* parent = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* check_block = builder.GetInsertBlock();
+    llvm::BasicBlock* seq_block = llvm::BasicBlock::Create(context, "sequential", parent);
+    builder.SetInsertPoint(seq_block);
+    n_sequential_copies++;
+    enterRegion();
+    llvm::Value* lhs_seq_val = lhs->getVal();
+    llvm::Value* seq_val = op(lhs_seq_val, rhs->getVal());
+    leaveRegion(seq_val, false);
+    n_sequential_copies--;
+    llvm::BasicBlock* seq_end = builder.GetInsertBlock();
+
+    std::unique_ptr<AST::Function>& thunk = fork_thunks[rhs];
+    if (!thunk) {
+      thunk.reset(new AST::Function(new AST::Parameters(), rhs->clone()));
+      thunk->loc = rhs->loc;
+      effects->copy(rhs, thunk->value.get());
+    }
+    builder.SetInsertPoint(check_block);
+    Closure* closure = closure_table[createAnonClosure(thunk.get())];
+    std::vector<llvm::Value*> args, leaves;
+    llvm::Function* fn = getSpecialization(closure, args, leaves);
+
+    // Only plain values can come back through the result slot
+    llvm::Type* ret_type = fn->getReturnType();
+    if (!ret_type->isIntegerTy() || fn_ret_closure.count(fn) || !seq_val->getType()->isIntegerTy()) {
+      builder.CreateBr(seq_block);
+      builder.SetInsertPoint(seq_end);
+      return seq_val;
+    }
+
+    llvm::GlobalVariable* hungry = llvm::cast<llvm::GlobalVariable>(module.getOrInsertGlobal("rinha_par_hungry", builder.getInt32Ty()));
+    // The runtime is always linked into the executable itself
+    hungry->setDSOLocal(true);
+    llvm::LoadInst* n_hungry = builder.CreateAlignedLoad(builder.getInt32Ty(), hungry, llvm::Align(4), "hungry");
+    n_hungry->setAtomic(llvm::AtomicOrdering::Monotonic);
+    llvm::BasicBlock* fork_block = llvm::BasicBlock::Create(context, "fork", parent);
+    builder.CreateCondBr(builder.CreateICmpNE(n_hungry, builder.getInt32(0)), fork_block, seq_block);
+
+    llvm::Type* ptr = builder.getInt8PtrTy();
+    builder.SetInsertPoint(fork_block);
+    llvm::StructType* frame_type = getTaskFrameType(fn);
+    llvm::AllocaInst* frame = createEntryAlloca(frame_type, "task");
+    builder.CreateStore(getTaskEntry(fn), builder.CreateStructGEP(getTaskType(), frame, 0));
+    for (uint32_t i = 0; i < leaves.size(); i++) {
+      builder.CreateStore(leaves[i], builder.CreateStructGEP(frame_type, frame, 2 + i));
+    }
+    builder.CreateCall(getExternFunction(builder.getVoidTy(), {ptr}, "rinha_par_fork"), {frame});
+    enterRegion();
+    llvm::Value* lhs_val = lhs->getVal();
+    builder.CreateCall(getExternFunction(builder.getVoidTy(), {ptr}, "rinha_par_join"), {frame});
+    llvm::Value* rhs_val = builder.CreateLoad(ret_type, builder.CreateStructGEP(frame_type, frame, 1), "forked");
+    llvm::Value* par_val = op(lhs_val, rhs_val);
+    leaveRegion(par_val, false);
+    llvm::BasicBlock* par_end = builder.GetInsertBlock();
+    if (par_val->getType() != seq_val->getType()) {
+      std::cerr << "Error: operands evaluated in parallel don't match the sequential ones" << std::endl;
+      abort();
+    }
+
+    llvm::BasicBlock* end_block = llvm::BasicBlock::Create(context, "join_end", parent);
+    builder.CreateBr(end_block);
+    builder.SetInsertPoint(seq_end);
+    builder.CreateBr(end_block);
+    builder.SetInsertPoint(end_block);
+    llvm::PHINode* phi = builder.CreatePHI(seq_val->getType(), 2, "join_phi");
+    phi->addIncoming(par_val, par_end);
+    phi->addIncoming(seq_val, seq_end);
+
+    Stats::increment(Stats::Counter::PARALLEL_FORKS);
+    return phi;
+  }
+
   llvm::FunctionType* RinhaCompiler::getDefaultFnType(uint32_t n_args) {
     std::vector<llvm::Type*> args;
     for (uint32_t i = 0; i < n_args; i++) {
@@ -246,136 +898,499 @@ namespace Compiler {
       abort();
     }
 
-    ClosureSignature* closure = &opt_closure->second;
-    symtbl_stack.insertClosure(name, closure);
+    symtbl_stack.insertClosure(name, opt_closure->second);
     return val;
   }
 
-  llvm::Value* RinhaCompiler::createAnonClosure(const std::vector<std::string>& params, AST::Term* fn_body) {
-    llvm::Value* closure = createClosureVal();
-    closure_table[closure] = {params, fn_body};
+  llvm::Value* RinhaCompiler::createAnonClosure(AST::Function* fn, const std::string& self_name) {
+    auto opt_sig = closure_sigs.find(fn);
+    if (opt_sig == closure_sigs.end()) {
+      ClosureSignature& sig = closure_sigs[fn];
+      sig.name = self_name.empty() ? "lambda" : self_name;
+      sig.self_name = self_name;
+      for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) sig.params.push_back(*param->identifier);
+      sig.fn_body = fn->value.get();
+      sig.loc = fn->loc;
+      // A function is always defined at the same place, so the names bound
+      // there are the same every time it's evaluated
+      for (const std::string& name : Analysis::free_variables(fn)) {
+        if (name != self_name && symtbl_stack.getValue(name)) sig.captures.push_back(name);
+      }
+      opt_sig = closure_sigs.find(fn);
+    }
+
+    ClosureSignature* sig = &opt_sig->second;
+    closures.push_back({sig, {}, createClosureVal()});
+    Closure* closure = &closures.back();
+    for (const std::string& name : sig->captures) closure->env.push_back(*symtbl_stack.getValue(name));
+    closure_table[closure->marker] = closure;
+    return closure->marker;
+  }
+
+  void RinhaCompiler::copyPtrId(llvm::Value* from, llvm::Value* to) {
+    auto opt_id = ptr_id_table.find(from);
+    if (opt_id != ptr_id_table.end()) ptr_id_table[to] = opt_id->second;
+  }
+
+  void RinhaCompiler::appendValueKey(llvm::Value* val, std::vector<const void*>& key) {
+    key.push_back(val->getType());
+    // Pointers only differ by what they point to (e.g. strings vs. tuples)
+    if (val->getType()->isPointerTy()) key.push_back(lookupPtrType(val));
+  }
+
+  /*  Captured constants (e.g. literals, or another top-level function's
+      marker) are not passed around at all, so they become part of the key:
+      the specialization uses them directly.
+  */
+  bool RinhaCompiler::isKeyedConstant(llvm::Value* val, bool generic) {
+    return llvm::isa<llvm::Constant>(val) && !(generic && val->getType()->isIntegerTy());
+  }
+
+  void RinhaCompiler::appendClosureKey(Closure* closure, std::vector<const void*>& key, bool generic) {
+    key.push_back(closure->sig);
+    for (const EitherValOrClosure& entry : closure->env) {
+      if (entry.closure) appendClosureKey(entry.closure, key, generic);
+      else if (isKeyedConstant(entry.val, generic)) key.push_back(entry.val);
+      else appendValueKey(entry.val, key);
+    }
+    key.push_back(nullptr);
+  }
+
+  void RinhaCompiler::appendClosureLeaves(Closure* closure, std::vector<llvm::Value*>& leaves, bool generic) {
+    for (const EitherValOrClosure& entry : closure->env) {
+      if (entry.closure) appendClosureLeaves(entry.closure, leaves, generic);
+      else if (!isKeyedConstant(entry.val, generic)) leaves.push_back(entry.val);
+    }
+  }
+
+  // Creates a closure shaped like shape whose captured values are taken from
+  // leaf onwards, in the order given by appendClosureLeaves
+  Closure* RinhaCompiler::rebuildClosure(Closure* shape, std::vector<llvm::Value*>::const_iterator& leaf, bool generic) {
+    std::vector<EitherValOrClosure> env;
+    for (const EitherValOrClosure& entry : shape->env) {
+      if (entry.closure) {
+        Closure* closure = rebuildClosure(entry.closure, leaf, generic);
+        env.push_back({closure->marker, closure});
+      } else if (isKeyedConstant(entry.val, generic)) {
+        env.push_back(entry);
+      } else {
+        llvm::Value* val = *leaf++;
+        copyPtrId(entry.val, val);
+        env.push_back({val, nullptr});
+      }
+    }
+
+    closures.push_back({shape->sig, std::move(env), createClosureVal()});
+    Closure* closure = &closures.back();
+    closure_table[closure->marker] = closure;
     return closure;
   }
 
-  void RinhaCompiler::_insertCachedClosure(const std::vector<llvm::Type*>& params, uint64_t param_it, std::shared_ptr<ClosureInstanceNode> node, llvm::Function* fn) {
-    if (param_it >= params.size()){
+  // Copies the captured values to a heap record, so the closure may outlive
+  // the function that created it
+  llvm::Value* RinhaCompiler::materializeClosure(Closure* closure) {
+    std::vector<llvm::Value*> leaves;
+    appendClosureLeaves(closure, leaves);
+
+    llvm::Value* record = closure->marker;
+    if (!leaves.empty()) {
+      std::vector<llvm::Type*> leaf_types;
+      for (llvm::Value* leaf : leaves) leaf_types.push_back(leaf->getType());
+      llvm::StructType* record_type = llvm::StructType::get(context, leaf_types);
+
+      llvm::Type* ptr = builder.getInt8PtrTy();
+      llvm::Function* alloc = getExternFunction(ptr, {builder.getInt64Ty()}, "rinha_alloc");
+      llvm::Constant* size = llvm::ConstantExpr::getSizeOf(record_type);
+      record = builder.CreateCall(alloc, {size}, "closure_env");
+      for (uint32_t i = 0; i < leaves.size(); i++) {
+        // Records are never freed, so neither are the tuples they hold
+        llvm::Value* leaf = isTuple(leaves[i]) ? ownTuple(leaves[i]) : leaves[i];
+        builder.CreateStore(leaf, builder.CreateStructGEP(record_type, record, i));
+      }
+    }
+
+    std::string id = "closure_env." + std::to_string(n_closure_records++);
+    ptr_id_table[record] = id;
+    closure_shapes[id] = closure;
+    return record;
+  }
+
+  llvm::Value* RinhaCompiler::loadClosure(Closure* shape, llvm::Value* record) {
+    std::vector<llvm::Value*> shape_leaves;
+    appendClosureLeaves(shape, shape_leaves);
+
+    std::vector<llvm::Value*> leaves;
+    if (!shape_leaves.empty()) {
+      std::vector<llvm::Type*> leaf_types;
+      for (llvm::Value* leaf : shape_leaves) leaf_types.push_back(leaf->getType());
+      llvm::StructType* record_type = llvm::StructType::get(context, leaf_types);
+      for (uint32_t i = 0; i < shape_leaves.size(); i++) {
+        llvm::Value* leaf_ptr = builder.CreateStructGEP(record_type, record, i);
+        leaves.push_back(builder.CreateLoad(leaf_types[i], leaf_ptr, "captured"));
+      }
+    }
+
+    std::vector<llvm::Value*>::const_iterator leaf = leaves.cbegin();
+    return rebuildClosure(shape, leaf)->marker;
+  }
+
+  llvm::Value* RinhaCompiler::createClosureMerge(Closure* then_closure, llvm::BasicBlock* then_end, Closure* else_closure, llvm::BasicBlock* else_end) {
+    std::vector<const void*> then_key, else_key;
+    appendClosureKey(then_closure, then_key);
+    appendClosureKey(else_closure, else_key);
+
+    // The same function with different captured numbers or booleans still
+    // merges once they are passed as values, like in generic specializations
+    bool generic = false;
+    if (then_key != else_key) {
+      then_key.clear();
+      else_key.clear();
+      appendClosureKey(then_closure, then_key, true);
+      appendClosureKey(else_closure, else_key, true);
+      generic = true;
+    }
+
+    // Calls are resolved when compiling, so there is no representation for
+    // a closure that is one of several functions depending on the path taken
+    if (then_key != else_key) {
+      std::cerr << "Error: branches of an if evaluate to different functions ("
+        << then_closure->sig->name << " on line " << then_closure->sig->loc.beginLine << " and "
+        << else_closure->sig->name << " on line " << else_closure->sig->loc.beginLine << ")" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+
+    std::vector<llvm::Value*> then_leaves, else_leaves, leaves;
+    appendClosureLeaves(then_closure, then_leaves, generic);
+    appendClosureLeaves(else_closure, else_leaves, generic);
+    for (uint32_t i = 0; i < then_leaves.size(); i++) {
+      llvm::PHINode* phi = builder.CreatePHI(then_leaves[i]->getType(), 2, "captured_phi");
+      phi->addIncoming(then_leaves[i], then_end);
+      phi->addIncoming(else_leaves[i], else_end);
+      leaves.push_back(phi);
+    }
+
+    std::vector<llvm::Value*>::const_iterator leaf = leaves.cbegin();
+    return rebuildClosure(then_closure, leaf, generic)->marker;
+  }
+
+  void RinhaCompiler::_insertCachedClosure(const std::vector<const void*>& key, uint64_t key_it, std::shared_ptr<ClosureInstanceNode> node, llvm::Function* fn) {
+    if (key_it >= key.size()){
       node->fn = fn;
+      specializations.push_back({node, fn});
       return;
     }
-    llvm::Type* param = params[param_it];
+    const void* param = key[key_it];
     auto opt_next = node->children.find(param);
     if (opt_next == node->children.end()) node->children[param] = std::make_shared<ClosureInstanceNode>();
-    _insertCachedClosure(params, param_it + 1, node->children[param], fn);  
-  }
-
-  void RinhaCompiler::insertCachedClosure(const std::string& name, llvm::Function* fn) {
-    std::vector<llvm::Type*> params = fn->getFunctionType()->params();
-    assert(params.size() > 0);
-    auto opt_typeNodeMap = closure_cache.find(name);
-    if (opt_typeNodeMap == closure_cache.end()) closure_cache[name] 
-      = {}; 
-    std::map<llvm::Type*, std::shared_ptr<ClosureInstanceNode>>& typeNodeMap = closure_cache[name];
-    uint64_t param_it = 0;
-    llvm::Type* arg = params[param_it];
-    auto opt_node = typeNodeMap.find(arg);
-    if (opt_node == typeNodeMap.end()) typeNodeMap[arg] = std::make_shared<ClosureInstanceNode>();
-    _insertCachedClosure(params, param_it + 1, typeNodeMap[arg], fn);
+    _insertCachedClosure(key, key_it + 1, node->children[param], fn);  
+  }
+
+  void RinhaCompiler::insertCachedClosure(ClosureSignature* sig, const std::vector<const void*>& key, llvm::Function* fn) {
+    auto opt_root = closure_cache.find(sig);
+    if (opt_root == closure_cache.end()) closure_cache[sig] = std::make_shared<ClosureInstanceNode>();
+    _insertCachedClosure(key, 0, closure_cache[sig], fn);
   }
   
   llvm::Function* RinhaCompiler::_getCachedClosure(
-  const std::vector<llvm::Type*>& args, 
-  uint64_t args_it, 
+  const std::vector<const void*>& key, 
+  uint64_t key_it, 
   std::shared_ptr<ClosureInstanceNode> instance_it) {
 
-    if (args_it >= args.size()) return instance_it->fn;
+    if (key_it >= key.size()) return instance_it->fn;
 
-    auto opt_next = instance_it->children.find(args[args_it]);
+    auto opt_next = instance_it->children.find(key[key_it]);
     if (opt_next == instance_it->children.end()) return nullptr;
-    return _getCachedClosure(args, args_it + 1, opt_next->second);
+    return _getCachedClosure(key, key_it + 1, opt_next->second);
   }
 
-  llvm::Function* RinhaCompiler::getCachedClosure(const std::string& name, std::vector<llvm::Type*> args) {
-    uint64_t args_it = 0;
-    llvm::Type* arg = args[args_it];
-    auto opt_closureInstNode = closure_cache.find(name);
-    if (opt_closureInstNode == closure_cache.end()) return nullptr;
-    std::map<llvm::Type*, std::shared_ptr<ClosureInstanceNode>> roots = opt_closureInstNode->second;
-    auto opt_next = roots.find(arg);
-    if (opt_next == roots.end()) return nullptr;
-    else return _getCachedClosure(args, args_it + 1, opt_next->second);
+  llvm::Function* RinhaCompiler::getCachedClosure(ClosureSignature* sig, const std::vector<const void*>& key) {
+    auto opt_root = closure_cache.find(sig);
+    if (opt_root == closure_cache.end()) return nullptr;
+    return _getCachedClosure(key, 0, opt_root->second);
   }
 
   llvm::Value* RinhaCompiler::callClosure(const std::string& name, std::vector<llvm::Value*>& args) {
-    auto opt_closure_sig = symtbl_stack.getValue(name);
-    if (!opt_closure_sig) {
+    auto opt_binding = symtbl_stack.getValue(name);
+    if (!opt_binding) {
       std::cerr << "Warning: Trying to call undefined function " + name << std::endl;;
       return createUndefined();
     }
 
-    ClosureSignature* closure_sig = opt_closure_sig->closureSig;
-    if (!closure_sig) {
+    Closure* closure = opt_binding->closure;
+    if (!closure) {
+      auto opt_closure = closure_table.find(opt_binding->val);
+      if (opt_closure != closure_table.end()) closure = opt_closure->second;
+    }
+
+    if (!closure) {
       std::cerr << "" + name + " refers to a value, not a closure." << std::endl;
       return createUndefined();
     }
 
+    return callKnownClosure(closure, args);
+  }
+
+  llvm::Value* RinhaCompiler::callKnownClosure(Closure* closure, std::vector<llvm::Value*>& args) {
+    ClosureSignature* closure_sig = closure->sig;
     if (args.size() != closure_sig->params.size()) {
-      std::cerr << "On " + name + " function call: number of arguments don't match" << std::endl;
+      std::cerr << "On " + closure_sig->name + " function call: number of arguments don't match" << std::endl;
       return createUndefined();
     }
 
-    llvm::AllocaInst* buffer = builder.CreateAlloca(llvm::Type::getInt32Ty(context), nullptr, "ret_buffer");
-    args.push_back(buffer);
-    std::vector<llvm::Type*> arg_types;
-    for (llvm::Value* arg : args) arg_types.push_back(arg->getType()); 
+    std::vector<llvm::Value*> leaves;
+    llvm::Function* fn = getSpecialization(closure, args, leaves);
+  
+    // Call function
+    llvm::CallInst* ret = builder.CreateCall(fn, leaves, "ret");
+    ret->setCallingConv(fn->getCallingConv());
+    if (incomplete_fns.count(fn)) n_provisional_calls++;
+    if (ret->getType()->isPointerTy()) copyPtrId(fn, ret);
+    // The caller owns the tuples functions return
+    if (isTuple(ret)) keepTuple(ret);
+
+    auto opt_ret_closure = fn_ret_closure.find(fn);
+    if (opt_ret_closure != fn_ret_closure.end()) return loadClosure(opt_ret_closure->second, ret);
+    return ret;
+  }
 
-    llvm::Function* fn = getCachedClosure(name, arg_types);
+  llvm::Function* RinhaCompiler::getSpecialization(Closure* closure, std::vector<llvm::Value*>& args, std::vector<llvm::Value*>& leaves) {
+    // Strings cross function boundaries in their runtime representation, so
+    // a specialization works no matter which kind of string it receives.
+    for (llvm::Value*& arg : args) if (isStrLiteral(arg)) arg = toRuntimeStr(arg);
+
+    // Flatten arguments and environment into the values actually passed
+    std::vector<const void*> key;
+    auto flatten = [&](bool generic) {
+      key.clear();
+      leaves.clear();
+      if (generic) key.push_back(&generic_key_tag);
+      for (llvm::Value* arg : args) {
+        auto opt_closure = closure_table.find(arg);
+        if (opt_closure != closure_table.end()) {
+          appendClosureKey(opt_closure->second, key, generic);
+          appendClosureLeaves(opt_closure->second, leaves, generic);
+        } else {
+          appendValueKey(arg, key);
+          leaves.push_back(arg);
+        }
+      }
+      appendClosureKey(closure, key, generic);
+      appendClosureLeaves(closure, leaves, generic);
+      return getCachedClosure(closure->sig, key);
+    };
+
+    // Exact specializations are still used when they exist (e.g. for
+    // recursive calls), only new ones become generic
+    bool generic = false;
+    llvm::Function* fn = flatten(false);
+    if (!fn && isOverBudget(closure->sig)) {
+      generic = true;
+      fn = flatten(true);
+    }
     if (fn) {
-      builder.CreateCall(fn, args);
-      return builder.CreateLoad(llvm::Type::getInt32Ty(context), buffer, "load_ret");        
-    }
-
-    // Create and Set Function
-    llvm::FunctionType* fn_type = llvm::FunctionType::get(llvm::Type::getVoidTy(context), arg_types, false);    
-    fn = llvm::Function::Create(fn_type, llvm::Function::ExternalLinkage, name, module);
-    llvm::BasicBlock* cur_block = builder.GetInsertBlock();
-    llvm::BasicBlock* fn_entry = llvm::BasicBlock::Create(context, "entry", fn);
-    builder.SetInsertPoint(fn_entry);
-    symtbl_stack.pushScope();
-    insertCachedClosure(name, fn);
-
-    // Get arguments
-    assert(closure_sig->params.size() == fn->arg_size() - 1);
-    uint64_t i = 0;
-    for (i = 0; i < fn->arg_size() - 1; i++) {
-      llvm::Argument* arg = fn->getArg(i);
-      symtbl_stack.insertValue(closure_sig->params[i], arg);
-    }
-    assert(i == fn->arg_size() - 1);
-
-    // Generate Code
-    assert(closure_sig->fn_body);
-    llvm::Value* ret_val = closure_sig->fn_body->getVal();
-
-    // Return Value
-    llvm::Value* ret_buffer_ptr = fn->getArg(i);
-    builder.CreateStore(ret_val, ret_buffer_ptr, false);
-    builder.CreateRetVoid();
+      Stats::increment(Stats::Counter::SPECIALIZATION_CACHE_HITS);
+      return fn;
+    }
+    if (generic && n_specializations[closure->sig] >= 2 * options.specialization_budget) {
+      std::cerr << "Error: " << closure->sig->name << " on line " << closure->sig->loc.beginLine
+        << " needs more specializations than its budget allows (" << options.specialization_budget << ", then as many generic"
+        << " ones), since it is called with too many types of arguments. Raise --specialization-budget, or set it to 0 for no limit" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    Stats::increment(Stats::Counter::SPECIALIZATION_CACHE_MISSES);
+    return createSpecialization(closure, args, key, leaves, generic);
+  }
 
-    // Exit from Function
-    builder.SetInsertPoint(cur_block);
-    symtbl_stack.popScope();
+  /*  Every distinct key makes a new specialization, so a function that is
+      called with many shapes of arguments or closes over many different
+      constants grows without limit. Past the budget, its captured numbers
+      and booleans are passed as values, so calls that only differ by those
+      share one specialization. Types still have to match, since values
+      have no boxed representation to fall back to, so a function gets at
+      most as many generic specializations as the budget and compiling fails
+      past that.
+  */
+  bool RinhaCompiler::isOverBudget(ClosureSignature* sig) {
+    if (!options.specialization_budget) return false;
+    if (over_budget.count(sig)) return true;
+    if (n_specializations[sig] < options.specialization_budget) return false;
+
+    over_budget.insert(sig);
+    Stats::increment(Stats::Counter::OVER_BUDGET_CLOSURES);
+    std::cerr << "Warning: " << sig->name << " reached the specialization budget (" << options.specialization_budget
+      << "), further calls use generic specializations. See --specialization-budget" << std::endl;
+    return true;
+  }
 
-    // Save function data
-    fn_ret_table[fn] = ret_val->getType();
-  
-    // Call function
-    builder.CreateCall(fn, args);
-    args.pop_back();
-    llvm::Value* ret = builder.CreateLoad(ret_val->getType(), buffer, "load_ret");        
-    if (ret->getType()->isPointerTy()) { 
-      ptr_id_table[ret] = ptr_id_table[ret_val];
+  /*  Specializations return their value directly, so the return type is part
+      of the function type. Recursive calls are generated before the body is
+      done, so they assume the function returns an int. If the body turns out
+      to return something else, everything generated for it is thrown away
+      and the body is generated again, now with the right type.
+  */
+  llvm::Function* RinhaCompiler::createSpecialization(Closure* closure, const std::vector<llvm::Value*>& args, const std::vector<const void*>& key, const std::vector<llvm::Value*>& leaves, bool generic) {
+    ClosureSignature* closure_sig = closure->sig;
+    std::vector<llvm::Type*> param_types;
+    for (llvm::Value* leaf : leaves) param_types.push_back(leaf->getType());
+
+    std::vector<llvm::Type*> tried_types;
+    llvm::Type* ret_type = default_type;
+    std::string ret_ptr_id;
+    while (true) {
+      // Create and Set Function
+      llvm::FunctionType* fn_type = llvm::FunctionType::get(ret_type, param_types, false);    
+      llvm::Function* fn = llvm::Function::Create(fn_type, llvm::Function::InternalLinkage, closure_sig->name, module);
+      fn->setCallingConv(llvm::CallingConv::Fast);
+      // Nothing in Rinha (or in the runtime) unwinds. Whether it reads or
+      // writes memory is left to LLVM, which sees the whole body and
+      // what the runtime functions it calls do (see setRuntimeAttributes).
+      fn->addFnAttr(llvm::Attribute::NoUnwind);
+      if (!ret_ptr_id.empty()) ptr_id_table[fn] = ret_ptr_id;
+      fn_ret_table[fn] = ret_type;
+      incomplete_fns.insert(fn);
+      uint64_t first_specialization = specializations.size();
+      insertCachedClosure(closure_sig, key, fn);
+
+      llvm::BasicBlock* cur_block = builder.GetInsertBlock();
+      llvm::BasicBlock* fn_entry = llvm::BasicBlock::Create(context, "entry", fn);
+      builder.SetInsertPoint(fn_entry);
+      llvm::DebugLoc caller_loc = enterFunction(fn, closure_sig->name, closure_sig->loc);
+      llvm::DebugLoc fn_loc = builder.getCurrentDebugLocation();
+      llvm::Value* entry_tsc = options.instrument ? instrumentEntry(fn) : nullptr;
+
+      // The body only sees what the closure captured (lexical scoping)
+      SymbolTableStack caller_symtbl_stack = std::move(symtbl_stack);
+      symtbl_stack = SymbolTableStack();
+
+      // Get arguments
+      std::vector<llvm::Value*> fn_leaves;
+      for (uint64_t i = 0; i < leaves.size(); i++) {
+        llvm::Argument* arg = fn->getArg(i);
+        copyPtrId(leaves[i], arg);
+        fn_leaves.push_back(arg);
+      }
+
+      std::vector<llvm::Value*>::const_iterator leaf = fn_leaves.cbegin();
+      std::vector<EitherValOrClosure> params;
+      for (llvm::Value* arg : args) {
+        auto opt_closure = closure_table.find(arg);
+        if (opt_closure != closure_table.end()) {
+          Closure* param = rebuildClosure(opt_closure->second, leaf, generic);
+          params.push_back({param->marker, param});
+        } else {
+          params.push_back({*leaf++, nullptr});
+        }
+      }
+      Closure* self = rebuildClosure(closure, leaf, generic);
+      assert(leaf == fn_leaves.cend());
+
+      // Parameters shadow captures, which shadow the function itself
+      std::vector<std::pair<const std::string*, EitherValOrClosure>> bindings;
+      if (!closure_sig->self_name.empty()) bindings.push_back({&closure_sig->self_name, {self->marker, self}});
+      for (uint64_t i = 0; i < self->env.size(); i++) bindings.push_back({&closure_sig->captures[i], self->env[i]});
+      for (uint64_t i = 0; i < params.size(); i++) bindings.push_back({&closure_sig->params[i], params[i]});
+      for (auto& [name, binding] : bindings) {
+        if (binding.closure) symtbl_stack.insertClosure(*name, binding.closure);
+        else symtbl_stack.insertValue(*name, binding.val);
+      }
+
+      // Generate Code
+      assert(closure_sig->fn_body);
+      enterRegion();
+      llvm::Value* ret_val = closure_sig->fn_body->getVal();
+      auto opt_ret_closure = closure_table.find(ret_val);
+      if (opt_ret_closure != closure_table.end()) {
+        fn_ret_closure[fn] = opt_ret_closure->second;
+        ret_val = materializeClosure(opt_ret_closure->second);
+      }
+      leaveRegion(ret_val, true);
+      
+      // Exit from Function
+      llvm::BasicBlock* fn_end = builder.GetInsertBlock();
+      builder.SetInsertPoint(cur_block);
+      restoreLocation(caller_loc);
+      symtbl_stack = std::move(caller_symtbl_stack);
+
+      if (ret_val->getType() != ret_type) {
+        tried_types.push_back(ret_type);
+        ret_type = ret_val->getType();
+        ret_ptr_id = ret_type->isPointerTy() && ptr_id_table.count(ret_val) ? ptr_id_table[ret_val] : "";
+        discardSpecializations(first_specialization);
+        if (std::find(tried_types.begin(), tried_types.end(), ret_type) != tried_types.end()) {
+          std::cerr << "Error: could not infer the return type of " << closure_sig->name << std::endl;
+          abort();
+        }
+        continue;
+      }
+
+      // Return Value
+      incomplete_fns.erase(fn);
+      builder.SetInsertPoint(fn_end);
+      restoreLocation(fn_loc);
+      if (options.instrument) instrumentExit(fn, entry_tsc);
+      builder.CreateRet(ret_val);
+      builder.SetInsertPoint(cur_block);
+      restoreLocation(caller_loc);
+
+      // Save function data
+      Stats::increment(Stats::Counter::CLOSURE_SPECIALIZATIONS);
+      n_specializations[closure_sig]++;
+      specialization_sigs[fn] = closure_sig;
+      copyPtrId(ret_val, fn);
+      return fn;
     }
-    return ret;
+  }
+
+  bool RinhaCompiler::isProvisional(llvm::Value* val) {
+    llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(val);
+    return call && incomplete_fns.count(call->getCalledFunction());
+  }
+
+  // Deletes the specializations created since the given one was, together
+  // with everything the code generator knows about their values
+  void RinhaCompiler::discardSpecializations(uint64_t first) {
+    std::set<llvm::Function*> discarded;
+    for (uint64_t i = first; i < specializations.size(); i++) {
+      specializations[i].first->fn = nullptr;
+      discarded.insert(specializations[i].second);
+    }
+    specializations.resize(first);
+
+    for (llvm::Function* fn : discarded) {
+      for (llvm::Argument& arg : fn->args()) ptr_id_table.erase(&arg);
+      for (llvm::Instruction& inst : llvm::instructions(fn)) {
+        ptr_id_table.erase(&inst);
+        next_cells.erase(&inst);
+        heap_tuples.erase(&inst);
+        tuple_elements.erase(&inst);
+        closure_table.erase(&inst);
+        special_value_table.erase(&inst);
+      }
+      auto opt_sig = specialization_sigs.find(fn);
+      if (opt_sig != specialization_sigs.end()) {
+        n_specializations[opt_sig->second]--;
+        specialization_sigs.erase(opt_sig);
+      }
+      ptr_id_table.erase(fn);
+      fn_ret_table.erase(fn);
+      incomplete_fns.erase(fn);
+      fn_ret_closure.erase(fn);
+      fn->dropAllReferences();
+    }
+
+    for (auto it = task_entries.begin(); it != task_entries.end();) {
+      if (discarded.count(it->first) || discarded.count(it->second)) it = task_entries.erase(it);
+      else it++;
+    }
+
+    for (auto it = prof_entries.begin(); it != prof_entries.end();) {
+      if (!discarded.count(it->first)) it++;
+      else {
+        it->second->eraseFromParent();
+        it = prof_entries.erase(it);
+      }
+    }
+    for (llvm::Function* fn : discarded) fn->eraseFromParent();
   }
 
   llvm::Value* RinhaCompiler::getVariable(const std::string& name) {
@@ -385,13 +1400,55 @@ namespace Compiler {
       abort();
     }
 
-    if (!var->val) {
-      std::cerr << "Warning: "<< name << " is a closure" << std::endl;
-    }
-
+    // Closures are referred to through their marker
     return var->val;
   }
 
+  /*  What the runtime's functions touch, for the optimizer to work out what
+      the functions calling them do. Only declarations get these: when the
+      runtime is linked in (see linkRuntime), its code replaces them and
+      the allocator's state stops being out of the program's reach, so
+      LLVM has to work it out from the code instead.
+
+      Allocations only fail by exiting, so the functions making them still
+      count as returning.
+  */
+  static void setRuntimeAttributes(llvm::Function* fn) {
+    using Attr = llvm::Attribute;
+    struct Contract {
+      Attr::AttrKind memory;
+      std::vector<Attr::AttrKind> ret;
+      std::vector<Attr::AttrKind> ptr_args;
+    };
+    static const std::map<std::string, Contract> contracts = {
+      {"rinha_alloc", {Attr::InaccessibleMemOnly, {Attr::NoAlias}, {}}},
+      {"rinha_tuple_alloc", {Attr::InaccessibleMemOnly, {Attr::NoAlias}, {}}},
+      {"rinha_tuple_reuse", {Attr::InaccessibleMemOrArgMemOnly, {}, {}}},
+      {"rinha_tuple_dup", {Attr::InaccessibleMemOrArgMemOnly, {}, {Attr::NoCapture}}},
+      {"rinha_tuple_release", {Attr::InaccessibleMemOrArgMemOnly, {}, {}}},
+      {"rinha_tuple_free", {Attr::InaccessibleMemOrArgMemOnly, {}, {}}},
+      {"rinha_str_from_int", {Attr::InaccessibleMemOnly, {Attr::NoAlias}, {}}},
+      {"rinha_str_from_bool", {Attr::InaccessibleMemOnly, {Attr::NoAlias}, {}}},
+      // May return one of its arguments, and ropes point to them
+      {"rinha_str_concat", {Attr::InaccessibleMemOrArgMemOnly, {}, {Attr::ReadOnly}}},
+      // Flattens the ropes it's given in place
+      {"rinha_str_eq", {Attr::InaccessibleMemOrArgMemOnly, {}, {Attr::NoCapture}}},
+    };
+
+    // The runtime is C, built without exceptions
+    fn->addFnAttr(Attr::NoUnwind);
+    auto opt_contract = contracts.find(fn->getName().str());
+    if (opt_contract == contracts.end()) return;
+    const Contract& contract = opt_contract->second;
+    fn->addFnAttr(contract.memory);
+    fn->addFnAttr(Attr::WillReturn);
+    for (Attr::AttrKind kind : contract.ret) fn->addRetAttr(kind);
+    for (llvm::Argument& arg : fn->args()) {
+      if (!arg.getType()->isPointerTy()) continue;
+      for (Attr::AttrKind kind : contract.ptr_args) arg.addAttr(kind);
+    }
+  }
+
   llvm::Function* RinhaCompiler::getExternFunction(llvm::Type* ret, const std::vector<llvm::Type*>& args, const std::string& name) {
     llvm::Function* fn = extern_fn_table[name];
     if (fn) return fn;
@@ -400,7 +1457,8 @@ namespace Compiler {
     builder.restoreIP(externInsertPoint);
     llvm::FunctionType* fn_type = llvm::FunctionType::get(ret, args, false);
     llvm::Function* extern_fn = llvm::Function::Create(fn_type, llvm::Function::ExternalLinkage, name, module);
-    extern_fn_table[name] = fn;
+    setRuntimeAttributes(extern_fn);
+    extern_fn_table[name] = extern_fn;
     
     builder.restoreIP(previous_point);
     return extern_fn;
@@ -425,27 +1483,160 @@ namespace Compiler {
   }
 
   llvm::Value* RinhaCompiler::createStr(const std::string& str) {
+    auto opt_literal = str_literal_table.find(str);
+    if (opt_literal != str_literal_table.end()) return opt_literal->second.chars;
+
     llvm::GlobalVariable* ret = builder.CreateGlobalString(str, "str", 0, &module);
     std::string id = ret->getName().str();
     ptr_id_table[ret] = id;
     ptr_type_table[id] = ret->getValueType();
+    str_literal_table[str] = {ret, nullptr};
     return ret;
   }
 
+  llvm::GlobalVariable* RinhaCompiler::createGlobal(llvm::Type* type, bool is_constant, llvm::Constant* init, const std::string& name) {
+    return new llvm::GlobalVariable(module, type, is_constant, llvm::GlobalValue::PrivateLinkage, init, name);
+  }
+
+  llvm::StructType* RinhaCompiler::getStrType() {
+    if (str_type) return str_type;
+    // Mirrors struct rinha_str: { len, kind, union { sso, flat, rope } }
+    llvm::Type* i32 = builder.getInt32Ty();
+    llvm::Type* ptr = builder.getInt8PtrTy();
+    str_type = llvm::StructType::create(context, {i32, i32, ptr, ptr}, "rinha_str");
+    ptr_type_table["rinha_str"] = str_type;
+    return str_type;
+  }
+
+  llvm::Type* RinhaCompiler::lookupPtrType(llvm::Value* val) {
+    auto opt_id = ptr_id_table.find(val);
+    if (opt_id == ptr_id_table.end()) return nullptr;
+    auto opt_type = ptr_type_table.find(opt_id->second);
+    return opt_type == ptr_type_table.end() ? nullptr : opt_type->second;
+  }
+
+  bool RinhaCompiler::isStrLiteral(llvm::Value* val) {
+    if (!val->getType()->isPointerTy() || !llvm::isa<llvm::GlobalVariable>(val)) return false;
+    llvm::Type* type = lookupPtrType(val);
+    return type && type->isArrayTy() && type->getArrayElementType()->isIntegerTy(8);
+  }
+
+  bool RinhaCompiler::isRuntimeStr(llvm::Value* val) {
+    if (!val->getType()->isPointerTy()) return false;
+    llvm::Type* type = lookupPtrType(val);
+    return type && type == str_type;
+  }
+
+  bool RinhaCompiler::isStr(llvm::Value* val) {
+    return isStrLiteral(val) || isRuntimeStr(val);
+  }
+
+  bool RinhaCompiler::isTuple(llvm::Value* val) {
+    if (!val->getType()->isPointerTy()) return false;
+    llvm::Type* type = lookupPtrType(val);
+    return type && type->isStructTy() && type->getStructNumElements() == 2;
+  }
+
+  std::string RinhaCompiler::getStrLiteral(llvm::Value* val) {
+    llvm::GlobalVariable* global = llvm::cast<llvm::GlobalVariable>(val);
+    // The empty string is initialized as zeroinitializer instead of an array
+    llvm::ConstantDataArray* chars = llvm::dyn_cast<llvm::ConstantDataArray>(global->getInitializer());
+    return chars ? chars->getAsCString().str() : "";
+  }
+
+  llvm::Value* RinhaCompiler::toRuntimeStr(llvm::Value* val) {
+    if (isRuntimeStr(val) || llvm::isa<llvm::UndefValue>(val)) return val;
+
+    llvm::Value* ret;
+    llvm::Type* str_ptr_type = getStrType()->getPointerTo();
+    if (isStrLiteral(val)) {
+      StrLiteral& literal = str_literal_table[getStrLiteral(val)];
+      if (!literal.rstr) {
+        llvm::Type* ptr = builder.getInt8PtrTy();
+        llvm::Constant* init = llvm::ConstantStruct::get(getStrType(), {
+          builder.getInt32(literal.chars->getValueType()->getArrayNumElements() - 1),
+          builder.getInt32(RINHA_STR_FLAT),
+          llvm::ConstantExpr::getPointerCast(literal.chars, ptr),
+          llvm::ConstantPointerNull::get(llvm::cast<llvm::PointerType>(ptr))
+        });
+        literal.rstr = createGlobal(getStrType(), true, init, "rstr");
+      }
+      ret = literal.rstr;
+    } else if (is32Int(val)) {
+      llvm::Function* from_int = getExternFunction(str_ptr_type, {val->getType()}, "rinha_str_from_int");
+      ret = builder.CreateCall(from_int, {val}, "int_str");
+    } else if (isBool(val)) {
+      llvm::Type* i8 = builder.getInt8Ty();
+      llvm::Function* from_bool = getExternFunction(str_ptr_type, {i8}, "rinha_str_from_bool");
+      ret = builder.CreateCall(from_bool, {builder.CreateZExt(val, i8)}, "bool_str");
+    } else {
+      return nullptr;
+    }
+
+    ptr_id_table[ret] = "rinha_str";
+    return ret;
+  }
+
+  llvm::Value* RinhaCompiler::createStrConcat(llvm::Value* lhs, llvm::Value* rhs) {
+    // Fold concatenations whose operands are all known at compile time
+    llvm::ConstantInt* lhs_int = llvm::dyn_cast<llvm::ConstantInt>(lhs);
+    llvm::ConstantInt* rhs_int = llvm::dyn_cast<llvm::ConstantInt>(rhs);
+    bool lhs_const = isStrLiteral(lhs) || (lhs_int && is32Int(lhs));
+    bool rhs_const = isStrLiteral(rhs) || (rhs_int && is32Int(rhs));
+    if (lhs_const && rhs_const) {
+      std::string lhs_str = lhs_int ? std::to_string(lhs_int->getSExtValue()) : getStrLiteral(lhs);
+      std::string rhs_str = rhs_int ? std::to_string(rhs_int->getSExtValue()) : getStrLiteral(rhs);
+      return createStr(lhs_str + rhs_str);
+    }
+
+    llvm::Value* lhs_str = toRuntimeStr(lhs);
+    llvm::Value* rhs_str = toRuntimeStr(rhs);
+    if (!lhs_str || !rhs_str) return createUndefined();
+
+    llvm::Type* str_ptr_type = getStrType()->getPointerTo();
+    llvm::Function* concat = getExternFunction(str_ptr_type, {str_ptr_type, str_ptr_type}, "rinha_str_concat");
+    llvm::Value* ret = builder.CreateCall(concat, {lhs_str, rhs_str}, "concat");
+    ptr_id_table[ret] = "rinha_str";
+    return ret;
+  }
+
+  llvm::Value* RinhaCompiler::createStrEq(llvm::Value* lhs, llvm::Value* rhs) {
+    // Literals are interned by createStr, so address equality is enough
+    if (isStrLiteral(lhs) && isStrLiteral(rhs)) return builder.CreateICmpEQ(lhs, rhs, "eq");
+
+    llvm::Type* str_ptr_type = getStrType()->getPointerTo();
+    llvm::Function* str_eq = getExternFunction(builder.getInt8Ty(), {str_ptr_type, str_ptr_type}, "rinha_str_eq");
+    llvm::Value* eq = builder.CreateCall(str_eq, {toRuntimeStr(lhs), toRuntimeStr(rhs)}, "str_eq");
+    return builder.CreateICmpNE(eq, builder.getInt8(0), "eq");
+  }
+
+  llvm::AllocaInst* RinhaCompiler::createEntryAlloca(llvm::Type* type, const std::string& name) {
+    llvm::BasicBlock& entry = builder.GetInsertBlock()->getParent()->getEntryBlock();
+    llvm::IRBuilder<> entry_builder(&entry, entry.begin());
+    return entry_builder.CreateAlloca(type, nullptr, name);
+  }
+
   llvm::Value* RinhaCompiler::createTuple(llvm::Value* first, llvm::Value* second) {
+    if (isClosure(first)) first = materializeClosure(closure_table[first]);
+    if (isClosure(second)) second = materializeClosure(closure_table[second]);
+    // Literals are only known to be strings while they're globals, so
+    // tuples hold strings in their runtime representation
+    if (isStrLiteral(first)) first = toRuntimeStr(first);
+    if (isStrLiteral(second)) second = toRuntimeStr(second);
+
     llvm::Type* first_type = first->getType();
     llvm::Type* second_type = second->getType();
 
     llvm::StructType* tuple_type = llvm::StructType::get(context, {first_type, second_type});
-    llvm::Value* tuple = builder.CreateAlloca(tuple_type, nullptr, "tuple");
+    llvm::Value* tuple = createEntryAlloca(tuple_type, "tuple");
 
-    std::string tuple_id = tuple->getName().str();
+    std::string tuple_id = "tuple." + std::to_string(n_tuple_ids++);
     ptr_id_table[tuple] = tuple_id;
 
-    std::string* first_ptr_id = first_type->isPointerTy() ? 
-      &ptr_id_table[first] : nullptr; 
-    std::string* second_ptr_id = second_type->isPointerTy() ?
-      &ptr_id_table[second] : nullptr;
+    std::string first_ptr_id = first_type->isPointerTy() ? 
+      ptr_id_table[first] : ""; 
+    std::string second_ptr_id = second_type->isPointerTy() ?
+      ptr_id_table[second] : "";
     tuple_ptr_types[tuple_id] = {first_ptr_id, second_ptr_id};
     ptr_type_table[tuple_id] = tuple_type;
 
@@ -457,9 +1648,206 @@ namespace Compiler {
 
     builder.CreateStore(first, first_ptr);
     builder.CreateStore(second, second_ptr);
+    tuple_elements[tuple] = {first, second};
+    return tuple;
+  }
+
+  /*  A tuple whose second element is another tuple built right there is a
+      cons cell of a list. Instead of one allocation per cell, the cells of
+      the list go in a single block, one after the other, so the list is
+      contiguous and the cell after any of them is known when compiling:
+      second on a cell is the address of the next one instead of a load.
+      Each cell is still stored as an ordinary tuple (its second element
+      points to the next cell), so a cell that escapes (passed to a
+      function, returned, printed) reads like any other tuple.
+
+      The block is an array of cells, so only the cells up to the first
+      head of another type share it. The rest of the list is made of
+      ordinary tuples.
+  */
+  llvm::Value* RinhaCompiler::createList(const std::vector<llvm::Value*>& heads, llvm::Value* tail) {
+    std::vector<llvm::Value*> firsts;
+    for (llvm::Value* head : heads) {
+      if (isClosure(head)) head = materializeClosure(closure_table[head]);
+      firsts.push_back(isStrLiteral(head) ? toRuntimeStr(head) : head);
+    }
+    if (isClosure(tail)) tail = materializeClosure(closure_table[tail]);
+    if (isStrLiteral(tail)) tail = toRuntimeStr(tail);
+
+    llvm::Type* head_type = firsts[0]->getType();
+    uint64_t n_cells = 1;
+    while (n_cells < firsts.size() && firsts[n_cells]->getType() == head_type) n_cells++;
+    for (uint64_t i = firsts.size(); i > n_cells; i--) tail = createTuple(firsts[i - 1], tail);
+    if (n_cells == 1) return createTuple(firsts[0], tail);
+
+    llvm::StructType* cell_type = llvm::StructType::get(context, {head_type, builder.getInt8PtrTy()});
+    llvm::StructType* last_type = llvm::StructType::get(context, {head_type, tail->getType()});
+    llvm::ArrayType* cells_type = llvm::ArrayType::get(cell_type, n_cells - 1);
+    llvm::StructType* list_type = llvm::StructType::get(context, {cells_type, last_type});
+    llvm::Value* list = createEntryAlloca(list_type, "list");
+
+    // All cells' addresses come first, so the next cell's address is
+    // available wherever a cell is
+    llvm::Value* zero = builder.getInt32(0);
+    std::vector<llvm::Value*> cells;
+    for (uint32_t i = 0; i + 1 < n_cells; i++) {
+      cells.push_back(builder.CreateGEP(list_type, list, {zero, zero, builder.getInt32(i)}, "cell"));
+    }
+    cells.push_back(builder.CreateStructGEP(list_type, list, 1, "cell"));
+
+    // Each cell records the id of the next one, so they're all named first
+    for (llvm::Value* cell : cells) ptr_id_table[cell] = "cell." + std::to_string(n_tuple_ids++);
+
+    for (uint32_t i = 0; i < n_cells; i++) {
+      llvm::Value* second = i + 1 < n_cells ? cells[i + 1] : tail;
+      llvm::StructType* type = i + 1 < n_cells ? cell_type : last_type;
+      const std::string& cell_id = ptr_id_table[cells[i]];
+      ptr_type_table[cell_id] = type;
+
+      std::string first_ptr_id = head_type->isPointerTy() ? ptr_id_table[firsts[i]] : "";
+      std::string second_ptr_id = second->getType()->isPointerTy() ? ptr_id_table[second] : "";
+      tuple_ptr_types[cell_id] = {first_ptr_id, second_ptr_id};
+      if (i + 1 < n_cells) next_cells[cells[i]] = cells[i + 1];
+      tuple_elements[cells[i]] = {firsts[i], second};
+
+      builder.CreateStore(firsts[i], builder.CreateStructGEP(type, cells[i], 0));
+      builder.CreateStore(second, builder.CreateStructGEP(type, cells[i], 1));
+    }
+    return cells[0];
+  }
+
+  void RinhaCompiler::enterRegion() {
+    tuple_regions.emplace_back();
+  }
+
+  bool RinhaCompiler::leaveRegion(llvm::Value*& result, bool own) {
+    std::vector<llvm::Value*> owned = std::move(tuple_regions.back());
+    tuple_regions.pop_back();
+
+    bool moved = false;
+    if (isTuple(result)) {
+      auto opt_owned = std::find(owned.begin(), owned.end(), result);
+      if (opt_owned != owned.end()) {
+        owned.erase(opt_owned);
+        moved = true;
+      } else if (own || !owned.empty()) {
+        // It may refer to what's dropped below
+        result = buildTuple(*planTuple(result, owned), owned);
+        moved = true;
+      }
+    }
+    for (llvm::Value* tuple : owned) dropTuple(tuple, false);
+    return moved;
+  }
+
+  void RinhaCompiler::keepTuple(llvm::Value* tuple) {
+    heap_tuples.insert(tuple);
+    if (!tuple_regions.empty()) tuple_regions.back().push_back(tuple);
+  }
+
+  llvm::Value* RinhaCompiler::ownTuple(llvm::Value* tuple) {
+    std::vector<llvm::Value*> owned;
+    return buildTuple(*planTuple(tuple, owned), owned);
+  }
+
+  std::unique_ptr<RinhaCompiler::TuplePlan> RinhaCompiler::planTuple(llvm::Value* tuple, std::vector<llvm::Value*>& owned) {
+    std::unique_ptr<TuplePlan> plan = std::make_unique<TuplePlan>();
+    plan->val = tuple;
+    if (!isTuple(tuple)) return plan;
+
+    auto opt_owned = std::find(owned.begin(), owned.end(), tuple);
+    if (opt_owned != owned.end()) {
+      owned.erase(opt_owned);
+      return plan;
+    }
+    if (heap_tuples.count(tuple)) {
+      llvm::Type* ptr = builder.getInt8PtrTy();
+      builder.CreateCall(getExternFunction(builder.getVoidTy(), {ptr}, "rinha_tuple_dup"), {tuple});
+      return plan;
+    }
+
+    // Tuples built here are copied from what they were built from, so
+    // references in owned can be moved into the copy
+    plan->type = llvm::cast<llvm::StructType>(lookupPtrType(tuple));
+    auto opt_elements = tuple_elements.find(tuple);
+    llvm::Value* first = opt_elements != tuple_elements.end() ? opt_elements->second.first : loadTupleElement(tuple, 0);
+    llvm::Value* second = opt_elements != tuple_elements.end() ? opt_elements->second.second : loadTupleElement(tuple, 1);
+    plan->first = planTuple(first, owned);
+    plan->second = planTuple(second, owned);
+    return plan;
+  }
+
+  llvm::Value* RinhaCompiler::buildTuple(TuplePlan& plan, std::vector<llvm::Value*>& owned) {
+    if (!plan.type) return plan.val;
+    llvm::Value* first = buildTuple(*plan.first, owned);
+    llvm::Value* second = buildTuple(*plan.second, owned);
+
+    llvm::Type* ptr = builder.getInt8PtrTy();
+    llvm::Type* i64 = builder.getInt64Ty();
+    llvm::Constant* size = llvm::ConstantExpr::getSizeOf(plan.type);
+    llvm::Value* tuple;
+    auto opt_reusable = std::find_if(owned.begin(), owned.end(), [&](llvm::Value* val) {
+      return lookupPtrType(val) == plan.type;
+    });
+    if (opt_reusable != owned.end()) {
+      llvm::Value* dropped = *opt_reusable;
+      owned.erase(opt_reusable);
+      llvm::Value* token = dropTuple(dropped, true);
+      tuple = builder.CreateCall(getExternFunction(ptr, {ptr, i64}, "rinha_tuple_reuse"), {token, size}, "heap_tuple");
+    } else {
+      tuple = builder.CreateCall(getExternFunction(ptr, {i64}, "rinha_tuple_alloc"), {size}, "heap_tuple");
+    }
+    builder.CreateStore(first, builder.CreateStructGEP(plan.type, tuple, 0));
+    builder.CreateStore(second, builder.CreateStructGEP(plan.type, tuple, 1));
+
+    std::string tuple_id = "heap_tuple." + std::to_string(n_tuple_ids++);
+    ptr_id_table[tuple] = tuple_id;
+    ptr_type_table[tuple_id] = plan.type;
+    std::string first_ptr_id = first->getType()->isPointerTy() ? ptr_id_table[first] : "";
+    std::string second_ptr_id = second->getType()->isPointerTy() ? ptr_id_table[second] : "";
+    tuple_ptr_types[tuple_id] = {first_ptr_id, second_ptr_id};
+    heap_tuples.insert(tuple);
     return tuple;
   }
 
+  llvm::Value* RinhaCompiler::dropTuple(llvm::Value* tuple, bool reuse) {
+    llvm::Type* ptr = builder.getInt8PtrTy();
+    llvm::Value* last = builder.CreateCall(getExternFunction(ptr, {ptr}, "rinha_tuple_release"), {tuple}, "last");
+
+    llvm::Function* current_fn = builder.GetInsertBlock()->getParent();
+    llvm::BasicBlock* drop_block = llvm::BasicBlock::Create(context, "drop", current_fn);
+    llvm::BasicBlock* dropped_block = llvm::BasicBlock::Create(context, "dropped", current_fn);
+    builder.CreateCondBr(builder.CreateIsNotNull(last), drop_block, dropped_block);
+
+    builder.SetInsertPoint(drop_block);
+    for (uint32_t i = 0; i < 2; i++) {
+      llvm::Value* element = loadTupleElement(tuple, i);
+      if (isTuple(element)) dropTuple(element, false);
+    }
+    if (!reuse) {
+      llvm::Constant* size = llvm::ConstantExpr::getSizeOf(lookupPtrType(tuple));
+      builder.CreateCall(getExternFunction(builder.getVoidTy(), {ptr, builder.getInt64Ty()}, "rinha_tuple_free"), {last, size});
+    }
+    builder.CreateBr(dropped_block);
+
+    builder.SetInsertPoint(dropped_block);
+    return reuse ? last : nullptr;
+  }
+
+  llvm::Value* RinhaCompiler::loadTupleElement(llvm::Value* tuple, uint32_t i) {
+    llvm::StructType* tuple_type = llvm::cast<llvm::StructType>(lookupPtrType(tuple));
+    llvm::Value* element_ptr = builder.CreateStructGEP(tuple_type, tuple, i);
+    llvm::Value* element = builder.CreateLoad(tuple_type->getStructElementType(i), element_ptr, i ? "second" : "first");
+    if (element->getType()->isPointerTy()) {
+      const TuplePtrIds& ids = tuple_ptr_types[ptr_id_table[tuple]];
+      const std::string& element_id = i ? ids.second_ptr_id : ids.first_ptr_id;
+      if (!element_id.empty()) ptr_id_table[element] = element_id;
+    }
+    // The elements of a tuple on the heap hold a reference
+    if (heap_tuples.count(tuple) && isTuple(element)) heap_tuples.insert(element);
+    return element;
+  }
+
   
   llvm::Value* RinhaCompiler::createAdd(llvm::Value* lhs, llvm::Value* rhs) {
 
@@ -467,7 +1855,9 @@ namespace Compiler {
       return builder.CreateAdd(lhs, rhs, "add");
     }
 
-    // What about string operations?
+    if ((isStr(lhs) && (isStr(rhs) || is32Int(rhs))) || (is32Int(lhs) && isStr(rhs))) {
+      return createStrConcat(lhs, rhs);
+    }
 
     return createUndefined();
   }
@@ -511,6 +1901,10 @@ namespace Compiler {
       return builder.CreateICmpEQ(lhs, rhs, "eq");
     }
 
+    if (isStr(lhs) && isStr(rhs)) {
+      return createStrEq(lhs, rhs);
+    }
+
     return createUndefined();
   };
   llvm::Value* RinhaCompiler::createNeq(llvm::Value* lhs, llvm::Value* rhs){
@@ -519,6 +1913,10 @@ namespace Compiler {
       return builder.CreateICmpNE(lhs, rhs);
     }
 
+    if (isStr(lhs) && isStr(rhs)) {
+      return builder.CreateNot(createStrEq(lhs, rhs), "neq");
+    }
+
     return createUndefined();
   };
   llvm::Value* RinhaCompiler::createGt(llvm::Value* lhs, llvm::Value* rhs){
@@ -563,13 +1961,19 @@ namespace Compiler {
     builder.SetInsertPoint(or_block);
 
     llvm::Value* lhs_val = lhs->getVal();
+    // A recursive call that isn't known to return a boolean yet (see
+    // createSpecialization), e.g. in any = fn (n) => { ... || any(n - 1) }
+    if (isProvisional(lhs_val) && !isBool(lhs_val)) lhs_val = llvm::UndefValue::get(builder.getInt1Ty());
     if (!isBool(lhs_val)) return createUndefined();
 
     llvm::BasicBlock* current = builder.GetInsertBlock();
     builder.CreateCondBr(lhs_val, merge_block, or_false);
 
     builder.SetInsertPoint(or_false);
+    enterRegion();
     llvm::Value* rhs_val = rhs->getVal();
+    leaveRegion(rhs_val, false);
+    if (isProvisional(rhs_val) && !isBool(rhs_val)) rhs_val = llvm::UndefValue::get(lhs_val->getType());
     if (!isBool(rhs_val)) return createUndefined();
 
     llvm::BasicBlock* current_or_false = builder.GetInsertBlock();
@@ -593,13 +1997,17 @@ namespace Compiler {
     builder.SetInsertPoint(and_block);
 
     llvm::Value* lhs_val = lhs->getVal();
+    if (isProvisional(lhs_val) && !isBool(lhs_val)) lhs_val = llvm::UndefValue::get(builder.getInt1Ty());
     if (!isBool(lhs_val)) return createUndefined();
 
     llvm::BasicBlock* current = builder.GetInsertBlock();
     builder.CreateCondBr(lhs_val, true_block, merge_block);
 
     builder.SetInsertPoint(true_block);
+    enterRegion();
     llvm::Value* rhs_val = rhs->getVal();
+    leaveRegion(rhs_val, false);
+    if (isProvisional(rhs_val) && !isBool(rhs_val)) rhs_val = llvm::UndefValue::get(lhs_val->getType());
     if (!isBool(rhs_val)) return createUndefined();
 
     llvm::BasicBlock* current_and_true = builder.GetInsertBlock();
@@ -621,10 +2029,11 @@ namespace Compiler {
   }
   
   llvm::Value* RinhaCompiler::createClosureVal() {
-    llvm::Value* zero = builder.getInt8(0);
-    llvm::Value* undef = builder.CreateIntToPtr(zero, llvm::Type::getInt8PtrTy(context));
-    special_value_table[undef] = SpecialValue::CLOSURE;
-    return undef;
+    // Closures are keyed by their value in closure_table, so each one needs a
+    // distinct marker. A constant expression would be uniqued by LLVM.
+    llvm::Value* closure = createGlobal(builder.getInt8Ty(), true, builder.getInt8(0), "closure");
+    special_value_table[closure] = SpecialValue::CLOSURE;
+    return closure;
   }
 
   void RinhaCompiler::createVoidReturn() {
@@ -659,19 +2068,68 @@ namespace Compiler {
 
     builder.CreateCondBr(decision, then_block, else_block);
 
+    // Branches may end in a different block than they started (e.g. nested ifs)
     builder.SetInsertPoint(then_block);
+    uint64_t provisional_calls = n_provisional_calls;
+    enterRegion();
     llvm::Value* then_val = then->getVal();
+    bool then_owned = leaveRegion(then_val, false);
+    llvm::BasicBlock* then_end = builder.GetInsertBlock();
     builder.CreateBr(merge_block);
+    bool then_guessed = n_provisional_calls != provisional_calls;
     
     builder.SetInsertPoint(else_block);
+    provisional_calls = n_provisional_calls;
+    enterRegion();
     llvm::Value* else_val = orElse->getVal();
+    bool else_owned = leaveRegion(else_val, false);
+    llvm::BasicBlock* else_end = builder.GetInsertBlock();
     builder.CreateBr(merge_block);
+    bool else_guessed = n_provisional_calls != provisional_calls;
+
+    // A recursive call whose return type is not known yet takes the type of
+    // the other branch. If the guess was wrong, the function is regenerated.
+    if (then_val->getType() != else_val->getType()) {
+      if (isProvisional(then_val)) then_val = llvm::UndefValue::get(else_val->getType());
+      else if (isProvisional(else_val)) else_val = llvm::UndefValue::get(then_val->getType());
+    }
+
+    if (isClosure(then_val) && isClosure(else_val)) {
+      builder.SetInsertPoint(merge_block);
+      return createClosureMerge(closure_table[then_val], then_end, closure_table[else_val], else_end);
+    }
 
 
+    // Branches yielding different kinds of strings must agree on one
+    // representation. Literals convert to constants, so no code is emitted.
+    bool str_phi = (isStr(then_val) || llvm::isa<llvm::UndefValue>(then_val)) && (isStr(else_val) || llvm::isa<llvm::UndefValue>(else_val));
+    if (str_phi) {
+      then_val = toRuntimeStr(then_val);
+      else_val = toRuntimeStr(else_val);
+    }
+
+    // If one branch hands over a reference to a tuple, so must the other
+    if (then_owned != else_owned && isTuple(then_val) && isTuple(else_val)) {
+      builder.SetInsertPoint((then_owned ? else_end : then_end)->getTerminator());
+      llvm::Value*& unowned = then_owned ? else_val : then_val;
+      unowned = ownTuple(unowned);
+      then_owned = else_owned = true;
+    }
+
     builder.SetInsertPoint(merge_block);
     llvm::PHINode* phi = builder.CreatePHI(then_val->getType(), 2, "if_phi");
-    phi->addIncoming(then_val, then_block);
-    phi->addIncoming(else_val, else_block);
+    phi->addIncoming(then_val, then_end);
+    phi->addIncoming(else_val, else_end);
+    if (str_phi) ptr_id_table[phi] = "rinha_str";
+    else if (phi->getType()->isPointerTy()) {
+      // Other pointers (e.g. tuples) are described by whichever branch is
+      // known. A branch built from a provisional result may hold anything.
+      bool then_known = !llvm::isa<llvm::UndefValue>(then_val) && !(then_guessed && !else_guessed);
+      bool else_known = !llvm::isa<llvm::UndefValue>(else_val) && !(else_guessed && !then_guessed);
+      if (!then_known || !else_known || lookupPtrType(then_val) == lookupPtrType(else_val)) copyPtrId(then_known ? then_val : else_val, phi);
+    }
+    if (then_owned && else_owned && isTuple(phi)) keepTuple(phi);
+    else if (heap_tuples.count(then_val) && heap_tuples.count(else_val)) heap_tuples.insert(phi);
 
     return phi;
    }
@@ -724,15 +2182,14 @@ namespace Compiler {
       return tuple_ptr;
     }
 
-    std::string* first_id = nullptr;
+    std::string first_id;
     if (tuple_type->getElementType(0)->isPointerTy()) {
       first_id = tuple_ptr_types[ptr_id_table[tuple_ptr]].first_ptr_id; 
-      assert(first_id);
     }
     
-    llvm::Value* first_element_ptr = builder.CreateStructGEP(tuple_type, tuple_ptr, 0);
-    llvm::LoadInst* load = builder.CreateLoad(tuple_type->getStructElementType(0), first_element_ptr, "first");
-    if (first_id) ptr_id_table[load] = *first_id;
+    llvm::Value* load = loadTupleElement(tuple_ptr, 0);
+    auto opt_shape = closure_shapes.find(first_id);
+    if (opt_shape != closure_shapes.end()) return loadClosure(opt_shape->second, load);
 
     return load;
   }
@@ -757,15 +2214,19 @@ namespace Compiler {
       return createUndefined();
     }
 
-    std::string* second_id = nullptr;
+    // The next cell of a list, see createList
+    auto opt_next = next_cells.find(tuple_ptr);
+    if (opt_next != next_cells.end()) return opt_next->second;
+
+    std::string second_id;
     if (tuple_type->getElementType(1)->isPointerTy()) {
       second_id = tuple_ptr_types[ptr_id_table[tuple_ptr]].second_ptr_id;
-      assert(second_id);
     }
     
-    llvm::Value* second_element_ptr = builder.CreateStructGEP(tuple_type, tuple_ptr, 1);
-    llvm::Value* load = builder.CreateLoad(tuple_type->getStructElementType(1), second_element_ptr, "load");
-    if (second_id) ptr_id_table[load] = *second_id;
+    llvm::Value* load = loadTupleElement(tuple_ptr, 1);
+
+    auto opt_shape = closure_shapes.find(second_id);
+    if (opt_shape != closure_shapes.end()) return loadClosure(opt_shape->second, load);
 
     return load;
   }
@@ -783,10 +2244,16 @@ namespace Compiler {
     std::vector<llvm::Type*> args;
     llvm::Type* type = val->getType();
 
+    if (isClosure(val)) {
+      llvm::Type* void_type = llvm::Type::getVoidTy(context);
+      builder.CreateCall(getExternFunction(void_type, {}, "print_closure"));
+      return;
+    }
+
     if (type->isIntegerTy(1)) {
       print_name = "print_bool";
       args = {llvm::Type::getInt8Ty(context)};
-      val = builder.CreateZExt(val, type);
+      val = builder.CreateZExt(val, args[0]);
 
     } else if (type->isIntegerTy()) {
       print_name = "print_num";
@@ -817,6 +2284,11 @@ namespace Compiler {
           args = {llvm::Type::getInt8PtrTy(context)};
         }
 
+        else if (ptr_type == str_type) {
+          print_name = "print_rstr";
+          args = {str_type->getPointerTo()};
+        }
+
         else if (ptr_type->isStructTy()) {
           printTuple(val);  
           return;
@@ -883,19 +2355,47 @@ namespace Compiler {
     __ast_file = file;
   }
 
-  int compile(const std::string& input_file, const std::string& output_file) {
+  int compile(const std::string& input_file, const std::string& output_file, const CompileOptions& options) {
     set_rinha_file(input_file);
-    RinhaCompiler& generator = RinhaCompiler::initialize(input_file);
+    RinhaCompiler& generator = RinhaCompiler::initialize(input_file, options);
     
-    int ret = yyparse();
+    int ret;
+    {
+      Stats::PhaseTimer timer(Stats::Phase::PARSE);
+      if (options.pipelined_lexer) Lexer::start_pipeline();
+      ret = yyparse();
+      Lexer::stop_pipeline();
+    }
+    Stats::stop_counting_nodes();
     if (ret != 0) {
       std::cerr << "Error while parsing. yyparse error: " << ret << std::endl;
       exit(EXIT_FAILURE);
     }
 
     assert(__ast_file);
-    __ast_file->compile();
-    generator.printCode(output_file);
+    if (options.after_parse && !options.after_parse(__ast_file->term.get())) {
+      delete __ast_file;
+      return EXIT_SUCCESS;
+    }
+    {
+      Stats::PhaseTimer timer(Stats::Phase::OPTIMIZE);
+      if (options.accumulate) Accumulator::transform(__ast_file->term);
+      Inliner::inline_calls(__ast_file->term, options.inline_threshold);
+      DeadCode::remove_bindings(__ast_file->term);
+      if (options.cse) CSE::eliminate(__ast_file->term);
+      generator.analyze(__ast_file->term.get());
+    }
+    {
+      Stats::PhaseTimer timer(Stats::Phase::CODEGEN);
+      __ast_file->compile();
+      generator.finalize();
+    }
+    if (Stats::is_enabled()) Stats::set(Stats::Counter::IR_INSTRUCTIONS, generator.getInstructionCount());
+    {
+      Stats::PhaseTimer timer(Stats::Phase::EMIT);
+      if (options.emit == EmitKind::OBJ) generator.emitObject(output_file);
+      else generator.printCode(output_file);
+    }
     delete __ast_file;
     return EXIT_SUCCESS;
   }
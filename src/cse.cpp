@@ -0,0 +1,466 @@
+#include "cse.h"
+#include "analysis.h"
+#include "stats.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+
+namespace CSE {
+
+  // The Let or Function node that introduced a name (nullptr if unbound)
+  using Binding = const AST::Term*;
+
+  // A class of structurally equal terms
+  struct Value {
+    bool pure;
+    bool shareable;   // Pure and not a leaf, so worth binding
+    bool branches;    // Has an if or a short-circuit operator
+    uint32_t size;    // In AST nodes
+    // The innermost binding any name in it refers to, so it can be evaluated
+    // wherever that one is in scope. Terms with a let or function literal are
+    // never shared, so the names bound inside of them are left out.
+    std::string name;
+    Binding innermost = nullptr;
+  };
+
+  static std::string unique_key(char tag, const void* ptr) {
+    return tag + std::to_string(reinterpret_cast<uintptr_t>(ptr));
+  }
+
+  static bool is_short_circuit(AST::Term* term) {
+    AST::Binary* binary = dynamic_cast<AST::Binary*>(term);
+    return binary && (binary->binop == AST::BinOp::AND || binary->binop == AST::BinOp::OR);
+  }
+
+  // Like Analysis::unchain, but stops at short-circuit operators, whose
+  // right operand isn't always evaluated
+  static void unchain_strict(AST::Binary* binary, std::vector<AST::Binary*>& chain) {
+    for (; binary && !is_short_circuit(binary); binary = dynamic_cast<AST::Binary*>(binary->lhs.get())) chain.push_back(binary);
+  }
+
+  // Where each shareable term occurs in a region
+  using Occurrences = std::unordered_map<uint32_t, std::unordered_set<std::unique_ptr<AST::Term>*>>;
+
+  // A shareable term, where it's evaluated first
+  struct Found {
+    uint32_t id;
+    std::unique_ptr<AST::Term>* slot;
+  };
+
+  struct Eliminator {
+    Analysis::Effects effects;
+    Analysis::Scope scope;
+    uint32_t n_bindings = 0;
+
+    // Hash-consing table. Keys are made of a tag, the node's own fields and
+    // the values of its children, so equal keys mean equal terms.
+    std::unordered_map<std::string, uint32_t> table;
+    std::vector<Value> values;
+    std::unordered_map<const AST::Term*, uint32_t> ids;
+
+    Eliminator(AST::Term* root) : effects(root) {}
+
+    Binding lookup(const std::string& name) {
+      return scope.lookup(name);
+    }
+
+    // Adds a reference to name, bound to binding in the current scope
+    void use(Value& value, const std::string& name, Binding binding) {
+      if (!binding) return;
+      if (value.innermost && scope.level(name) < scope.level(value.name)) return;
+      value.name = name;
+      value.innermost = binding;
+    }
+
+    void include(Value& value, std::string& key, uint32_t id) {
+      const Value& child = values[id];
+      value.pure &= child.pure;
+      value.branches |= child.branches;
+      value.size += child.size;
+      key += ',' + std::to_string(id);
+    }
+
+    uint32_t intern(AST::Term* term, const std::string& key, Value& value) {
+      value.shareable &= value.pure;
+      auto [it, inserted] = table.emplace(key, values.size());
+      if (inserted) values.push_back(std::move(value));
+      ids[term] = it->second;
+      return it->second;
+    }
+
+    // Numbers term and its subterms, except for function bodies, which are
+    // numbered when they're visited. Terms that bind names (and prints) get
+    // keys of their own, so they're never shared. Sequences of lets and
+    // chains of operators are numbered in a loop, so long ones don't need a
+    // deep stack.
+    uint32_t number(AST::Term* term) {
+      if (dynamic_cast<AST::Let*>(term)) {
+        size_t n_scope = scope.size();
+        std::vector<std::pair<AST::Let*, uint32_t>> lets;
+        while (AST::Let* let = dynamic_cast<AST::Let*>(term)) {
+          const std::string& name = *let->parameter->identifier;
+          bool is_fn = dynamic_cast<AST::Function*>(let->val.get());
+          if (is_fn) scope.push(name, let);
+          lets.push_back({let, number(let->val.get())});
+          if (!is_fn) scope.push(name, let);
+          term = let->next.get();
+        }
+        uint32_t id = number(term);
+        scope.resize(n_scope);
+
+        for (auto it = lets.rbegin(); it != lets.rend(); it++) {
+          Value value{true, false, false, 1};
+          std::string key = unique_key('l', it->first);
+          include(value, key, it->second);
+          include(value, key, id);
+          id = intern(it->first, key, value);
+        }
+        return id;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        Analysis::unchain(binary, chain);
+        uint32_t id = number(chain.back()->lhs.get());
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+          Value value{true, true, is_short_circuit(*it), 1};
+          std::string key = "o" + std::to_string(static_cast<uint32_t>((*it)->binop));
+          include(value, key, id);
+          use(value, values[id].name, values[id].innermost);
+          uint32_t rhs = number((*it)->rhs.get());
+          include(value, key, rhs);
+          use(value, values[rhs].name, values[rhs].innermost);
+          id = intern(*it, key, value);
+        }
+        return id;
+      }
+
+      Value value{true, false, false, 1};
+      std::string key;
+      if (dynamic_cast<AST::Function*>(term)) {
+        key = unique_key('f', term);
+      } else {
+        if (AST::Int* num = dynamic_cast<AST::Int*>(term)) key = "i" + std::to_string(num->value);
+        else if (AST::Bool* boolean = dynamic_cast<AST::Bool*>(term)) key = boolean->val ? "b1" : "b0";
+        else if (AST::Str* str = dynamic_cast<AST::Str*>(term)) key = "s" + std::to_string(str->str->size()) + ":" + *str->str;
+        else if (AST::Var* var = dynamic_cast<AST::Var*>(term)) {
+          Binding binding = lookup(*var->name);
+          key = unique_key('v', binding) + ':' + *var->name;
+          use(value, *var->name, binding);
+        } else if (AST::Call* call = dynamic_cast<AST::Call*>(term)) {
+          Binding binding = lookup(call->callee);
+          key = unique_key('c', binding) + ':' + call->callee;
+          use(value, call->callee, binding);
+          value.shareable = true;
+        } else if (dynamic_cast<AST::Print*>(term)) {
+          key = unique_key('p', term);
+          value.pure = false;
+        } else if (dynamic_cast<AST::If*>(term)) {
+          key = "?";
+          value.branches = true;
+        }
+        else if (dynamic_cast<AST::First*>(term)) key = "1";
+        else if (dynamic_cast<AST::Second*>(term)) key = "2";
+        else if (dynamic_cast<AST::Tuple*>(term)) key = "t";
+        else key = unique_key('?', term);
+
+        std::vector<std::unique_ptr<AST::Term>*> children;
+        term->getChildren(children);
+        for (std::unique_ptr<AST::Term>* child : children) {
+          uint32_t id = number(child->get());
+          include(value, key, id);
+          use(value, values[id].name, values[id].innermost);
+        }
+        if (!children.empty()) value.shareable = true;
+        if (dynamic_cast<AST::Call*>(term) && value.pure) value.pure = effects.isPure(term);
+      }
+      return intern(term, key, value);
+    }
+
+    // Adds the shareable terms under slot to occurrences, or removes them.
+    // Function bodies are left out, since occurrences aren't shared across
+    // function literals.
+    void track(std::unique_ptr<AST::Term>& slot, Occurrences& occurrences, bool add) {
+      std::vector<std::unique_ptr<AST::Term>*> stack = {&slot};
+      while (!stack.empty()) {
+        std::unique_ptr<AST::Term>* next = stack.back();
+        stack.pop_back();
+        AST::Term* term = next->get();
+        if (dynamic_cast<AST::Function*>(term)) continue;
+
+        uint32_t id = ids.at(term);
+        if (values[id].shareable) {
+          if (add) occurrences[id].insert(next);
+          else occurrences[id].erase(next);
+        }
+        term->getChildren(stack);
+      }
+    }
+
+    // Collects the shareable terms that are evaluated whenever the term in
+    // slot is, before anything that may print, with where each of them is
+    // evaluated first. Terms that were already seen, or that are evaluated
+    // on some paths only, are left out, since binding them before slot could
+    // evaluate them earlier or more often than the program does. clean is
+    // cleared once something may have printed.
+    void reach(std::unique_ptr<AST::Term>& slot, bool& clean, std::vector<Found>& found, std::unordered_set<uint32_t>& seen) {
+      AST::Term* term = slot.get();
+      if (dynamic_cast<AST::Function*>(term)) return;
+
+      auto visit = [&](std::unique_ptr<AST::Term>& at) {
+        uint32_t id = ids.at(at.get());
+        if (!values[id].shareable) return;
+        if (clean && !seen.count(id)) found.push_back({id, &at});
+        seen.insert(id);
+      };
+
+      // Lets and chains of operators are followed in a loop, see number
+      if (dynamic_cast<AST::Let*>(term)) {
+        std::unique_ptr<AST::Term>* next = &slot;
+        while (AST::Let* let = dynamic_cast<AST::Let*>(next->get())) {
+          reach(let->val, clean, found, seen);
+          next = &let->next;
+        }
+        reach(*next, clean, found, seen);
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term); binary && !is_short_circuit(binary)) {
+        std::vector<AST::Binary*> chain;
+        unchain_strict(binary, chain);
+        visit(slot);
+        for (size_t i = 0; i + 1 < chain.size(); i++) visit(chain[i]->lhs);
+        reach(chain.back()->lhs, clean, found, seen);
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) reach((*it)->rhs, clean, found, seen);
+        return;
+      }
+
+      visit(slot);
+      if (AST::If* branch = dynamic_cast<AST::If*>(term)) {
+        reach(branch->condition, clean, found, seen);
+        bool then_clean = clean, else_clean = clean;
+        std::vector<Found> then_found, else_found;
+        std::unordered_set<uint32_t> then_seen, else_seen;
+        reach(branch->then, then_clean, then_found, then_seen);
+        reach(branch->orElse, else_clean, else_found, else_seen);
+
+        // Only what both arms evaluate is evaluated either way
+        std::unordered_set<uint32_t> else_ids;
+        for (const Found& found_else : else_found) else_ids.insert(found_else.id);
+        for (const Found& found_then : then_found) {
+          if (else_ids.count(found_then.id) && !seen.count(found_then.id)) found.push_back(found_then);
+        }
+        seen.insert(then_seen.begin(), then_seen.end());
+        seen.insert(else_seen.begin(), else_seen.end());
+        clean = then_clean && else_clean;
+        return;
+      }
+
+      if (is_short_circuit(term)) {
+        AST::Binary* binary = static_cast<AST::Binary*>(term);
+        reach(binary->lhs, clean, found, seen);
+        // The right operand isn't always evaluated, so nothing in it is found
+        bool rhs_clean = false;
+        std::vector<Found> rhs_found;
+        reach(binary->rhs, rhs_clean, rhs_found, seen);
+        clean &= values[ids.at(binary->rhs.get())].pure;
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) reach(*child, clean, found, seen);
+      // The term's own effect (e.g. a print) comes after its operands
+      clean &= values[ids.at(term)].pure;
+    }
+
+    // Bindings enclose one another, so the innermost one being in scope
+    // means they all are
+    bool inScope(const Value& value) {
+      return !value.innermost || lookup(value.name) == value.innermost;
+    }
+
+    // Wraps slot in a let binding the term in first, and refers to the
+    // binding instead wherever else the term occurs. Terms that contain an
+    // occurrence keep their numbers: every copy of them changes the same
+    // way, so they're still equal to one another.
+    void bind(std::unique_ptr<AST::Term>& slot, const Found& first, Occurrences& occurrences) {
+      std::unordered_set<std::unique_ptr<AST::Term>*> others = std::move(occurrences[first.id]);
+      occurrences.erase(first.id);
+      others.erase(first.slot);
+      for (std::unique_ptr<AST::Term>* other : others) track(*other, occurrences, false);
+
+      // Not a valid identifier, so it can't clash with the program's names
+      std::string name = "cse." + std::to_string(n_bindings++);
+      AST::Term* val = first.slot->release();
+      AST::Term* body = slot.release();
+      AST::Let* let = new AST::Let(new AST::Parameter(new std::string(name)), val, body);
+      let->loc = body->loc;
+      slot.reset(let);
+
+      std::string var_key = unique_key('v', let) + ':' + name;
+      auto refer = [&](std::unique_ptr<AST::Term>& at, const AST::Localization& loc) {
+        AST::Var* var = new AST::Var(new std::string(name));
+        var->loc = loc;
+        at.reset(var);
+        Value value{true, false, false, 1};
+        use(value, name, let);
+        intern(var, var_key, value);
+      };
+      refer(*first.slot, val->loc);
+      for (std::unique_ptr<AST::Term>* other : others) refer(*other, (*other)->loc);
+
+      Value value{true, false, false, 1};
+      std::string key = unique_key('l', let);
+      include(value, key, ids.at(val));
+      include(value, key, ids.at(body));
+      intern(let, key, value);
+      Stats::increment(Stats::Counter::CSE_BINDINGS);
+    }
+
+    // Binds, before the term in slot, what element evaluates first and
+    // occurs again further on in the region, largest first (binding a term
+    // takes the occurrences of its subterms in the other copies with it).
+    // element is slot itself, or the value of the let in it. Returns how
+    // many lets were added.
+    uint32_t share(std::unique_ptr<AST::Term>& slot, std::unique_ptr<AST::Term>& element, Occurrences& occurrences) {
+      bool clean = true;
+      std::vector<Found> found;
+      std::unordered_set<uint32_t> seen;
+      reach(element, clean, found, seen);
+      std::stable_sort(found.begin(), found.end(), [&](const Found& a, const Found& b) {
+        return values[a.id].size > values[b.id].size;
+      });
+
+      uint32_t n_lets = 0;
+      for (const Found& first : found) {
+        auto opt_slots = occurrences.find(first.id);
+        if (opt_slots == occurrences.end() || opt_slots->second.size() < 2) continue;
+        // Gone with a copy of a larger term that was bound
+        if (!opt_slots->second.count(first.slot)) continue;
+        if (!inScope(values[first.id])) continue;
+        bind(slot, first, occurrences);
+        n_lets++;
+      }
+      return n_lets;
+    }
+
+    // Numbers a function body (or the whole program) and tells whether
+    // anything in it repeats
+    bool enterRegion(std::unique_ptr<AST::Term>& root) {
+      number(root.get());
+      Occurrences occurrences;
+      track(root, occurrences, true);
+      for (auto& [id, slots] : occurrences) if (slots.size() >= 2) return true;
+      return false;
+    }
+
+    // Whether a term after this one may have to be looked at again: this one
+    // could print, or reach an occurrence only on some paths, either of
+    // which keeps what comes after from being hoisted above it
+    bool blocks(AST::Term* term) {
+      const Value& value = values[ids.at(term)];
+      return !value.pure || value.branches;
+    }
+
+    // Shares what repeats in the term in slot. The values of a sequence of
+    // lets are looked at in a loop, each of them once: occurrences only keeps
+    // what comes after the value being looked at, and is updated as terms
+    // are bound, so this is linear in the length of the sequence.
+    void region(std::unique_ptr<AST::Term>& slot, bool repeats) {
+      Occurrences occurrences;
+      if (repeats) track(slot, occurrences, true);
+      auto pass = [&](std::unique_ptr<AST::Term>& element) {
+        if (repeats) track(element, occurrences, false);
+        walk(element, repeats, false);
+      };
+
+      size_t n_scope = scope.size();
+      std::unique_ptr<AST::Term>* next = &slot;
+      for (;;) {
+        AST::Let* let = dynamic_cast<AST::Let*>(next->get());
+        bool is_fn = let && dynamic_cast<AST::Function*>(let->val.get());
+        if (repeats && !is_fn) {
+          uint32_t n_lets = share(*next, let ? let->val : *next, occurrences);
+          for (uint32_t i = 0; i < n_lets; i++) {
+            AST::Let* binding = static_cast<AST::Let*>(next->get());
+            pass(binding->val);
+            scope.push(*binding->parameter->identifier, binding);
+            next = &binding->next;
+          }
+        }
+        if (!let) {
+          pass(*next);
+          break;
+        }
+
+        const std::string& name = *let->parameter->identifier;
+        if (is_fn) scope.push(name, let);
+        pass(let->val);
+        if (!is_fn) scope.push(name, let);
+        next = &let->next;
+      }
+      scope.resize(n_scope);
+    }
+
+    // Outermost first, so that a term is bound where all of its occurrences
+    // can see it. Sequences of lets are regions of their own, since the
+    // names they bind are what some of their terms refer to. Other places
+    // are only looked at where something could be left to share that the
+    // enclosing region couldn't: a term before them might print, or they're
+    // not always evaluated.
+    void walk(std::unique_ptr<AST::Term>& slot, bool repeats, bool look) {
+      AST::Term* term = slot.get();
+      if (look || dynamic_cast<AST::Let*>(term)) {
+        region(slot, repeats);
+        return;
+      }
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) scope.push(*param->identifier, fn);
+        bool fn_repeats = enterRegion(fn->value);
+        walk(fn->value, fn_repeats, fn_repeats);
+        scope.resize(scope.size() - fn->parameters->params.size());
+        return;
+      }
+
+      if (AST::If* branch = dynamic_cast<AST::If*>(term)) {
+        walk(branch->condition, repeats, false);
+        walk(branch->then, repeats, repeats);
+        walk(branch->orElse, repeats, repeats);
+        return;
+      }
+
+      if (is_short_circuit(term)) {
+        AST::Binary* binary = static_cast<AST::Binary*>(term);
+        walk(binary->lhs, repeats, false);
+        walk(binary->rhs, repeats, repeats);
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        unchain_strict(binary, chain);
+        walk(chain.back()->lhs, repeats, false);
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+          walk((*it)->rhs, repeats, repeats && blocks((*it)->lhs.get()));
+        }
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      bool blocked = false;
+      for (std::unique_ptr<AST::Term>* child : children) {
+        walk(*child, repeats, repeats && blocked);
+        blocked |= blocks(child->get());
+      }
+    }
+  };
+
+  void eliminate(std::unique_ptr<AST::Term>& root) {
+    Eliminator eliminator(root.get());
+    bool repeats = eliminator.enterRegion(root);
+    eliminator.walk(root, repeats, repeats);
+  }
+}
@@ -0,0 +1,149 @@
+#include "deadcode.h"
+#include "analysis.h"
+#include "stats.h"
+#include <map>
+#include <set>
+
+namespace DeadCode {
+
+  // The Let or Function node that introduced a name (nullptr if unbound)
+  using Binding = const AST::Term*;
+
+  struct BindingRemover {
+    Analysis::Effects effects;
+    Analysis::Scope scope;
+    // Let-bound functions whose own body is being looked at. References to
+    // themselves don't keep them alive.
+    std::set<Binding> defining;
+    std::map<Binding, int64_t> uses;
+
+    BindingRemover(AST::Term* root) : effects(root) {}
+
+    Binding lookup(const std::string& name) {
+      return scope.lookup(name);
+    }
+
+    void refer(const std::string& name, int64_t delta) {
+      Binding binding = lookup(name);
+      if (binding && !defining.count(binding)) uses[binding] += delta;
+    }
+
+    // Adds delta to the uses of every binding term refers to
+    void count(AST::Term* term, int64_t delta) {
+      if (AST::Var* var = dynamic_cast<AST::Var*>(term)) {
+        refer(*var->name, delta);
+        return;
+      }
+
+      if (AST::Call* call = dynamic_cast<AST::Call*>(term)) refer(call->callee, delta);
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) scope.push(*param->identifier, fn);
+        count(fn->value.get(), delta);
+        scope.resize(scope.size() - fn->parameters->params.size());
+        return;
+      }
+
+      // Sequences of lets are walked in a loop, so long ones don't need a
+      // deep stack
+      if (dynamic_cast<AST::Let*>(term)) {
+        size_t n_scope = scope.size();
+        while (AST::Let* let = dynamic_cast<AST::Let*>(term)) {
+          const std::string& name = *let->parameter->identifier;
+          bool is_fn = dynamic_cast<AST::Function*>(let->val.get());
+          if (is_fn) scope.push(name, let);
+          countValue(let, delta);
+          if (!is_fn) scope.push(name, let);
+          term = let->next.get();
+        }
+        count(term, delta);
+        scope.resize(n_scope);
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        Analysis::unchain(binary, chain);
+        count(chain.back()->lhs.get(), delta);
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) count((*it)->rhs.get(), delta);
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) count(child->get(), delta);
+    }
+
+    void countValue(AST::Let* let, int64_t delta) {
+      defining.insert(let);
+      count(let->val.get(), delta);
+      defining.erase(let);
+    }
+
+    // Inner bindings go first, so removing one can free the ones its value
+    // referred to
+    void walk(std::unique_ptr<AST::Term>& slot) {
+      AST::Term* term = slot.get();
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) scope.push(*param->identifier, fn);
+        walk(fn->value);
+        scope.resize(scope.size() - fn->parameters->params.size());
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        Analysis::unchain(binary, chain);
+        walk(chain.back()->lhs);
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) walk((*it)->rhs);
+        return;
+      }
+
+      if (!dynamic_cast<AST::Let*>(term)) {
+        std::vector<std::unique_ptr<AST::Term>*> children;
+        term->getChildren(children);
+        for (std::unique_ptr<AST::Term>* child : children) walk(*child);
+        return;
+      }
+
+      // Sequences of lets are walked down in a loop (so long ones don't need
+      // a deep stack), then back up to remove the dead ones
+      std::vector<std::unique_ptr<AST::Term>*> slots;
+      std::unique_ptr<AST::Term>* next = &slot;
+      while (AST::Let* let = dynamic_cast<AST::Let*>(next->get())) {
+        const std::string& name = *let->parameter->identifier;
+        bool is_fn = dynamic_cast<AST::Function*>(let->val.get());
+        if (is_fn) scope.push(name, let);
+        defining.insert(let);
+        walk(let->val);
+        defining.erase(let);
+        if (!is_fn) scope.push(name, let);
+        slots.push_back(next);
+        next = &let->next;
+      }
+      walk(*next);
+
+      for (auto it = slots.rbegin(); it != slots.rend(); it++) {
+        AST::Let* let = static_cast<AST::Let*>((*it)->get());
+        bool is_fn = dynamic_cast<AST::Function*>(let->val.get());
+        if (!is_fn) scope.pop();
+
+        bool dead = !uses[let] && effects.isPure(let->val.get());
+        if (dead) countValue(let, -1);
+        if (is_fn) scope.pop();
+        if (!dead) continue;
+
+        std::unique_ptr<AST::Term> let_next = std::move(let->next);
+        **it = std::move(let_next);
+        Stats::increment(Stats::Counter::DEAD_BINDINGS);
+      }
+    }
+  };
+
+  void remove_bindings(std::unique_ptr<AST::Term>& root) {
+    BindingRemover remover(root.get());
+    remover.count(root.get(), 1);
+    remover.walk(root);
+  }
+}
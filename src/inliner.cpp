@@ -0,0 +1,238 @@
+#include "inliner.h"
+#include "analysis.h"
+#include "stats.h"
+#include <set>
+#include <algorithm>
+
+namespace Inliner {
+
+  // The Let or Function node that introduced a name (nullptr if unbound)
+  using Binding = const AST::Term*;
+
+  struct Candidate {
+    AST::Function* fn;
+    // What each of the function's free variables referred to where it was defined
+    std::vector<std::pair<std::string, Binding>> captures;
+  };
+
+  // Whether visit returns true for some term in root. Walks an explicit
+  // stack of pending terms, as generated programs can nest very deeply.
+  template <typename Visit>
+  static bool any_term(AST::Term* root, Visit visit) {
+    std::vector<AST::Term*> pending = {root};
+    while (!pending.empty()) {
+      AST::Term* term = pending.back();
+      pending.pop_back();
+      if (visit(term)) return true;
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) pending.push_back(child->get());
+    }
+    return false;
+  }
+
+  static uint32_t size(AST::Term* term) {
+    uint32_t n = 0;
+    any_term(term, [&n](AST::Term*) { n++; return false; });
+    return n;
+  }
+
+  static bool contains_function(AST::Term* term) {
+    return any_term(term, [](AST::Term* term) { return dynamic_cast<AST::Function*>(term) != nullptr; });
+  }
+
+  // Safe to evaluate anywhere, any number of times
+  static bool is_pure(AST::Term* term) {
+    return !any_term(term, [](AST::Term* term) {
+      return dynamic_cast<AST::Call*>(term) || dynamic_cast<AST::Print*>(term) || dynamic_cast<AST::Function*>(term);
+    });
+  }
+
+  // Names bound by lets inside a body without nested functions
+  static void collect_binders(AST::Term* term, std::set<std::string>& binders) {
+    any_term(term, [&binders](AST::Term* term) {
+      if (AST::Let* let = dynamic_cast<AST::Let*>(term)) binders.insert(*let->parameter->identifier);
+      return false;
+    });
+  }
+
+  // Small enough to copy for every use of a parameter
+  static bool is_atom(AST::Term* term) {
+    return dynamic_cast<AST::Var*>(term) || dynamic_cast<AST::Int*>(term) ||
+      dynamic_cast<AST::Bool*>(term) || dynamic_cast<AST::Str*>(term);
+  }
+
+  static bool calls(AST::Term* term, const std::string& name) {
+    return any_term(term, [&name](AST::Term* term) {
+      AST::Call* call = dynamic_cast<AST::Call*>(term);
+      return call && call->callee == name;
+    });
+  }
+
+  // Replaces the parameters in a copy of a function body by the arguments
+  static void substitute(std::unique_ptr<AST::Term>& slot, std::map<std::string, AST::Term*> args) {
+    AST::Term* term = slot.get();
+
+    if (AST::Var* var = dynamic_cast<AST::Var*>(term)) {
+      auto opt_arg = args.find(*var->name);
+      if (opt_arg != args.end()) slot.reset(opt_arg->second->clone());
+      return;
+    }
+
+    if (AST::Call* call = dynamic_cast<AST::Call*>(term)) {
+      auto opt_arg = args.find(call->callee);
+      if (opt_arg != args.end()) {
+        // Only variables are substituted for parameters that are called
+        AST::Var* callee = dynamic_cast<AST::Var*>(opt_arg->second);
+        assert(callee);
+        AST::Call* substituted = new AST::Call(callee->name.get(), call->args.release());
+        substituted->loc = call->loc;
+        slot.reset(substituted);
+      }
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      slot->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) substitute(*child, args);
+      return;
+    }
+
+    if (AST::Let* let = dynamic_cast<AST::Let*>(term)) {
+      substitute(let->val, args);
+      args.erase(*let->parameter->identifier);
+      substitute(let->next, args);
+      return;
+    }
+
+    std::vector<std::unique_ptr<AST::Term>*> children;
+    term->getChildren(children);
+    for (std::unique_ptr<AST::Term>* child : children) substitute(*child, args);
+  }
+
+  struct CallInliner {
+    uint32_t threshold;
+    Analysis::Scope scope;
+    std::map<Binding, Candidate> candidates;
+    uint32_t n_bindings = 0;
+
+    Binding lookup(const std::string& name) {
+      return scope.lookup(name);
+    }
+
+    void consider(AST::Let* let, AST::Function* fn) {
+      const std::string& name = *let->parameter->identifier;
+      std::vector<std::string> free = Analysis::free_variables(fn);
+      if (std::find(free.begin(), free.end(), name) != free.end()) return;
+      if (contains_function(fn->value.get()) || size(fn->value.get()) > threshold) return;
+
+      Candidate& candidate = candidates[let];
+      candidate.fn = fn;
+      for (const std::string& var : free) candidate.captures.push_back({var, lookup(var)});
+    }
+
+    void tryInline(std::unique_ptr<AST::Term>& slot, AST::Call* call) {
+      auto opt_candidate = candidates.find(lookup(call->callee));
+      if (opt_candidate == candidates.end()) return;
+      Candidate& candidate = opt_candidate->second;
+
+      std::vector<std::unique_ptr<AST::Parameter>>& params = candidate.fn->parameters->params;
+      std::vector<std::unique_ptr<AST::Term>>& args = call->args->args;
+      if (params.size() != args.size()) return;
+
+      for (auto& [name, binding] : candidate.captures) {
+        if (lookup(name) != binding) return;
+      }
+
+      AST::Term* body = candidate.fn->value.get();
+      std::set<std::string> binders;
+      collect_binders(body, binders);
+      std::vector<uint64_t> bound;
+      for (uint64_t i = 0; i < args.size(); i++) {
+        AST::Term* arg = args[i].get();
+        if (!is_pure(arg)) return;
+        const std::string& param = *params[i]->identifier;
+        if (!is_atom(arg)) {
+          if (calls(body, param)) return;
+          bound.push_back(i);
+          continue;
+        }
+        for (const std::string& var : Analysis::free_variables(arg)) {
+          if (binders.count(var)) return;
+        }
+      }
+
+      // Other arguments are bound by lets around the body, so the body
+      // refers to each of them by name instead of getting a copy of it for
+      // every use of its parameter
+      std::map<std::string, AST::Term*> substitutions;
+      std::vector<std::unique_ptr<AST::Var>> names;
+      for (uint64_t i = 0; i < args.size(); i++) substitutions[*params[i]->identifier] = args[i].get();
+      for (uint64_t i : bound) {
+        // Not a valid identifier, so it can't clash with the program's names
+        names.emplace_back(new AST::Var(new std::string("inline." + std::to_string(n_bindings++))));
+        substitutions[*params[i]->identifier] = names.back().get();
+      }
+
+      std::unique_ptr<AST::Term> inlined(body->clone());
+      substitute(inlined, substitutions);
+      for (uint64_t j = bound.size(); j-- > 0;) {
+        AST::Term* arg = args[bound[j]].release();
+        AST::Let* let = new AST::Let(new AST::Parameter(names[j]->name.release()), arg, inlined.release());
+        let->loc = call->loc;
+        inlined.reset(let);
+      }
+      slot = std::move(inlined);
+      Stats::increment(Stats::Counter::INLINED_CALLS);
+    }
+
+    void walk(std::unique_ptr<AST::Term>& slot) {
+      AST::Term* term = slot.get();
+
+      // Sequences of lets are walked in a loop, so long ones don't need a
+      // deep stack
+      if (dynamic_cast<AST::Let*>(term)) {
+        size_t n_scope = scope.size();
+        std::unique_ptr<AST::Term>* next = &slot;
+        while (AST::Let* let = dynamic_cast<AST::Let*>(next->get())) {
+          const std::string& name = *let->parameter->identifier;
+          AST::Function* fn = dynamic_cast<AST::Function*>(let->val.get());
+          // A let-bound function may refer to itself
+          if (fn) scope.push(name, let);
+          walk(let->val);
+          if (fn) consider(let, fn);
+          else scope.push(name, let);
+          next = &let->next;
+        }
+        walk(*next);
+        scope.resize(n_scope);
+        return;
+      }
+
+      if (AST::Function* fn = dynamic_cast<AST::Function*>(term)) {
+        for (const std::unique_ptr<AST::Parameter>& param : fn->parameters->params) scope.push(*param->identifier, fn);
+        walk(fn->value);
+        scope.resize(scope.size() - fn->parameters->params.size());
+        return;
+      }
+
+      if (AST::Binary* binary = dynamic_cast<AST::Binary*>(term)) {
+        std::vector<AST::Binary*> chain;
+        Analysis::unchain(binary, chain);
+        walk(chain.back()->lhs);
+        for (auto it = chain.rbegin(); it != chain.rend(); it++) walk((*it)->rhs);
+        return;
+      }
+
+      std::vector<std::unique_ptr<AST::Term>*> children;
+      term->getChildren(children);
+      for (std::unique_ptr<AST::Term>* child : children) walk(*child);
+
+      // Calls in the arguments (and in the callee's body) are already inlined
+      if (AST::Call* call = dynamic_cast<AST::Call*>(term)) tryInline(slot, call);
+    }
+  };
+
+  void inline_calls(std::unique_ptr<AST::Term>& root, uint32_t threshold) {
+    if (!threshold) return;
+    CallInliner inliner{threshold, Analysis::Scope(), {}};
+    inliner.walk(root);
+  }
+}
@@ -2,8 +2,96 @@
 #include "lexer.h"
 #include "compiler.h"
 #include "parser.tab.h"
+#include <atomic>
+#include <thread>
 
 namespace Lexer {
+	Token scanned;
+
+	// Line of the last token handed to the parser, for its errors
+	static int parser_line = 1;
+
+	/*  Tokens on their way from the scanner's thread to the parser. Each side
+	    only writes its own index and reads the other's to see how far it can
+	    go, so publishing a token is a release store and nothing is locked.
+	    Each side also remembers the other's index and only reads it again
+	    when it has caught up with it, so the two don't keep taking each
+	    other's cache line.
+	*/
+	class TokenRing {
+		static constexpr size_t capacity = 4096;
+		static_assert((capacity & (capacity - 1)) == 0, "indices wrap around");
+
+		Token slots[capacity];
+		// The parser's side
+		alignas(64) std::atomic<size_t> head = 0;
+		size_t known_tail = 0;
+		// The scanner's side
+		alignas(64) std::atomic<size_t> tail = 0;
+		size_t known_head = 0;
+
+	public:
+		// Set when the parser won't take any more tokens
+		std::atomic<bool> cancelled = false;
+
+		// Waits while the ring is full. Returns false if it was cancelled.
+		bool push(const Token& token) {
+			size_t next = tail.load(std::memory_order_relaxed);
+			while (next - known_head == capacity) {
+				if (cancelled.load(std::memory_order_relaxed)) return false;
+				known_head = head.load(std::memory_order_acquire);
+				if (next - known_head == capacity) std::this_thread::yield();
+			}
+			slots[next & (capacity - 1)] = token;
+			tail.store(next + 1, std::memory_order_release);
+			return true;
+		}
+
+		void pop(Token& token) {
+			size_t next = head.load(std::memory_order_relaxed);
+			while (next == known_tail) {
+				known_tail = tail.load(std::memory_order_acquire);
+				if (next == known_tail) std::this_thread::yield();
+			}
+			token = slots[next & (capacity - 1)];
+			head.store(next + 1, std::memory_order_release);
+		}
+	};
+
+	static std::unique_ptr<TokenRing> ring;
+	static std::thread scanner;
+
+	static void scan(Token& token) {
+		token.kind = yylex();
+		token.value = scanned.value;
+		token.loc = scanned.loc;
+	}
+
+	void start_pipeline() {
+		// On one CPU, the threads would only take turns
+		if (std::thread::hardware_concurrency() == 1) return;
+		ring = std::make_unique<TokenRing>();
+		scanner = std::thread([ring = ring.get()]() {
+			Token token;
+			do scan(token);
+			while (ring->push(token) && token.kind);
+		});
+	}
+
+	void stop_pipeline() {
+		if (!scanner.joinable()) return;
+		ring->cancelled = true;
+		scanner.join();
+		ring.reset();
+	}
+
+	int next_token(Token& token) {
+		if (ring) ring->pop(token);
+		else scan(token);
+		if (token.kind) parser_line = token.loc.first_line;
+		return token.kind;
+	}
+
 	int64_t get_number(int base) {
 		size_t offset = base != 10 ? 2 : 0;
 		char* end = yytext + yyleng;
@@ -77,3 +165,8 @@ namespace Lexer {
 		}	
 	}
 }
+
+int yyerror(const char *s) {
+	std::cerr << "Error on line " << Lexer::parser_line << ": " << s << std::endl;
+	return 1;
+}
@@ -6,37 +6,48 @@
 #include "lexer.h"
 #include "compiler.h"
 #include "parser.tab.h"
+#include "stats.h"
+#include "server.h"
+#include "client.h"
+#include "watch.h"
 
 constexpr const char lexer_str[] = "lexer";
+constexpr const char parser_str[] = "parser";
 constexpr const char comp_str[] = "compiler";
 
 // Uncomment when running Bison with -t
 //extern int yydebug;
 
 enum class program_t : uint8_t {
-  LEXER, COMPILER
+  LEXER, PARSER, COMPILER
 };
 
 struct args_t {
   program_t main;
   std::string filename;
+  std::string stats;
+  std::string serve;
+  std::string connect;
+  bool watch;
+  Compiler::CompileOptions compile_options;
 };
 
 boost::bimap<std::string_view, program_t> program_map;
 
 void init_global() {
   program_map.insert({lexer_str, program_t::LEXER});
+  program_map.insert({parser_str, program_t::PARSER});
   program_map.insert({comp_str, program_t::COMPILER});
 
   // Uncomment when running Bison with -t
   //yydebug = 1
 }
 
-std::string changeExtToLL(const std::string& path, const std::string& new_dir) {
+std::string changeExt(const std::string& path, const std::string& new_dir, const std::string& ext) {
   std::filesystem::path p(path);
   std::string filename = p.stem().string();
   std::filesystem::path newFile(new_dir);
-  newFile /= filename + ".ll";
+  newFile /= filename + ext;
   return newFile.string();
 }
 
@@ -44,6 +55,27 @@ void parse_args(int argc, char* argv[], args_t& args) {
   constexpr const char prog_arg[] = "program";
   constexpr const char src_arg[] = "source"; 
   constexpr const char help_arg[] = "help";
+  constexpr const char stats_arg[] = "stats";
+  constexpr const char instrument_arg[] = "instrument";
+  constexpr const char inline_threshold_arg[] = "inline-threshold";
+  constexpr const char no_cse_arg[] = "no-cse";
+  constexpr const char no_accumulate_arg[] = "no-accumulate";
+  constexpr const char specialization_budget_arg[] = "specialization-budget";
+  constexpr const char runtime_arg[] = "runtime";
+  constexpr const char opt_level_arg[] = "opt-level";
+  constexpr const char parallel_arg[] = "parallel";
+  constexpr const char parallel_cutoff_arg[] = "parallel-cutoff";
+  constexpr const char verify_arg[] = "verify";
+  constexpr const char debug_info_arg[] = "debug-info";
+  constexpr const char remarks_arg[] = "remarks";
+  constexpr const char remarks_filter_arg[] = "remarks-filter";
+  constexpr const char remarks_format_arg[] = "remarks-format";
+  constexpr const char emit_arg[] = "emit";
+  constexpr const char jobs_arg[] = "jobs";
+  constexpr const char serve_arg[] = "serve";
+  constexpr const char connect_arg[] = "connect";
+  constexpr const char watch_arg[] = "watch";
+  constexpr const char pipelined_lexer_arg[] = "pipelined-lexer";
   
   cxxopts::Options options_parser(
       "vladpiler",
@@ -53,8 +85,40 @@ void parse_args(int argc, char* argv[], args_t& args) {
       "your sole discretion and risk."
     );
   options_parser.add_options()
-  (prog_arg, "Main program to be run", cxxopts::value<std::string>()->default_value(comp_str))
+  (prog_arg, "Main program to be run: lexer, parser or compiler", cxxopts::value<std::string>()->default_value(comp_str))
   (src_arg, "Source file to read from", cxxopts::value<std::string>()->default_value(""))
+  (stats_arg, "Report per-phase timings and counters to stderr. Format: json", cxxopts::value<std::string>()->default_value(""))
+  (instrument_arg, "Count calls and cycles spent in each closure specialization. "
+    "The compiled program writes a report at exit to $RINHA_PROFILE_OUT (default: stderr)")
+  (inline_threshold_arg, "Inline non-recursive functions whose body has at most this many AST nodes. 0 disables inlining",
+    cxxopts::value<uint32_t>()->default_value(std::to_string(Compiler::CompileOptions().inline_threshold)))
+  (no_cse_arg, "Don't share repeated pure terms")
+  (no_accumulate_arg, "Don't turn functions that combine their own result with +, *, && or || into tail-recursive ones")
+  (specialization_budget_arg, "Specializations of a function before calls to it share generic ones "
+    "(captured numbers and booleans passed as values). Compiling fails if it needs as many generic ones again. "
+    "0 means no limit",
+    cxxopts::value<uint32_t>()->default_value(std::to_string(Compiler::CompileOptions().specialization_budget)))
+  (runtime_arg, "Runtime to use. libc: link the embedded runtime into the output. "
+    "minimal: same, but without libc (link with -static -nostdlib). "
+    "external: leave it out (link build/rinha_extern.o yourself)", cxxopts::value<std::string>()->default_value("libc"))
+  (opt_level_arg, "LLVM optimization level, from 0 to 3", cxxopts::value<uint32_t>()->default_value(std::to_string(Compiler::CompileOptions().opt_level)))
+  (parallel_arg, "Evaluate independent operands without prints on a work-stealing thread pool. "
+    "Link the output with -pthread; $RINHA_THREADS sets the number of threads")
+  (parallel_cutoff_arg, "Smallest estimated cost (AST nodes, a call counts as 32) of operands evaluated in parallel",
+    cxxopts::value<uint32_t>()->default_value(std::to_string(Compiler::CompileOptions().parallel_cutoff)))
+  (verify_arg, "Check the generated IR before and after optimizing it")
+  (std::string("g,") + debug_info_arg, "Emit DWARF line info, so debuggers and profilers (e.g. perf) can map the program back to Rinha source lines")
+  (remarks_arg, "Write LLVM optimization remarks to this file", cxxopts::value<std::string>()->default_value(""))
+  (remarks_filter_arg, "Only write remarks of passes matching this regex (e.g. inline|loop-vectorize)",
+    cxxopts::value<std::string>()->default_value(""))
+  (remarks_format_arg, "Format of the remarks file. yaml or bitstream", cxxopts::value<std::string>()->default_value(Compiler::CompileOptions().remarks_format))
+  (emit_arg, "Output to write to the llvm directory. ll: LLVM IR. obj: native object file", cxxopts::value<std::string>()->default_value("ll"))
+  (jobs_arg, "Threads used to generate object code (--emit=obj). 0 uses one per CPU. The output doesn't depend on it",
+    cxxopts::value<uint32_t>()->default_value(std::to_string(Compiler::CompileOptions().jobs)))
+  (serve_arg, "Run a compile server listening on this Unix domain socket, for --connect", cxxopts::value<std::string>()->default_value(""))
+  (connect_arg, "Have the compile server listening on this socket do the rest of the command line", cxxopts::value<std::string>()->default_value(""))
+  (watch_arg, "Compile again every time the source file is saved, skipping edits that don't change the program")
+  (pipelined_lexer_arg, "Scan the source on a thread of its own while it's parsed")
   (help_arg, "Print this help message.");
   options_parser.parse_positional({src_arg});
   auto options = options_parser.parse(argc, argv);
@@ -66,23 +130,151 @@ void parse_args(int argc, char* argv[], args_t& args) {
 
   args.main = program_map.left.at(options[prog_arg].as<std::string>());
   args.filename= std::move(options[src_arg].as<std::string>());
+  args.stats = options[stats_arg].as<std::string>();
+  args.serve = options[serve_arg].as<std::string>();
+  args.connect = options[connect_arg].as<std::string>();
+  args.watch = options.count(watch_arg);
+  args.compile_options.instrument = options.count(instrument_arg);
+  args.compile_options.inline_threshold = options[inline_threshold_arg].as<uint32_t>();
+  args.compile_options.cse = !options.count(no_cse_arg);
+  args.compile_options.accumulate = !options.count(no_accumulate_arg);
+  args.compile_options.specialization_budget = options[specialization_budget_arg].as<uint32_t>();
+  args.compile_options.opt_level = options[opt_level_arg].as<uint32_t>();
+  args.compile_options.parallel = options.count(parallel_arg);
+  args.compile_options.parallel_cutoff = options[parallel_cutoff_arg].as<uint32_t>();
+  args.compile_options.jobs = options[jobs_arg].as<uint32_t>();
+  args.compile_options.verify = options.count(verify_arg);
+  args.compile_options.debug_info = options.count(debug_info_arg);
+  args.compile_options.remarks_file = options[remarks_arg].as<std::string>();
+  args.compile_options.remarks_filter = options[remarks_filter_arg].as<std::string>();
+  args.compile_options.remarks_format = options[remarks_format_arg].as<std::string>();
+  args.compile_options.pipelined_lexer = options.count(pipelined_lexer_arg);
+  std::string runtime = options[runtime_arg].as<std::string>();
+  std::string emit = options[emit_arg].as<std::string>();
+
+  if (!args.stats.empty() && args.stats != "json") {
+    std::cerr << "Unknown stats format " << args.stats << ". Supported: json" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (runtime == "libc") args.compile_options.runtime = Compiler::RuntimeKind::LIBC;
+  else if (runtime == "minimal") args.compile_options.runtime = Compiler::RuntimeKind::MINIMAL;
+  else if (runtime == "external") args.compile_options.runtime = Compiler::RuntimeKind::EXTERNAL;
+  else {
+    std::cerr << "Unknown runtime " << runtime << ". Supported: libc, minimal, external" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (emit == "ll") args.compile_options.emit = Compiler::EmitKind::LL;
+  else if (emit == "obj") args.compile_options.emit = Compiler::EmitKind::OBJ;
+  else {
+    std::cerr << "Unknown output " << emit << ". Supported: ll, obj" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  const std::string& remarks_format = args.compile_options.remarks_format;
+  if (remarks_format != "yaml" && remarks_format != "bitstream") {
+    std::cerr << "Unknown remarks format " << remarks_format << ". Supported: yaml, bitstream" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (!args.compile_options.remarks_file.empty() && !args.compile_options.opt_level) {
+    std::cerr << "--remarks needs an optimization level above 0" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (args.compile_options.instrument && args.compile_options.runtime == Compiler::RuntimeKind::MINIMAL) {
+    std::cerr << "--instrument needs the libc runtime" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (args.compile_options.parallel && args.compile_options.runtime == Compiler::RuntimeKind::MINIMAL) {
+    std::cerr << "--parallel needs the libc runtime" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  // Profiling counters are per process, not per thread
+  if (args.compile_options.parallel && args.compile_options.instrument) {
+    std::cerr << "--parallel can't be combined with --instrument" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (args.watch && (args.main != program_t::COMPILER || !args.serve.empty() || !args.connect.empty())) {
+    std::cerr << "--watch can only be used to compile, without --serve or --connect" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (args.watch && args.filename.empty()) {
+    std::cerr << "--watch needs a source file" << std::endl;
+    exit(EX_USAGE);
+  }
+
+  if (args.compile_options.opt_level > 3) {
+    std::cerr << "Optimization level must be between 0 and 3" << std::endl;
+    exit(EX_USAGE);
+  }
 }
 
-int main(int argc, char* argv[]) {
-  args_t args;
-  init_global();
-  parse_args(argc, argv, args);
+int run(const args_t& args) {
+  if (!args.stats.empty()) Stats::enable();
 
   switch (args.main) {
     case program_t::LEXER:
       Lexer::tokens_scanner(args.filename);
       break;
-    case program_t::COMPILER:
-      Compiler::compile(args.filename, changeExtToLL(args.filename, "llvm"));
+    case program_t::PARSER: {
+      // Stops once the program is parsed
+      Compiler::CompileOptions options = args.compile_options;
+      options.after_parse = [](AST::Term*) { return false; };
+      Compiler::compile(args.filename, "", options);
       break;
+    }
+    case program_t::COMPILER: {
+      const char* ext = args.compile_options.emit == Compiler::EmitKind::OBJ ? ".o" : ".ll";
+      Compiler::compile(args.filename, changeExt(args.filename, "llvm", ext), args.compile_options);
+      break;
+    }
     default:
       break;
   }
 
+  if (Stats::is_enabled()) Stats::report_json(std::cerr, args.filename);
+
   return 0;
+}
+
+// What the compile server's workers run for each request
+int run_request(int argc, char* argv[]) {
+  args_t args;
+  parse_args(argc, argv, args);
+  if (!args.serve.empty() || !args.connect.empty() || args.watch) {
+    std::cerr << "--serve, --connect and --watch can't be sent to a compile server" << std::endl;
+    return EX_USAGE;
+  }
+  return run(args);
+}
+
+int main(int argc, char* argv[]) {
+  args_t args;
+  init_global();
+  parse_args(argc, argv, args);
+
+  if (!args.serve.empty()) Server::serve(args.serve, run_request);
+
+  if (args.watch) {
+    args.compile_options.after_parse = Watch::changed;
+    Watch::watch(args.filename, [&args]() { return run(args); });
+  }
+
+  if (!args.connect.empty()) {
+    std::vector<char*> forwarded;
+    for (int i = 1; i < argc; i++) {
+      std::string_view arg = argv[i];
+      if (arg == "--connect") i++;
+      else if (arg.rfind("--connect=", 0) != 0) forwarded.push_back(argv[i]);
+    }
+    return client_compile(args.connect.c_str(), forwarded.size(), forwarded.data());
+  }
+
+  return run(args);
 }
\ No newline at end of file
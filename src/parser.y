@@ -3,6 +3,15 @@
 #include "lexer.h"
 #include "parser.h"
 #include "compiler.h"
+#include "stats.h"
+
+/*  The let rule is right recursive (a left recursive one makes the grammar
+    ambiguous: a let in the body of another is the same as continuing the
+    sequence), so a sequence of n lets takes n entries on the parser's stack.
+    That stack is on the heap and grows as needed, so it only has to be
+    allowed to grow past bison's default limit of 10000.
+*/
+#define YYMAXDEPTH 100000000
 %}
 
 %union {
@@ -29,6 +38,39 @@
 	AST::Var*  			ast_var;
 }
 
+%locations
+
+%code {
+/*  Hands the parser the scanner's next token (see Lexer::next_token).
+    Lets --stats attribute time spent in the scanner to the lex phase: with
+    --pipelined-lexer, that's the time the parser waited for it.
+*/
+static int next_token() {
+	Lexer::Token token;
+	if (!Stats::is_enabled()) Lexer::next_token(token);
+	else {
+		Stats::PhaseTimer timer(Stats::Phase::LEX, false);
+		Stats::increment(Stats::Counter::TOKENS);
+		Lexer::next_token(token);
+	}
+
+	if (token.kind == T_IDENTIFIER || token.kind == T_STRING) yylval.str_ptr = token.value.str_ptr;
+	else yylval.int64_val = token.value.int64_val;
+	yylloc.first_line = token.loc.first_line;
+	yylloc.first_column = token.loc.first_column;
+	yylloc.last_line = token.loc.last_line;
+	yylloc.last_column = token.loc.last_column;
+	return token.kind;
+}
+#define yylex next_token
+
+// Where a term starts in the source, for debug info (see --debug-info)
+static AST::Term* located(AST::Term* term, const YYLTYPE& loc) {
+	term->loc = {static_cast<uint64_t>(loc.first_line), static_cast<uint64_t>(loc.first_column)};
+	return term;
+}
+}
+
 
 // Assignment
 %token T_LET
@@ -175,19 +217,19 @@ second: T_SECOND term 				{ $$ = new AST::Second($2); 	}
 
 print: T_PRINT T_LP term T_RP		{ $$ = new AST::Print($3); 		}
 
-term: int			{ $$ = $1; }
-	| str			{ $$ = $1; }
-	| call			{ $$ = $1; }
-	| binary		{ $$ = $1; }
-	| function		{ $$ = $1; }
-	| let			{ $$ = $1; }
-	| if			{ $$ = $1; }
-	| print			{ $$ = $1; }
-	| first			{ $$ = $1; }
-	| second		{ $$ = $1; }
-	| bool			{ $$ = $1; }
-	| tuple			{ $$ = $1; }
-	| var			{ $$ = $1; }
+term: int			{ $$ = located($1, @1); }
+	| str			{ $$ = located($1, @1); }
+	| call			{ $$ = located($1, @1); }
+	| binary		{ $$ = located($1, @1); }
+	| function		{ $$ = located($1, @1); }
+	| let			{ $$ = located($1, @1); }
+	| if			{ $$ = located($1, @1); }
+	| print			{ $$ = located($1, @1); }
+	| first			{ $$ = located($1, @1); }
+	| second		{ $$ = located($1, @1); }
+	| bool			{ $$ = located($1, @1); }
+	| tuple			{ $$ = located($1, @1); }
+	| var			{ $$ = located($1, @1); }
 	
 %%
 
@@ -1,42 +1,726 @@
-#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#ifndef RINHA_MINIMAL
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+#include "rinha_extern.h"
+
+//==================================
+// Platform
+//==================================
+
+/*  Everything below this section only uses these primitives. The default
+    runtime implements them on top of libc. The minimal one (built with
+    -DRINHA_MINIMAL -ffreestanding, see --runtime=minimal) talks to the
+    kernel directly and has its own _start, so programs can be linked as
+    small static executables that skip the dynamic loader and stdio set up.
+    It buffers stdout itself and never gives memory back. Linux x86-64 only.
+*/
+#ifdef RINHA_MINIMAL
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "The minimal runtime only supports Linux on x86-64"
+#endif
+
+#define EXIT_FAILURE 1
+
+#define SYS_WRITE 1
+#define SYS_MMAP 9
+#define SYS_EXIT_GROUP 231
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+
+static long sys_call6(long n, long a, long b, long c, long d, long e, long f) {
+  register long r10 __asm__("r10") = d;
+  register long r8 __asm__("r8") = e;
+  register long r9 __asm__("r9") = f;
+  long ret;
+  __asm__ volatile ("syscall"
+    : "=a"(ret)
+    : "a"(n), "D"(a), "S"(b), "d"(c), "r"(r10), "r"(r8), "r"(r9)
+    : "rcx", "r11", "memory");
+  return ret;
+}
+
+static long sys_call3(long n, long a, long b, long c) {
+  return sys_call6(n, a, b, c, 0, 0, 0);
+}
+
+__attribute__((noreturn)) static void sys_exit(int status) {
+  for (;;) sys_call3(SYS_EXIT_GROUP, status, 0, 0);
+}
+
+// The backend may lower copies and initializations to calls to these, so
+// they must exist even though there is no libc
+void* memcpy(void* restrict dst, const void* restrict src, size_t len) {
+  char* d = dst;
+  const char* s = src;
+  while (len--) *d++ = *s++;
+  return dst;
+}
+
+void* memmove(void* dst, const void* src, size_t len) {
+  char* d = dst;
+  const char* s = src;
+  if (d < s) {
+    while (len--) *d++ = *s++;
+  } else {
+    while (len--) d[len] = s[len];
+  }
+  return dst;
+}
+
+void* memset(void* dst, int val, size_t len) {
+  unsigned char* d = dst;
+  while (len--) *d++ = (unsigned char)val;
+  return dst;
+}
+
+int memcmp(const void* lhs, const void* rhs, size_t len) {
+  const unsigned char* a = lhs;
+  const unsigned char* b = rhs;
+  for (; len; len--, a++, b++) {
+    if (*a != *b) return *a - *b;
+  }
+  return 0;
+}
+
+static size_t strlen(const char* str) {
+  size_t len = 0;
+  while (str[len]) len++;
+  return len;
+}
+
+static void fd_write(int fd, const char* buf, size_t len) {
+  while (len) {
+    long written = sys_call3(SYS_WRITE, fd, (long)buf, len);
+    if (written == -4) continue;  // EINTR
+    if (written < 0) sys_exit(EXIT_FAILURE);
+    buf += written;
+    len -= written;
+  }
+}
+
+static char out_buf[1 << 16];
+static size_t out_len;
+
+static void out_flush(void) {
+  fd_write(1, out_buf, out_len);
+  out_len = 0;
+}
+
+static void out_write(const char* buf, size_t len) {
+  if (len > sizeof(out_buf) - out_len) out_flush();
+  if (len >= sizeof(out_buf)) {
+    fd_write(1, buf, len);
+    return;
+  }
+  memcpy(out_buf + out_len, buf, len);
+  out_len += len;
+}
+
+__attribute__((noreturn)) static void die(const char* msg) {
+  out_flush();
+  fd_write(2, msg, strlen(msg));
+  sys_exit(EXIT_FAILURE);
+}
+
+// Bump allocator over anonymous mappings. Requests bigger than a chunk get
+// a mapping of their own.
+#define MEM_CHUNK (1 << 20)
+
+static char* mem_next;
+static char* mem_end;
+
+static void* mem_map(size_t size) {
+  long addr = sys_call6(SYS_MMAP, 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr < 0 && addr > -4096) return NULL;
+  return (void*)addr;
+}
+
+static void* mem_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (size > MEM_CHUNK / 4) return mem_map(size);
+  if (size > (size_t)(mem_end - mem_next)) {
+    mem_next = mem_map(MEM_CHUNK);
+    if (!mem_next) return NULL;
+    mem_end = mem_next + MEM_CHUNK;
+  }
+  void* ptr = mem_next;
+  mem_next += size;
+  return ptr;
+}
+
+static void* mem_grow(void* ptr, size_t old_size, size_t new_size) {
+  void* grown = mem_alloc(new_size);
+  if (grown) memcpy(grown, ptr, old_size);
+  return grown;
+}
+
+static void mem_free(void* ptr) {
+  (void)ptr;
+}
+
+int main(void);
+
+__attribute__((noreturn, force_align_arg_pointer, used)) void _start(void) {
+  int status = main();
+  out_flush();
+  sys_exit(status);
+}
+
+#else
+
+static void out_write(const char* buf, size_t len) {
+  fwrite(buf, 1, len, stdout);
+}
+
+__attribute__((noreturn)) static void die(const char* msg) {
+  fflush(stdout);
+  fputs(msg, stderr);
+  exit(EXIT_FAILURE);
+}
+
+static void* mem_alloc(size_t size) {
+  return malloc(size);
+}
+
+static void* mem_grow(void* ptr, size_t old_size, size_t new_size) {
+  (void)old_size;
+  return realloc(ptr, new_size);
+}
+
+static void mem_free(void* ptr) {
+  free(ptr);
+}
+
+#endif
+
+//==================================
+// Printing
+//==================================
+
+static void out_cstr(const char* str) {
+  out_write(str, strlen(str));
+}
+
+// Writes the decimal representation of val to out (at least 12 bytes) and
+// returns its length, without a terminator
+static uint32_t fmt_int(char* out, int32_t val) {
+  char digits[10];
+  uint32_t n_digits = 0, len = 0;
+  uint32_t abs_val = val < 0 ? 0u - (uint32_t)val : (uint32_t)val;
+  do {
+    digits[n_digits++] = '0' + abs_val % 10;
+    abs_val /= 10;
+  } while (abs_val);
+
+  if (val < 0) out[len++] = '-';
+  while (n_digits) out[len++] = digits[--n_digits];
+  return len;
+}
 
 void print_undefined() {
-  printf("undefined");
+  out_cstr("undefined");
 }
 
 void print_bool(uint8_t val) {
-  if (val) printf("true");
-  else printf("false");
+  if (val) out_cstr("true");
+  else out_cstr("false");
 }
 
 void print_num(int32_t val) {
-  printf("%d", val);
+  char buf[12];
+  out_write(buf, fmt_int(buf, val));
 }
 
 
 void print_str(char* str) {
   if (!str) print_undefined();
-  else printf("%s", str);
+  else out_cstr(str);
 }
 
 
 void print_closure(void) {
-  printf("<#closure>");
+  out_cstr("<#closure>");
 }
 
 void print_lp(void) {
-  printf("(");
+  out_cstr("(");
 }
 
 void print_delim(void) {
-  printf(", ");
+  out_cstr(", ");
 }
 
 void print_rp(void) {
-  printf(")");
+  out_cstr(")");
 }
 
 void print_nl(void) {
-  printf("\n");
-}
\ No newline at end of file
+  out_cstr("\n");
+}
+
+//==================================
+// Memory
+//==================================
+
+void* rinha_alloc(uint64_t size) {
+  void* ptr = mem_alloc(size);
+  if (!ptr) die("Out of memory\n");
+  return ptr;
+}
+
+//==================================
+// Strings
+//==================================
+
+static rinha_str* str_alloc(uint32_t kind, uint32_t len) {
+  rinha_str* str = rinha_alloc(sizeof(rinha_str));
+  str->kind = kind;
+  str->len = len;
+  return str;
+}
+
+static const char* str_chars(const rinha_str* str) {
+  return str->kind == RINHA_STR_SSO ? str->sso : str->flat.chars;
+}
+
+// Copies the characters of str into out (which must hold str->len bytes).
+// Ropes may be arbitrarily deep, so walk them with an explicit stack instead
+// of recursing. It lives on the C stack until a rope is too deep for it, as
+// the minimal runtime never gets memory back.
+static void str_copy(rinha_str* str, char* out) {
+  rinha_str* local[64];
+  size_t cap = 64, top = 0;
+  rinha_str** stack = local;
+  stack[top++] = str;
+
+  while (top) {
+    rinha_str* node = stack[--top];
+    if (node->kind != RINHA_STR_ROPE) {
+      memcpy(out, str_chars(node), node->len);
+      out += node->len;
+      continue;
+    }
+    if (top + 2 > cap) {
+      if (stack == local) {
+        stack = rinha_alloc(2 * cap * sizeof(rinha_str*));
+        memcpy(stack, local, cap * sizeof(rinha_str*));
+      } else {
+        stack = mem_grow(stack, cap * sizeof(rinha_str*), 2 * cap * sizeof(rinha_str*));
+        if (!stack) die("Out of memory\n");
+      }
+      cap *= 2;
+    }
+    stack[top++] = node->rope.right;
+    stack[top++] = node->rope.left;
+  }
+  if (stack != local) mem_free(stack);
+}
+
+// Set for good once a --parallel program starts its worker threads
+static int par_started;
+
+// Collapses a rope into a FLAT node in place, so later reads are O(1). Once
+// other threads may be reading the same nodes, the rope is left alone and
+// *owned is set to a copy the caller must free.
+static const char* str_flatten(rinha_str* str, char** owned) {
+  *owned = NULL;
+  if (str->kind != RINHA_STR_ROPE) return str_chars(str);
+
+  char* chars = rinha_alloc(str->len + 1);
+  str_copy(str, chars);
+  chars[str->len] = '\0';
+  if (__atomic_load_n(&par_started, __ATOMIC_RELAXED)) {
+    *owned = chars;
+    return chars;
+  }
+  str->kind = RINHA_STR_FLAT;
+  str->flat.chars = chars;
+  return chars;
+}
+
+void print_rstr(rinha_str* str) {
+  if (!str) {
+    print_undefined();
+    return;
+  }
+  char* owned;
+  out_write(str_flatten(str, &owned), str->len);
+  mem_free(owned);
+}
+
+rinha_str* rinha_str_from_int(int32_t val) {
+  rinha_str* str = str_alloc(RINHA_STR_SSO, 0);
+  str->len = fmt_int(str->sso, val);
+  str->sso[str->len] = '\0';
+  return str;
+}
+
+rinha_str* rinha_str_from_bool(uint8_t val) {
+  rinha_str* str = str_alloc(RINHA_STR_FLAT, val ? 4 : 5);
+  str->flat.chars = val ? "true" : "false";
+  return str;
+}
+
+rinha_str* rinha_str_concat(rinha_str* lhs, rinha_str* rhs) {
+  if (!lhs->len) return rhs;
+  if (!rhs->len) return lhs;
+
+  uint32_t len = lhs->len + rhs->len;
+  if (len <= RINHA_STR_SSO_CAP) {
+    rinha_str* str = str_alloc(RINHA_STR_SSO, len);
+    str_copy(lhs, str->sso);
+    str_copy(rhs, str->sso + lhs->len);
+    str->sso[len] = '\0';
+    return str;
+  }
+
+  rinha_str* str = str_alloc(RINHA_STR_ROPE, len);
+  str->rope.left = lhs;
+  str->rope.right = rhs;
+  return str;
+}
+
+uint8_t rinha_str_eq(rinha_str* lhs, rinha_str* rhs) {
+  if (lhs == rhs) return 1;
+  if (lhs->len != rhs->len) return 0;
+  char *lhs_owned, *rhs_owned;
+  uint8_t eq = memcmp(str_flatten(lhs, &lhs_owned), str_flatten(rhs, &rhs_owned), lhs->len) == 0;
+  mem_free(lhs_owned);
+  mem_free(rhs_owned);
+  return eq;
+}
+
+//==================================
+// Tuples
+//==================================
+
+// The reference count lives in the word before the tuple
+static uint64_t* tuple_refs(void* tuple) {
+  return (uint64_t*)tuple - 1;
+}
+
+#ifdef RINHA_MINIMAL
+// mem_free can't give memory back, so freed tuples are kept for the next
+// ones that round up to the same size. The list is threaded through them.
+#define TUPLE_FREE_CLASSES 8
+static void* tuple_free_lists[TUPLE_FREE_CLASSES];
+
+static uint64_t tuple_class(uint64_t size) {
+  return (sizeof(uint64_t) + size + 15) / 16 - 1;
+}
+#endif
+
+void* rinha_tuple_alloc(uint64_t size) {
+  uint64_t* block = NULL;
+#ifdef RINHA_MINIMAL
+  uint64_t class = tuple_class(size);
+  if (class < TUPLE_FREE_CLASSES && tuple_free_lists[class]) {
+    block = tuple_free_lists[class];
+    tuple_free_lists[class] = *(void**)(block + 1);
+  }
+#endif
+  if (!block) block = rinha_alloc(sizeof(uint64_t) + size);
+  *block = 1;
+  return block + 1;
+}
+
+void* rinha_tuple_reuse(void* token, uint64_t size) {
+  if (!token) return rinha_tuple_alloc(size);
+  *tuple_refs(token) = 1;
+  return token;
+}
+
+void rinha_tuple_dup(void* tuple) {
+  if (__atomic_load_n(&par_started, __ATOMIC_RELAXED)) __atomic_add_fetch(tuple_refs(tuple), 1, __ATOMIC_RELAXED);
+  else ++*tuple_refs(tuple);
+}
+
+void* rinha_tuple_release(void* tuple) {
+  uint64_t left;
+  if (__atomic_load_n(&par_started, __ATOMIC_RELAXED)) left = __atomic_sub_fetch(tuple_refs(tuple), 1, __ATOMIC_ACQ_REL);
+  else left = --*tuple_refs(tuple);
+  return left ? NULL : tuple;
+}
+
+void rinha_tuple_free(void* tuple, uint64_t size) {
+#ifdef RINHA_MINIMAL
+  uint64_t class = tuple_class(size);
+  if (class < TUPLE_FREE_CLASSES) {
+    *(void**)tuple = tuple_free_lists[class];
+    tuple_free_lists[class] = tuple_refs(tuple);
+  }
+#else
+  (void)size;
+  mem_free(tuple_refs(tuple));
+#endif
+}
+
+//==================================
+// Profiling (--instrument)
+//==================================
+
+// Needs stdio for the report, so it's only in the libc runtime
+#ifndef RINHA_MINIMAL
+
+// Must tick like llvm.readcyclecounter, which is what instrumented code uses
+static uint64_t prof_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static rinha_prof_entry** prof_table;
+static uint32_t prof_n_entries;
+static uint64_t prof_start_tsc;
+
+static int prof_cmp(const void* lhs, const void* rhs) {
+  const rinha_prof_entry* a = *(rinha_prof_entry* const*)lhs;
+  const rinha_prof_entry* b = *(rinha_prof_entry* const*)rhs;
+  if (a->cycles != b->cycles) return a->cycles < b->cycles ? 1 : -1;
+  if (a->calls != b->calls) return a->calls < b->calls ? 1 : -1;
+  return strcmp(a->name, b->name);
+}
+
+static void prof_dump(void) {
+  uint64_t total = prof_tsc() - prof_start_tsc;
+  fflush(stdout);
+
+  FILE* out = stderr;
+  const char* path = getenv("RINHA_PROFILE_OUT");
+  if (path && *path && !(out = fopen(path, "w"))) {
+    perror(path);
+    out = stderr;
+  }
+
+  rinha_prof_entry** sorted = malloc(prof_n_entries * sizeof(rinha_prof_entry*));
+  memcpy(sorted, prof_table, prof_n_entries * sizeof(rinha_prof_entry*));
+  qsort(sorted, prof_n_entries, sizeof(rinha_prof_entry*), prof_cmp);
+
+  fprintf(out, "%-32s %14s %18s %8s %14s\n", "function", "calls", "incl. cycles", "%", "cycles/call");
+  for (uint32_t i = 0; i < prof_n_entries; i++) {
+    rinha_prof_entry* entry = sorted[i];
+    if (!entry->calls) continue;
+    fprintf(out, "%-32s %14lu %18lu %7.2f%% %14.1f\n",
+      entry->name,
+      (unsigned long)entry->calls,
+      (unsigned long)entry->cycles,
+      total ? 100.0 * entry->cycles / total : 0.0,
+      (double)entry->cycles / entry->calls);
+  }
+  fprintf(out, "%-32s %14s %18lu\n", "total", "", (unsigned long)total);
+
+  free(sorted);
+  if (out != stderr) fclose(out);
+}
+
+void rinha_prof_init(rinha_prof_entry** table, uint32_t n_entries) {
+  prof_table = table;
+  prof_n_entries = n_entries;
+  prof_start_tsc = prof_tsc();
+  atexit(prof_dump);
+}
+
+#endif
+
+//==================================
+// Fork-join parallelism (--parallel)
+//==================================
+
+// Needs threads, so it's only in the libc runtime
+#ifndef RINHA_MINIMAL
+
+enum par_task_state {
+  PAR_TASK_INLINE = 0,  // Not queued, the forking thread runs it at join
+  PAR_TASK_QUEUED,
+  PAR_TASK_DONE
+};
+
+// Forking more than this many tasks ahead of the thieves is only overhead,
+// so past it tasks are run inline. A full deque does the same.
+#define PAR_MAX_QUEUED 4
+#define PAR_DEQUE_CAP 1024
+
+/*  Chase-Lev work-stealing deque (with the C11 orderings from Le et al.,
+    "Correct and Efficient Work-Stealing for Weak Memory Models"). The owner
+    pushes and pops at the bottom; thieves steal the oldest, and so
+    usually biggest, task from the top. The buffer doesn't grow.
+*/
+typedef struct par_deque {
+  int64_t top;
+  char pad[56];   // Keep thieves and the owner off each other's cache line
+  int64_t bottom;
+  rinha_task* tasks[PAR_DEQUE_CAP];
+} par_deque;
+
+static int par_push(par_deque* deque, rinha_task* task) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (bottom - top >= PAR_MAX_QUEUED) return 0;
+  __atomic_store_n(&deque->tasks[bottom % PAR_DEQUE_CAP], task, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static rinha_task* par_pop(par_deque* deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  rinha_task* task = __atomic_load_n(&deque->tasks[bottom % PAR_DEQUE_CAP], __ATOMIC_RELAXED);
+  if (top == bottom) {
+    // Last task: race the thieves for it
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) task = NULL;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return task;
+}
+
+static rinha_task* par_steal(par_deque* deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+
+  rinha_task* task = __atomic_load_n(&deque->tasks[top % PAR_DEQUE_CAP], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return NULL;
+  return task;
+}
+
+typedef struct par_worker {
+  par_deque deque;
+  uint32_t rng;
+} par_worker;
+
+static par_worker* par_workers;
+static uint32_t par_n_workers;
+static __thread par_worker* par_self;
+
+// Starts at 1, so the first fork starts the pool
+uint32_t rinha_par_hungry = 1;
+
+static void par_run(rinha_task* task) {
+  task->run(task);
+  __atomic_store_n(&task->state, PAR_TASK_DONE, __ATOMIC_RELEASE);
+}
+
+static rinha_task* par_steal_any(par_worker* self) {
+  self->rng ^= self->rng << 13;
+  self->rng ^= self->rng >> 17;
+  self->rng ^= self->rng << 5;
+  par_worker* victim = &par_workers[self->rng % par_n_workers];
+  if (victim == self) return NULL;
+  return par_steal(&victim->deque);
+}
+
+// Spins for a while, then yields, then sleeps, so idle workers don't keep
+// cores busy after the parallel part of a program is over
+static void par_backoff(uint32_t n_failed) {
+  if (n_failed < 64) return;
+  if (n_failed < 1024) {
+    sched_yield();
+    return;
+  }
+  struct timespec nap = {0, 50000};
+  nanosleep(&nap, NULL);
+}
+
+// Runs stolen tasks until until is done (forever if NULL). The worker counts
+// as hungry whenever it isn't running one.
+static void par_work(rinha_task* until) {
+  uint32_t n_failed = 0;
+  __atomic_add_fetch(&rinha_par_hungry, 1, __ATOMIC_RELAXED);
+  while (!until || __atomic_load_n(&until->state, __ATOMIC_ACQUIRE) != PAR_TASK_DONE) {
+    rinha_task* task = par_steal_any(par_self);
+    if (!task) {
+      par_backoff(++n_failed);
+      continue;
+    }
+    __atomic_sub_fetch(&rinha_par_hungry, 1, __ATOMIC_RELAXED);
+    par_run(task);
+    __atomic_add_fetch(&rinha_par_hungry, 1, __ATOMIC_RELAXED);
+    n_failed = 0;
+  }
+  __atomic_sub_fetch(&rinha_par_hungry, 1, __ATOMIC_RELAXED);
+}
+
+static void* par_worker_main(void* arg) {
+  par_self = arg;
+  par_work(NULL);
+  return NULL;
+}
+
+static void par_start(void) {
+  const char* threads = getenv("RINHA_THREADS");
+  long n_workers = threads && *threads ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  par_n_workers = n_workers > 0 ? n_workers : 1;
+  par_workers = rinha_alloc(par_n_workers * sizeof(par_worker));
+  memset(par_workers, 0, par_n_workers * sizeof(par_worker));
+
+  // The thread that forked first is worker 0
+  par_self = &par_workers[0];
+  for (uint32_t i = 0; i < par_n_workers; i++) par_workers[i].rng = 2654435761u * (i + 1);
+  __atomic_store_n(&rinha_par_hungry, 0, __ATOMIC_RELAXED);
+  if (par_n_workers == 1) return;
+
+  __atomic_store_n(&par_started, 1, __ATOMIC_RELAXED);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (uint32_t i = 1; i < par_n_workers; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, par_worker_main, &par_workers[i])) die("Could not start worker threads\n");
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void rinha_par_fork(rinha_task* task) {
+  // Only the main thread forks before the pool exists
+  if (!par_workers) par_start();
+
+  task->state = PAR_TASK_INLINE;
+  if (par_n_workers == 1) return;
+  task->state = PAR_TASK_QUEUED;
+  if (!par_push(&par_self->deque, task)) task->state = PAR_TASK_INLINE;
+}
+
+void rinha_par_join(rinha_task* task) {
+  if (task->state == PAR_TASK_INLINE) {
+    task->run(task);
+    return;
+  }
+
+  // Joins are nested in forks, so the task is at the bottom unless stolen
+  if (par_pop(&par_self->deque) == task) {
+    task->run(task);
+    return;
+  }
+
+  par_work(task);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#include "runtime.h"
+
+// Paths of the bitcode, relative to where vladpiler is built (see Makefile)
+#ifndef RINHA_RUNTIME_BC
+#define RINHA_RUNTIME_BC "build/rinha_extern.bc"
+#endif
+#ifndef RINHA_MINIMAL_BC
+#define RINHA_MINIMAL_BC "build/rinha_minimal.bc"
+#endif
+
+#define EMBED(name, path) \
+  "  .global " name "_begin\n" \
+  "  .hidden " name "_begin\n" \
+  name "_begin:\n" \
+  "  .incbin \"" path "\"\n" \
+  "  .global " name "_end\n" \
+  "  .hidden " name "_end\n" \
+  name "_end:\n"
+
+asm(
+  "  .section .rodata\n"
+  "  .p2align 3\n"
+  EMBED("rinha_libc_bc", RINHA_RUNTIME_BC)
+  "  .p2align 3\n"
+  EMBED("rinha_minimal_bc", RINHA_MINIMAL_BC)
+  "  .previous\n"
+);
+
+extern "C" const char rinha_libc_bc_begin[];
+extern "C" const char rinha_libc_bc_end[];
+extern "C" const char rinha_minimal_bc_begin[];
+extern "C" const char rinha_minimal_bc_end[];
+
+namespace Runtime {
+  llvm::StringRef libc_bitcode() {
+    return llvm::StringRef(rinha_libc_bc_begin, rinha_libc_bc_end - rinha_libc_bc_begin);
+  }
+
+  llvm::StringRef minimal_bitcode() {
+    return llvm::StringRef(rinha_minimal_bc_begin, rinha_minimal_bc_end - rinha_minimal_bc_begin);
+  }
+}
@@ -0,0 +1,151 @@
+#include "server.h"
+#include "backend.h"
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Server {
+
+  // Written to when a worker exits, so the loop below wakes up to answer
+  // its client
+  static int exit_pipe[2];
+
+  [[noreturn]] static void fail(const std::string& msg) {
+    std::cerr << "Error: " << msg << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static void on_child_exit(int) {
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(exit_pipe[1], &byte, 1) < 0) {}
+    errno = saved_errno;
+  }
+
+  // False if the client hung up or didn't send a request
+  static bool read_request(int conn, int fds[3], std::vector<std::string>& args) {
+    char buf[4096];
+    iovec iov = {buf, sizeof(buf)};
+    alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return false;
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return false;
+    if (cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) return false;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    // The number of arguments, then the arguments
+    std::string data(buf, n);
+    std::vector<std::string> fields;
+    size_t start = 0;
+    for (;;) {
+      for (size_t end; (end = data.find('\0', start)) != std::string::npos; start = end + 1) {
+        fields.push_back(data.substr(start, end - start));
+      }
+      if (!fields.empty() && fields.size() > strtoul(fields[0].c_str(), nullptr, 10)) break;
+      n = read(conn, buf, sizeof(buf));
+      if (n <= 0) return false;
+      data.append(buf, n);
+    }
+    args.assign(fields.begin() + 1, fields.end());
+    return true;
+  }
+
+  // Runs in the forked worker
+  [[noreturn]] static void handle(int conn, int listener, Handler handler) {
+    signal(SIGCHLD, SIG_DFL);
+    close(listener);
+    close(exit_pipe[0]);
+    close(exit_pipe[1]);
+
+    int fds[3];
+    std::vector<std::string> args;
+    if (!read_request(conn, fds, args)) _exit(EX_PROTOCOL);
+    close(conn);
+    if (fchdir(fds[0]) != 0 || dup2(fds[1], STDOUT_FILENO) < 0 || dup2(fds[2], STDERR_FILENO) < 0) _exit(EX_OSERR);
+    for (int fd : fds) close(fd);
+
+    std::vector<char*> argv = {const_cast<char*>("vladpiler")};
+    for (std::string& arg : args) argv.push_back(arg.data());
+    argv.push_back(nullptr);
+    int status = handler(argv.size() - 1, argv.data());
+    // Tearing down the copy of the server's state (LLVM's globals included)
+    // is of no use to anyone
+    std::cout.flush();
+    fflush(nullptr);
+    _exit(status);
+  }
+
+  void serve(const std::string& socket_path, Handler handler) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+      std::cerr << "Socket path is too long: " << socket_path << std::endl;
+      exit(EX_USAGE);
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) fail("could not create a socket");
+    unlink(socket_path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) fail("could not bind to " + socket_path);
+    if (listen(listener, SOMAXCONN) != 0) fail("could not listen on " + socket_path);
+
+    if (pipe2(exit_pipe, O_CLOEXEC | O_NONBLOCK) != 0) fail("could not create a pipe");
+    struct sigaction action = {};
+    action.sa_handler = on_child_exit;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, nullptr);
+    // A client may hang up before getting its reply
+    signal(SIGPIPE, SIG_IGN);
+
+    // Whatever every request would otherwise set up again
+    Backend::initialize();
+
+    std::map<pid_t, int> workers;   // And the connection each one answers
+    pollfd polled[2] = {{listener, POLLIN, 0}, {exit_pipe[0], POLLIN, 0}};
+    for (;;) {
+      if (poll(polled, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        fail("poll failed");
+      }
+
+      if (polled[1].revents) {
+        char bytes[64];
+        while (read(exit_pipe[0], bytes, sizeof(bytes)) > 0) {}
+        int status;
+        for (pid_t pid; (pid = waitpid(-1, &status, WNOHANG)) > 0;) {
+          auto worker = workers.find(pid);
+          if (worker == workers.end()) continue;
+          unsigned char reply = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+          if (write(worker->second, &reply, 1) < 0) {}
+          close(worker->second);
+          workers.erase(worker);
+        }
+      }
+
+      if (polled[0].revents) {
+        int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) continue;
+        pid_t pid = fork();
+        if (pid == 0) handle(conn, listener, handler);
+        if (pid < 0) {
+          std::cerr << "Could not fork a worker: " << strerror(errno) << std::endl;
+          close(conn);
+          continue;
+        }
+        workers[pid] = conn;
+      }
+    }
+  }
+}
@@ -0,0 +1,168 @@
+#include "stats.h"
+#include <time.h>
+#include <sys/resource.h>
+
+namespace Stats {
+
+  bool enabled = false;
+  uint64_t counters[static_cast<uint32_t>(Counter::N_COUNTERS)] = {};
+
+  struct PhaseData {
+    uint64_t runs = 0;
+    uint64_t wall_ns = 0;
+    uint64_t cpu_ns = 0;
+    bool has_cpu = false;
+    long peak_rss_kb = 0;
+  };
+
+  static PhaseData phases[static_cast<uint32_t>(Phase::N_PHASES)];
+  static std::map<std::string, uint64_t> node_counts;
+  static bool counting_nodes = true;
+  static PhaseTimer* current_timer = nullptr;
+  static std::chrono::steady_clock::time_point start_time;
+
+  static const char* phase_names[] = {
+    "lex", "parse", "codegen", "verify", "optimize", "emit"
+  };
+
+  static const char* counter_names[] = {
+    "tokens",
+    "ast_nodes",
+    "closure_specializations",
+    "specialization_cache_hits",
+    "specialization_cache_misses",
+    "over_budget_closures",
+    "symbol_lookups",
+    "ir_instructions",
+    "inlined_calls",
+    "cse_bindings",
+    "dead_bindings",
+    "accumulated_functions",
+    "parallel_forks"
+  };
+
+  static_assert(sizeof(phase_names) / sizeof(*phase_names) == static_cast<uint32_t>(Phase::N_PHASES));
+  static_assert(sizeof(counter_names) / sizeof(*counter_names) == static_cast<uint32_t>(Counter::N_COUNTERS));
+
+  static uint64_t cpu_time_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  static long peak_rss_kb() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+  }
+
+  void enable() {
+    enabled = true;
+    start_time = std::chrono::steady_clock::now();
+  }
+
+  void count_node(const char* kind) {
+    if (!enabled || !counting_nodes) return;
+    increment(Counter::AST_NODES);
+    node_counts[kind]++;
+  }
+
+  void stop_counting_nodes() {
+    counting_nodes = false;
+  }
+
+  void set(Counter counter, uint64_t value) {
+    if (enabled) counters[static_cast<uint32_t>(counter)] = value;
+  }
+
+  PhaseTimer::PhaseTimer(Phase _phase, bool _track_cpu) :
+    phase(_phase),
+    active(enabled),
+    track_cpu(_track_cpu),
+    cpu_start_ns(0),
+    child_wall_ns(0),
+    child_cpu_ns(0),
+    parent(nullptr) {
+    if (!active) return;
+    parent = current_timer;
+    current_timer = this;
+    if (track_cpu) cpu_start_ns = cpu_time_ns();
+    wall_start = clock::now();
+  }
+
+  PhaseTimer::~PhaseTimer() {
+    if (!active) return;
+    uint64_t wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - wall_start).count();
+    uint64_t cpu_ns = track_cpu ? cpu_time_ns() - cpu_start_ns : 0;
+
+    PhaseData& data = phases[static_cast<uint32_t>(phase)];
+    data.runs++;
+    data.wall_ns += wall_ns - std::min(wall_ns, child_wall_ns);
+    if (track_cpu) {
+      data.has_cpu = true;
+      data.cpu_ns += cpu_ns - std::min(cpu_ns, child_cpu_ns);
+      // getrusage is a syscall as well, so only sample it with the CPU clock
+      data.peak_rss_kb = std::max(data.peak_rss_kb, peak_rss_kb());
+    }
+
+    if (parent) {
+      parent->child_wall_ns += wall_ns;
+      parent->child_cpu_ns += cpu_ns;
+    }
+    current_timer = parent;
+  }
+
+  static void print_ms(std::ostream& out, uint64_t ns) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.3f", ns / 1e6);
+    out << buffer;
+  }
+
+  static void print_json_str(std::ostream& out, const std::string& str) {
+    out << '"';
+    for (char c : str) {
+      if (c == '"' || c == '\\') out << '\\' << c;
+      else if (static_cast<unsigned char>(c) < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        out << buffer;
+      } else out << c;
+    }
+    out << '"';
+  }
+
+  void report_json(std::ostream& out, const std::string& filename) {
+    uint64_t total_wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_time).count();
+
+    out << "{\n  \"file\": ";
+    print_json_str(out, filename);
+    out << ",\n  \"phases\": {\n";
+    for (uint32_t i = 0; i < static_cast<uint32_t>(Phase::N_PHASES); i++) {
+      const PhaseData& data = phases[i];
+      out << "    \"" << phase_names[i] << "\": {\"runs\": " << data.runs << ", \"wall_ms\": ";
+      print_ms(out, data.wall_ns);
+      out << ", \"cpu_ms\": ";
+      if (data.has_cpu) print_ms(out, data.cpu_ns);
+      else out << "null";
+      out << ", \"peak_rss_kb\": ";
+      if (data.has_cpu) out << data.peak_rss_kb;
+      else out << "null";
+      out << "}" << (i + 1 < static_cast<uint32_t>(Phase::N_PHASES) ? "," : "") << "\n";
+    }
+
+    out << "  },\n  \"counters\": {\n";
+    for (uint32_t i = 0; i < static_cast<uint32_t>(Counter::N_COUNTERS); i++) {
+      out << "    \"" << counter_names[i] << "\": " << counters[i] << ",\n";
+    }
+    out << "    \"ast_nodes_by_kind\": {";
+    for (auto it = node_counts.begin(); it != node_counts.end(); it++) {
+      out << (it == node_counts.begin() ? "" : ", ") << "\"" << it->first << "\": " << it->second;
+    }
+    out << "}\n  },\n  \"total\": {\"wall_ms\": ";
+    print_ms(out, total_wall_ns);
+    out << ", \"cpu_ms\": ";
+    print_ms(out, cpu_time_ns());
+    out << ", \"peak_rss_kb\": " << peak_rss_kb() << "}\n}" << std::endl;
+  }
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <sysexits.h>
+#include "client.h"
+
+// Same as vladpiler --connect, without loading LLVM: starts in about as long
+// as it takes the server to fork
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <socket> [vladpiler arguments]\n", argv[0]);
+    return EX_USAGE;
+  }
+  return client_compile(argv[1], argc - 2, argv + 2);
+}
@@ -0,0 +1,155 @@
+#include "watch.h"
+#include "analysis.h"
+#include "backend.h"
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Watch {
+
+  // Top-level bindings of the last build that succeeded, by key and hash.
+  // Builds are forks, so they see it as it was when they started.
+  static std::vector<std::pair<std::string, uint64_t>> last_build;
+
+  // The build writes the bindings it found here, one "key hash" per line
+  static int bindings_pipe[2] = {-1, -1};
+
+  [[noreturn]] static void fail(const std::string& msg) {
+    std::cerr << "Error: " << msg << ": " << strerror(errno) << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  static void join(std::ostream& out, const char* label, const std::vector<std::string>& keys) {
+    if (keys.empty()) return;
+    out << label;
+    for (size_t i = 0; i < keys.size(); i++) out << (i ? ", " : " ") << keys[i];
+    out << std::endl;
+  }
+
+  bool changed(AST::Term* program) {
+    std::vector<Analysis::TopLevelBinding> bindings = Analysis::top_level_bindings(program);
+    std::string report;
+    for (const Analysis::TopLevelBinding& binding : bindings) report += binding.key + ' ' + std::to_string(binding.hash) + '\n';
+    for (size_t written = 0; written < report.size();) {
+      ssize_t n = write(bindings_pipe[1], report.data() + written, report.size() - written);
+      if (n < 0 && errno != EINTR) break;
+      if (n > 0) written += n;
+    }
+    close(bindings_pipe[1]);
+    if (last_build.empty()) return true;
+
+    std::map<std::string, uint64_t> previous(last_build.begin(), last_build.end());
+    std::vector<bool> affected(bindings.size());
+    std::vector<std::string> changed_keys, dependent_keys, removed_keys;
+    bool reordered = bindings.size() != last_build.size();
+    for (size_t i = 0; i < bindings.size(); i++) {
+      const Analysis::TopLevelBinding& binding = bindings[i];
+      auto it = previous.find(binding.key);
+      bool is_changed = it == previous.end() || it->second != binding.hash;
+      if (it != previous.end()) previous.erase(it);
+      reordered |= i < last_build.size() && last_build[i].first != binding.key;
+
+      bool uses_changed = false;
+      for (size_t used : binding.uses) uses_changed |= affected[used];
+      affected[i] = is_changed || uses_changed;
+      if (is_changed) changed_keys.push_back(binding.key);
+      else if (uses_changed) dependent_keys.push_back(binding.key);
+    }
+    for (const auto& [key, hash] : previous) removed_keys.push_back(key);
+
+    if (changed_keys.empty() && removed_keys.empty()) {
+      if (!reordered) {
+        std::cerr << "No changes since the last build" << std::endl;
+        return false;
+      }
+      std::cerr << "Top-level bindings were reordered" << std::endl;
+    }
+    join(std::cerr, "Changed:", changed_keys);
+    join(std::cerr, "Removed:", removed_keys);
+    join(std::cerr, "Using them:", dependent_keys);
+    return true;
+  }
+
+  static void build_once(const std::string& source, const Build& build) {
+    if (pipe2(bindings_pipe, O_CLOEXEC) != 0) fail("could not create a pipe");
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) fail("could not fork a build");
+    if (pid == 0) {
+      close(bindings_pipe[0]);
+      int status = build();
+      std::cout.flush();
+      fflush(nullptr);
+      _exit(status);
+    }
+
+    close(bindings_pipe[1]);
+    std::string report;
+    char buf[4096];
+    for (ssize_t n; (n = read(bindings_pipe[0], buf, sizeof(buf))) != 0;) {
+      if (n > 0) report.append(buf, n);
+      else if (errno != EINTR) break;
+    }
+    close(bindings_pipe[0]);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    if (ok && !report.empty()) {
+      last_build.clear();
+      std::istringstream lines(report);
+      std::string key;
+      uint64_t hash;
+      while (lines >> key >> hash) last_build.push_back({key, hash});
+    }
+    std::cerr << (ok ? "Built " : "Failed to build ") << source << " in " << ms << "ms" << std::endl;
+  }
+
+  // Blocks until name is written or replaced in the watched directory.
+  // Events that come right after it (a save can be several) go with it.
+  static void wait_for_change(int notify, const std::string& name) {
+    bool seen = false;
+    for (;;) {
+      pollfd polled = {notify, POLLIN, 0};
+      int ready = poll(&polled, 1, seen ? 20 : -1);
+      if (ready < 0) {
+        if (errno == EINTR) continue;
+        fail("poll failed");
+      }
+      if (ready == 0) return;
+
+      alignas(inotify_event) char buf[4096];
+      ssize_t n = read(notify, buf, sizeof(buf));
+      for (ssize_t offset = 0; offset < n;) {
+        const inotify_event* event = reinterpret_cast<const inotify_event*>(buf + offset);
+        if (event->mask & IN_Q_OVERFLOW || (event->len && name == event->name)) seen = true;
+        offset += sizeof(inotify_event) + event->len;
+      }
+    }
+  }
+
+  void watch(const std::string& source, const Build& build) {
+    std::filesystem::path path(source);
+    std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+    std::string name = path.filename().string();
+
+    int notify = inotify_init1(IN_CLOEXEC);
+    if (notify < 0) fail("could not start watching files");
+    if (inotify_add_watch(notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) fail("could not watch " + dir);
+
+    // Whatever every build would otherwise set up again
+    Backend::initialize();
+
+    build_once(source, build);
+    for (;;) {
+      wait_for_change(notify, name);
+      build_once(source, build);
+    }
+  }
+}